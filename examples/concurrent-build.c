@@ -0,0 +1,136 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <libcork/core.h>
+#include <ipset/ipset.h>
+#include <ipset/bdd/nodes.h>
+
+
+struct worker {
+    pthread_t  thread;
+    struct ip_set  set;
+    long  first;
+    long  count;
+};
+
+/* Every run adds the same elements, no matter how many threads it
+ * uses, so that the timings are comparable. */
+static void
+element_ip(struct cork_ipv4 *ip, long index)
+{
+    uint32_t  value = (uint32_t) index * 2654435761u;
+    value = CORK_UINT32_HOST_TO_BIG(value);
+    cork_ipv4_copy(ip, &value);
+}
+
+static void *
+worker_run(void *user_data)
+{
+    struct worker  *worker = user_data;
+    long  i;
+
+    for (i = 0; i < worker->count; i++) {
+        struct cork_ipv4  ip;
+        element_ip(&ip, worker->first + i);
+        ipset_ipv4_add(&worker->set, &ip);
+    }
+    return NULL;
+}
+
+static double
+now(void)
+{
+    struct timespec  ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+static double
+one_test(long num_threads, long num_elements)
+{
+    struct ipset_node_cache  *cache = ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_CONCURRENT);
+    struct worker  *workers = cork_calloc(num_threads, sizeof(struct worker));
+    long  i;
+    double  start, end;
+
+    start = now();
+    for (i = 0; i < num_threads; i++) {
+        ipset_init_in_cache(&workers[i].set, cache);
+        workers[i].first = num_elements * i / num_threads;
+        workers[i].count = num_elements * (i + 1) / num_threads -
+            workers[i].first;
+        if (pthread_create(&workers[i].thread, NULL,
+                           worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "Cannot start thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    /* Merge the per-thread sets into the first one. */
+    for (i = 1; i < num_threads; i++) {
+        ipset_union(&workers[0].set, &workers[i].set);
+        ipset_done(&workers[i].set);
+    }
+    end = now();
+
+    ipset_done(&workers[0].set);
+    free(workers);
+    ipset_node_cache_free(cache);
+    return end - start;
+}
+
+
+int
+main(int argc, const char **argv)
+{
+    long  max_threads;
+    long  num_elements;
+    long  i;
+    double  baseline = 0.0;
+
+    if (argc != 3) {
+        fprintf(stderr,
+                "Usage: concurrent-build [max # threads] [# elements]\n");
+        return -1;
+    }
+
+    max_threads = atol(argv[1]);
+    num_elements = atol(argv[2]);
+    if (max_threads < 1 || num_elements < 1) {
+        fprintf(stderr, "Thread and element counts must be positive.\n");
+        return -1;
+    }
+
+    fprintf(stderr, "Building a set with %ld elements using 1-%ld threads.\n",
+            num_elements, max_threads);
+
+    ipset_init_library();
+
+    fprintf(stdout, "%8s%18s%10s\n", "threads", "wall_time", "speedup");
+    for (i = 1; i <= max_threads; i++) {
+        double  elapsed = one_test(i, num_elements);
+        if (i == 1) {
+            baseline = elapsed;
+        }
+        fprintf(stdout, "%8ld%18.6lf%10.2lf\n", i, elapsed, baseline / elapsed);
+    }
+
+    return 0;
+}
@@ -11,11 +11,14 @@
 #define IPSET_BDD_NODES_H
 
 
+#include <limits.h>
 #include <stdio.h>
 
 #include <libcork/core.h>
 #include <libcork/ds.h>
 
+#include <ipset/config.h>
+
 
 /*-----------------------------------------------------------------------
  * Preliminaries
@@ -38,10 +41,11 @@ typedef unsigned int  ipset_value;
 /**
  * An identifier for each distinct node in a BDD.
  *
- * Internal implementation note.  Since pointers are aligned to at
- * least two bytes, the ID of a terminal node has its LSB set to 1,
- * and has the terminal value stored in the remaining bits.  The ID of
- * a nonterminal node is simply a pointer to the node struct.
+ * Internal implementation note.  The ID of a terminal node has its LSB
+ * set to 1, and has the terminal value stored in the remaining bits.
+ * The ID of a nonterminal node has its LSB set to 0; the next bit is
+ * the complement bit (see below), and the remaining bits are the
+ * node's index in its node cache.
  */
 typedef unsigned int  ipset_node_id;
 
@@ -62,8 +66,10 @@ enum ipset_node_type {
 
 #define IPSET_NODE_ID_FORMAT  "%s%u"
 #define IPSET_NODE_ID_VALUES(node_id) \
-    (ipset_node_get_type((node_id)) == IPSET_NONTERMINAL_NODE? "s": ""), \
-    ((node_id) >> 1)
+    (ipset_node_get_type((node_id)) == IPSET_TERMINAL_NODE? "": \
+     ((node_id) & IPSET_COMPLEMENT_BIT)? "~s": "s"), \
+    (ipset_node_get_type((node_id)) == IPSET_TERMINAL_NODE? \
+     (node_id) >> 1: (node_id) >> 2)
 
 
 /*-----------------------------------------------------------------------
@@ -96,11 +102,50 @@ enum ipset_node_type {
  * true or 1.
  *
  * This type does not take care of ensuring that all BDD nodes are
- * reduced; that is handled by the node_cache class.
+ * reduced; that is handled by the node_cache class.  The node's
+ * reference count is stored separately by the node cache, so that
+ * evaluating a BDD doesn't have to pull reference counts into the CPU
+ * cache.
+ *
+ * You should use the ipset_node_variable, ipset_node_low, and
+ * ipset_node_high macros to access the contents of a node, since its
+ * layout depends on whether the library was built with
+ * IPSET_COMPACT_NODES.
  */
+
+#if IPSET_COMPACT_NODES
+
+/* In the compact layout, each node fits in 8 bytes.  Node IDs are
+ * limited to 28 bits, and the 8-bit variable index is split across the
+ * top 4 bits of the low and high pointers.  That limits each node cache
+ * to 2^26 nonterminals, and each terminal value to less than 2^27. */
+
+struct ipset_node {
+    /** The low subtree, and the top half of the variable index. */
+    uint32_t  low_bits;
+    /** The high subtree, and the bottom half of the variable index. */
+    uint32_t  high_bits;
+};
+
+#define IPSET_NODE_ID_BITS  28
+#define IPSET_NODE_ID_MASK  ((1u << IPSET_NODE_ID_BITS) - 1)
+#define IPSET_MAX_NODE_ID  IPSET_NODE_ID_MASK
+
+#define ipset_node_variable(node) \
+    ((((node)->low_bits >> IPSET_NODE_ID_BITS) << 4) | \
+     ((node)->high_bits >> IPSET_NODE_ID_BITS))
+#define ipset_node_low(node)  ((node)->low_bits & IPSET_NODE_ID_MASK)
+#define ipset_node_high(node)  ((node)->high_bits & IPSET_NODE_ID_MASK)
+
+#define ipset_node_set(node, var, lo, hi) \
+    do { \
+        (node)->low_bits = (lo) | (((var) >> 4) << IPSET_NODE_ID_BITS); \
+        (node)->high_bits = (hi) | (((var) & 0x0f) << IPSET_NODE_ID_BITS); \
+    } while (0)
+
+#else
+
 struct ipset_node {
-    /** The reference count for this node. */
-    unsigned int  refcount;
     /** The variable that this node represents. */
     ipset_variable  variable;
     /** The subtree node for when the variable is false. */
@@ -109,18 +154,91 @@ struct ipset_node {
     ipset_node_id  high;
 };
 
+#define IPSET_MAX_NODE_ID  UINT_MAX
+
+#define ipset_node_variable(node)  ((node)->variable)
+#define ipset_node_low(node)  ((node)->low)
+#define ipset_node_high(node)  ((node)->high)
+
+#define ipset_node_set(node, var, lo, hi) \
+    do { \
+        (node)->variable = (var); \
+        (node)->low = (lo); \
+        (node)->high = (hi); \
+    } while (0)
+
+#endif
+
+/**
+ * The largest value that a terminal node can hold.  Terminal values
+ * are always nonnegative, since the public API takes them as ints.
+ */
+#define IPSET_MAX_TERMINAL_VALUE  ((IPSET_MAX_NODE_ID >> 1) & INT_MAX)
+
+/**
+ * Return whether an int can be stored as the value of a terminal node.
+ */
+#define ipset_terminal_value_fits(value) \
+    ((value) >= 0 && (unsigned int) (value) <= IPSET_MAX_TERMINAL_VALUE)
+
 /**
  * Return the "value" of a nonterminal node.  The value of a nonterminal
  * is the index into the node array of the cache that the node belongs
  * to.
  */
-#define ipset_nonterminal_value(node_id) ((node_id) >> 1)
+#define ipset_nonterminal_value(node_id) ((node_id) >> 2)
 
 /**
  * Creates a nonterminal node ID from a nonterminal value.
  */
 #define ipset_nonterminal_node_id(value) \
-    (((value) << 1) | IPSET_NONTERMINAL_NODE)
+    (((value) << 2) | IPSET_NONTERMINAL_NODE)
+
+
+/*-----------------------------------------------------------------------
+ * Complement edges
+ */
+
+/**
+ * In a BDD whose terminals are all 0 or 1, a nonterminal ID can have
+ * its complement bit set, which means that it stands for the negation
+ * of the function of the node that it points to.  The IDs of the 0 and
+ * 1 terminals differ in that same bit, so XORing it into any node ID
+ * negates the function that the ID stands for.
+ *
+ * Only node caches created with IPSET_NODE_CACHE_COMPLEMENT_EDGES ever
+ * hand out complemented IDs, but the rest of the library handles them
+ * everywhere, by applying the complement bit of an edge to the
+ * children of the node that it points to.  In any other BDD, that
+ * bit is always clear, and this is a no-op.
+ */
+#define IPSET_COMPLEMENT_BIT  0x02
+
+/**
+ * Return whether a nonterminal node ID is complemented.
+ */
+#define ipset_node_is_complemented(node_id) \
+    (((node_id) & IPSET_COMPLEMENT_BIT) != 0)
+
+/**
+ * Return a nonterminal node ID with its complement bit cleared.
+ */
+#define ipset_node_regular(node_id)  ((node_id) & ~IPSET_COMPLEMENT_BIT)
+
+/**
+ * Return the negation of a node ID.  The node must be a nonterminal,
+ * or a terminal whose value is 0 or 1.
+ */
+#define ipset_node_complement(node_id)  ((node_id) ^ IPSET_COMPLEMENT_BIT)
+
+/**
+ * Return the low and high subtrees of the function that a nonterminal
+ * node ID stands for.  node must be the node that node_id points to.
+ */
+#define ipset_edge_low(node_id, node) \
+    (ipset_node_low((node)) ^ ((node_id) & IPSET_COMPLEMENT_BIT))
+#define ipset_edge_high(node_id, node) \
+    (ipset_node_high((node)) ^ ((node_id) & IPSET_COMPLEMENT_BIT))
 
 /**
  * Print out a node object.
@@ -134,12 +252,113 @@ ipset_node_fprint(FILE *stream, struct ipset_node *node);
  */
 
 /**
- * The log2 of the size of each chunk of BDD nodes.
+ * The default log2 of the size of each chunk of BDD nodes.  Each node
+ * cache can choose its own chunk size when it's created.
  */
-/* 16K elements per cache */
+/* 64 elements per chunk */
 #define IPSET_BDD_NODE_CACHE_BIT_SIZE  6
-#define IPSET_BDD_NODE_CACHE_SIZE  (1 << IPSET_BDD_NODE_CACHE_BIT_SIZE)
-#define IPSET_BDD_NODE_CACHE_MASK  (IPSET_BDD_NODE_CACHE_SIZE - 1)
+#define IPSET_BDD_NODE_CACHE_MAX_BIT_SIZE  24
+
+/**
+ * Flags that control how a node cache allocates its storage.
+ */
+/* Allocate chunks that fill at least a huge page with mmap, and ask the
+ * kernel to back them with transparent huge pages. */
+#define IPSET_NODE_CACHE_HUGE_PAGES  0x01
+/* Don't free nodes as soon as their reference count reaches 0.  Dead
+ * nodes stay in the unique table, where they can be resurrected, until
+ * the next garbage collection. */
+#define IPSET_NODE_CACHE_DEFERRED_GC  0x02
+/* Allow several threads to create nodes in the cache at the same time.
+ * This implies IPSET_NODE_CACHE_DEFERRED_GC, and garbage collections
+ * only happen when you explicitly ask for one. */
+#define IPSET_NODE_CACHE_CONCURRENT  0x04
+/* Every BDD in the cache is a set, whose terminals are all 0 or 1, so
+ * we can use complement edges.  A node and its negation share storage,
+ * and negating a BDD takes constant time.  Maps can't use these
+ * caches. */
+#define IPSET_NODE_CACHE_COMPLEMENT_EDGES  0x08
+
+/**
+ * The default number of dead nodes that trigger a garbage collection
+ * in a cache that uses IPSET_NODE_CACHE_DEFERRED_GC.
+ */
+#define IPSET_NODE_CACHE_DEFAULT_GC_THRESHOLD  16384
+
+/**
+ * The log2 of the initial number of slots in a node cache's unique
+ * table.
+ */
+#define IPSET_UNIQUE_TABLE_MIN_BIT_SIZE  6
+
+/**
+ * The log2 of the number of shards that the unique table of a
+ * concurrent node cache is split into.  Each shard has its own lock.
+ * Other caches use a single shard.
+ */
+#define IPSET_UNIQUE_TABLE_SHARD_BITS  6
+
+/**
+ * The smallest log2 chunk size for a concurrent node cache.  We
+ * allocate the array of chunk pointers up front for concurrent caches,
+ * so that it never moves while other threads are reading it, and this
+ * keeps that array small.
+ */
+#define IPSET_CONCURRENT_MIN_CHUNK_BIT_SIZE  16
+
+/**
+ * The number of node indices that each thread claims at a time from a
+ * concurrent node cache.
+ */
+#define IPSET_NODE_CACHE_SLAB_SIZE  256
+
+/**
+ * A slot in the unique table of a node cache.  The table uses open
+ * addressing with linear probing; we store each node's hash alongside
+ * its index so that we only have to look at the node itself when the
+ * hashes match, and so that we can resize the table without looking at
+ * the nodes at all.
+ */
+struct ipset_unique_slot {
+    /** The hash of the node's contents. */
+    cork_hash  hash;
+    /** The index of the node, or -1 if the slot is empty. */
+    ipset_value  index;
+};
+
+/**
+ * One shard of the unique table.  A node's shard is chosen by the high
+ * bits of its hash, and its slot within the shard by the low bits.
+ */
+struct ipset_unique_shard {
+    /** The slots in this shard. */
+    struct ipset_unique_slot  *slots;
+    /** The number of slots.  Always a power of two. */
+    size_t  size;
+    /** The number of nodes in this shard. */
+    size_t  count;
+    /** A spin lock, which is only used by concurrent caches. */
+    volatile unsigned int  lock;
+};
+
+/**
+ * The log2 of the smallest and largest number of entries in a node
+ * cache's operation cache.
+ */
+#define IPSET_OP_CACHE_MIN_BIT_SIZE  10
+#define IPSET_OP_CACHE_MAX_BIT_SIZE  22
+
+/**
+ * An entry in the operation cache, which records the result of
+ * applying an operator to a pair of nodes.  An entry is only valid if
+ * its epoch matches the current epoch of the cache.
+ */
+struct ipset_op_cache_entry {
+    ipset_node_id  lhs;
+    ipset_node_id  rhs;
+    ipset_node_id  result;
+    unsigned int  epoch;
+};
 
 /**
  * A cache for BDD nodes.  By creating and retrieving nodes through
@@ -148,32 +367,85 @@ ipset_node_fprint(FILE *stream, struct ipset_node *node);
 struct ipset_node_cache {
     /** The storage for the nodes managed by this cache. */
     cork_array(struct ipset_node *)  chunks;
+    /** The reference counts of the nodes, in chunks that parallel the
+     * node chunks. */
+    cork_array(unsigned int *)  refcount_chunks;
+    /** The log2 of the number of nodes in each chunk. */
+    unsigned int  chunk_bit_size;
+    /** The number of nodes in each chunk, minus 1. */
+    ipset_value  chunk_mask;
+    /** Flags that control how we allocate chunks. */
+    unsigned int  flags;
     /** The largest nonterminal index that has been handed out. */
     ipset_value  largest_index;
     /** The index of the first node in the free list. */
     ipset_value  free_list;
-    /** A cache of the nonterminal nodes, keyed by their contents. */
-    struct cork_hash_table  *node_cache;
+    /** A table of the nonterminal nodes, keyed by their contents. */
+    struct ipset_unique_shard  *unique_table;
+    /** The number of shards in the unique table, minus 1. */
+    unsigned int  unique_table_shard_mask;
+    /** The number of nodes in the unique table. */
+    size_t  unique_table_count;
+    /** Protects the free list and the chunk array in a concurrent
+     * cache. */
+    volatile unsigned int  alloc_lock;
+    /** Identifies this cache (and its current numbering of nodes) to
+     * the per-thread allocation slabs of a concurrent cache. */
+    size_t  alloc_id;
+    /** A lossy cache of the results of the current APPLY.  Each APPLY
+     * gets a new epoch, which invalidates all of the existing
+     * entries. */
+    struct ipset_op_cache_entry  *op_cache;
+    /** The number of entries in the operation cache. */
+    size_t  op_cache_size;
+    /** The epoch of the current APPLY. */
+    unsigned int  op_cache_epoch;
+    /** The number of operation cache lookups that found a result. */
+    size_t  op_cache_hits;
+    /** The number of operation cache lookups that didn't. */
+    size_t  op_cache_misses;
+    /** The number of nodes whose reference count is 0, but which
+     * haven't been garbage collected yet. */
+    size_t  dead_count;
+    /** The number of dead nodes that triggers a garbage collection. */
+    size_t  gc_threshold;
+    /** The number of garbage collections that have run. */
+    size_t  gc_runs;
+    /** The number of nodes reclaimed by the most recent garbage
+     * collection. */
+    size_t  gc_last_reclaimed;
+    /** The number of nodes reclaimed by all garbage collections. */
+    size_t  gc_total_reclaimed;
 };
 
 /**
  * Returns the index of the chunk that the given nonterminal lives in.
  */
-#define ipset_nonterminal_chunk_index(index) \
-    ((index) >> IPSET_BDD_NODE_CACHE_BIT_SIZE)
+#define ipset_nonterminal_chunk_index(cache, index) \
+    ((index) >> (cache)->chunk_bit_size)
 
 /**
  * Returns the offset of the given nonterminal within its chunk.
  */
-#define ipset_nonterminal_chunk_offset(index) \
-    ((index) & IPSET_BDD_NODE_CACHE_MASK)
+#define ipset_nonterminal_chunk_offset(cache, index) \
+    ((index) & (cache)->chunk_mask)
 
 /**
  * Returns a pointer to the ipset_node for a given nonterminal index.
  */
 #define ipset_node_cache_get_nonterminal_by_index(cache, index) \
-    (&cork_array_at(&(cache)->chunks, ipset_nonterminal_chunk_index((index))) \
-     [ipset_nonterminal_chunk_offset((index))])
+    (&cork_array_at(&(cache)->chunks, \
+                    ipset_nonterminal_chunk_index((cache), (index))) \
+     [ipset_nonterminal_chunk_offset((cache), (index))])
+
+/**
+ * Returns a pointer to the reference count for a given nonterminal
+ * index.
+ */
+#define ipset_node_cache_get_refcount_by_index(cache, index) \
+    (&cork_array_at(&(cache)->refcount_chunks, \
+                    ipset_nonterminal_chunk_index((cache), (index))) \
+     [ipset_nonterminal_chunk_offset((cache), (index))])
 
 /**
  * Returns the ipset_node for a given nonterminal node ID.
@@ -182,12 +454,100 @@ struct ipset_node_cache {
     (ipset_node_cache_get_nonterminal_by_index \
      ((cache), ipset_nonterminal_value((node_id))))
 
+/**
+ * Start loading a node into the CPU cache, since we're going to need
+ * it soon.
+ */
+#if defined(__GNUC__)
+#define ipset_node_prefetch(node)  __builtin_prefetch((node))
+#else
+#define ipset_node_prefetch(node)  ((void) (node))
+#endif
+
 /**
  * Create a new node cache.
  */
 struct ipset_node_cache *
 ipset_node_cache_new(void);
 
+/**
+ * Create a new node cache that allocates nodes in chunks of
+ * 2^chunk_bit_size nodes.  flags can include
+ * IPSET_NODE_CACHE_HUGE_PAGES, IPSET_NODE_CACHE_DEFERRED_GC,
+ * IPSET_NODE_CACHE_CONCURRENT, and IPSET_NODE_CACHE_COMPLEMENT_EDGES.
+ *
+ * In a concurrent cache, any number of threads can create nodes, and
+ * add and remove references to them, at the same time.  Each thread
+ * claims node indices from the cache in slabs, and the unique table is
+ * split into shards with their own locks.  Anything that renumbers or
+ * frees nodes (ipset_node_cache_gc, ipset_node_cache_compact,
+ * ipset_node_cache_reserve, and freeing the cache) can only be called
+ * while no other thread is using the cache.
+ */
+struct ipset_node_cache *
+ipset_node_cache_new_sized(unsigned int chunk_bit_size, unsigned int flags);
+
+/**
+ * Preallocate enough storage for the cache to hold node_count more
+ * nonterminals without allocating any more memory.
+ */
+void
+ipset_node_cache_reserve(struct ipset_node_cache *cache, size_t node_count);
+
+/**
+ * Set the number of dead nodes that triggers a garbage collection.
+ * This only has an effect for caches that were created with
+ * IPSET_NODE_CACHE_DEFERRED_GC, and not IPSET_NODE_CACHE_CONCURRENT.
+ * We only check the threshold when starting an insert or APPLY, since
+ * those are the points where no intermediate results are in flight.
+ */
+void
+ipset_node_cache_set_gc_threshold(struct ipset_node_cache *cache,
+                                  size_t threshold);
+
+/**
+ * Reclaim the storage for all of the dead nodes in a cache, returning
+ * the number of nodes that were reclaimed.  For a cache that doesn't
+ * use IPSET_NODE_CACHE_DEFERRED_GC, there are never any dead nodes, so
+ * this is a no-op.
+ */
+size_t
+ipset_node_cache_gc(struct ipset_node_cache *cache);
+
+/**
+ * Run a garbage collection if there are enough dead nodes in a cache.
+ * Concurrent caches only collect garbage when asked to, so we don't
+ * look at their dead node count, which other threads might be updating.
+ */
+#define ipset_node_cache_maybe_gc(cache) \
+    do { \
+        if (CORK_UNLIKELY(!((cache)->flags & IPSET_NODE_CACHE_CONCURRENT) && \
+                          (cache)->dead_count >= (cache)->gc_threshold)) { \
+            ipset_node_cache_gc((cache)); \
+        } \
+    } while (0)
+
+/**
+ * Return the number of node indices that a cache has handed out so far,
+ * which is an upper bound on the number of nonterminal nodes in it.
+ * This is safe to call while other threads are using a concurrent
+ * cache, though of course the answer might be stale by the time you
+ * look at it.
+ */
+size_t
+ipset_node_cache_index_count(const struct ipset_node_cache *cache);
+
+/**
+ * Renumber the live nodes in a cache so that they're stored densely,
+ * in level order, and free any storage that's no longer needed.  This
+ * changes the IDs of nonterminal nodes, so you must pass in a pointer
+ * to every root node that you hold from this cache; we'll update each
+ * of them with its new ID.
+ */
+void
+ipset_node_cache_compact(struct ipset_node_cache *cache,
+                         ipset_node_id **roots, size_t root_count);
+
 /**
  * Free a node cache.
  */
@@ -217,7 +577,8 @@ ipset_node_incref(struct ipset_node_cache *cache, ipset_node_id node);
 /**
  * Decrement the reference count of a nonterminal node.  If the
  * reference count reaches 0, the storage for the node will be
- * reclaimed.  (This is a no-op for terminal nodes.)
+ * reclaimed, either immediately or during the next garbage collection.
+ * (This is a no-op for terminal nodes.)
  */
 void
 ipset_node_decref(struct ipset_node_cache *cache, ipset_node_id node);
@@ -234,7 +595,8 @@ ipset_node_reachable_count(const struct ipset_node_cache *cache,
 
 
 /**
- * Return the amount of memory used by the nodes in the given BDD.
+ * Return the amount of memory used by the nodes in the given BDD,
+ * including their reference counts.
  */
 size_t
 ipset_node_memory_size(const struct ipset_node_cache *cache,
@@ -248,6 +610,14 @@ ipset_node_memory_size(const struct ipset_node_cache *cache,
 ipset_node_id
 ipset_node_cache_load(FILE *stream, struct ipset_node_cache *cache);
 
+/**
+ * Load a BDD from a buffer that holds exactly one serialized BDD, in
+ * any of the formats that ipset_node_cache_load can read.
+ */
+ipset_node_id
+ipset_node_cache_load_from_buffer(const void *buf, size_t size,
+                                  struct ipset_node_cache *cache);
+
 
 /**
  * Save a BDD to an output stream.  This encodes the set using only
@@ -257,6 +627,39 @@ int
 ipset_node_cache_save(struct cork_stream_consumer *stream,
                       struct ipset_node_cache *cache, ipset_node_id node);
 
+/**
+ * Save a BDD straight to a file descriptor, bypassing stdio.  The fd
+ * can be a file, pipe, or socket.
+ */
+int
+ipset_node_cache_save_fd(int fd, struct ipset_node_cache *cache,
+                         ipset_node_id node);
+
+/**
+ * Flags that control how a BDD is saved.  By default we use the v1
+ * file format.  IPSET_SAVE_COMPACT uses the v3 format instead, which
+ * encodes each node using varints, and is usually several times
+ * smaller.
+ */
+#define IPSET_SAVE_COMPACT  0x01
+
+/**
+ * Save a BDD to an output stream, using the file format selected by
+ * flags.
+ */
+int
+ipset_node_cache_save_with_flags(struct cork_stream_consumer *stream,
+                                 struct ipset_node_cache *cache,
+                                 ipset_node_id node, unsigned int flags);
+
+/**
+ * Save a BDD straight to a file descriptor, using the file format
+ * selected by flags.
+ */
+int
+ipset_node_cache_save_fd_with_flags(int fd, struct ipset_node_cache *cache,
+                                    ipset_node_id node, unsigned int flags);
+
 
 /**
  * Compare two BDD nodes, possibly from different caches, for equality.
@@ -322,6 +725,374 @@ ipset_node_insert(struct ipset_node_cache *cache, ipset_node_id node,
                   const void *user_data, ipset_variable variable_count,
                   ipset_value value);
 
+/**
+ * A function that combines the terminal values of two BDDs into the
+ * terminal value of the result.
+ */
+typedef ipset_value
+(*ipset_binary_operator)(const void *user_data,
+                         ipset_value lhs, ipset_value rhs);
+
+/**
+ * Combine two BDDs using a binary operator.  The LHS must belong to
+ * cache; the RHS belongs to rhs_cache, which can be the same cache or a
+ * different one.  The result is created in cache, and the caller owns
+ * a reference to it.  Each pair of LHS and RHS nodes is only visited
+ * once, so this runs in O(|lhs| × |rhs|) time.
+ */
+ipset_node_id
+ipset_node_apply(struct ipset_node_cache *cache, ipset_node_id lhs,
+                 const struct ipset_node_cache *rhs_cache, ipset_node_id rhs,
+                 ipset_binary_operator op, const void *user_data);
+
+
+/*-----------------------------------------------------------------------
+ * Counting
+ */
+
+/**
+ * A 128-bit unsigned integer, which is large enough to count IPv6
+ * addresses.  Arithmetic on these saturates, so the one count that
+ * doesn't fit (all 2^128 IPv6 addresses) comes out as 2^128-1.
+ */
+struct ipset_uint128 {
+    uint64_t  high;
+    uint64_t  low;
+};
+
+/**
+ * Return the number of assignments of variables 1 through var_count
+ * that the given BDD maps to value, with variable 0 (the discriminator
+ * for IP sets and maps) fixed to discriminator.  The BDD can't use any
+ * variables after var_count on that side of the discriminator.  This
+ * takes time proportional to the number of nodes in the BDD, no matter
+ * how large the count is.
+ */
+struct ipset_uint128
+ipset_node_count_value(const struct ipset_node_cache *cache,
+                       ipset_node_id node, ipset_value value,
+                       bool discriminator, ipset_variable var_count);
+
+/**
+ * Count the assignments that the given BDD maps to value, grouped by
+ * the values of some of the variables.  Variables 0 through prefix_var
+ * are fixed by the assignment function.  counts must have room for
+ * 2^(bucket_var - prefix_var) entries; entry i is the number of
+ * assignments where variables prefix_var+1 through bucket_var spell
+ * out i (most significant bit first), and variables bucket_var+1
+ * through var_count can be anything.  This takes time proportional to
+ * the number of entries plus the number of nodes below the prefix.
+ */
+void
+ipset_node_count_histogram(const struct ipset_node_cache *cache,
+                           ipset_node_id node, ipset_value value,
+                           ipset_assignment_func assignment,
+                           const void *user_data, ipset_variable prefix_var,
+                           ipset_variable bucket_var, ipset_variable var_count,
+                           struct ipset_uint128 *counts);
+
+
+/*-----------------------------------------------------------------------
+ * Frozen BDDs
+ */
+
+/**
+ * A read-only copy of a BDD, which doesn't depend on the node cache
+ * that it was created from.  The nonterminal nodes are stored in a
+ * single contiguous array, in breadth-first order, so that the nodes
+ * near the root (which every lookup visits) are close together.  Node
+ * IDs use the same encoding as in a node cache, except that the value
+ * of a nonterminal ID is its index in the nodes array.
+ */
+struct ipset_frozen {
+    /** The nonterminal nodes of the BDD, in breadth-first order. */
+    struct ipset_node  *nodes;
+    /** The number of nonterminal nodes. */
+    size_t  node_count;
+    /** The root node of the BDD. */
+    ipset_node_id  root;
+};
+
+/**
+ * Returns the ipset_node for a given nonterminal node ID in a frozen
+ * BDD.
+ */
+#define ipset_frozen_get_nonterminal(frozen, node_id) \
+    (&(frozen)->nodes[ipset_nonterminal_value((node_id))])
+
+/**
+ * Create a frozen copy of the BDD rooted at node.
+ */
+struct ipset_frozen *
+ipset_node_freeze(const struct ipset_node_cache *cache, ipset_node_id node);
+
+/**
+ * Free a frozen BDD.
+ */
+void
+ipset_frozen_free(struct ipset_frozen *frozen);
+
+/**
+ * Return the number of bytes used by a frozen BDD.
+ */
+size_t
+ipset_frozen_memory_size(const struct ipset_frozen *frozen);
+
+/**
+ * Evaluate a frozen BDD given a particular assignment of variables.
+ */
+ipset_value
+ipset_frozen_evaluate(const struct ipset_frozen *frozen,
+                      ipset_assignment_func assignment,
+                      const void *user_data);
+
+
+/*-----------------------------------------------------------------------
+ * Memory-mapped BDDs
+ */
+
+/**
+ * The v2 file format is a frozen BDD, stored exactly as it's laid out
+ * in memory, so that it can be mapped straight into a process's
+ * address space.  The nodes start after a fixed-size header.
+ */
+#define IPSET_V2_HEADER_SIZE  32
+
+/**
+ * Save a frozen BDD to an output stream, using the v2 file format.
+ */
+int
+ipset_frozen_save(struct cork_stream_consumer *stream,
+                  const struct ipset_frozen *frozen);
+
+/**
+ * Save a frozen BDD straight to a file descriptor, using the v2 file
+ * format.
+ */
+int
+ipset_frozen_save_fd(int fd, const struct ipset_frozen *frozen);
+
+/**
+ * A v2 file that's been mapped into memory.  frozen points into the
+ * mapped pages, and can be used with any of the frozen lookup
+ * functions, but must not be passed to ipset_frozen_free.
+ */
+struct ipset_mmap {
+    /** The BDD stored in the file. */
+    struct ipset_frozen  frozen;
+    /** The mapped pages. */
+    void  *base;
+    /** The size of the mapping. */
+    size_t  size;
+};
+
+/* Flags for ipset_mmap_open */
+
+/* Read the whole file into memory before returning. */
+#define IPSET_MMAP_POPULATE  0x01
+/* Start reading the file into memory in the background. */
+#define IPSET_MMAP_WILLNEED  0x02
+/* Don't read ahead when a lookup touches a page that isn't in memory
+ * yet.  Lookups jump around the file, so readahead is usually wasted
+ * effort. */
+#define IPSET_MMAP_RANDOM  0x04
+
+/**
+ * Map a v2 file into memory.  This only checks the file's header, so
+ * it takes constant time no matter how large the file is; pages are
+ * read in as lookups touch them, and are shared with any other process
+ * that maps the same file.  This only works on a little-endian machine
+ * whose node layout (see IPSET_COMPACT_NODES) matches the one that
+ * wrote the file; ipset_node_cache_load can read any v2 file.  The
+ * file must come from a trusted source, since the nodes aren't
+ * checked.  Returns NULL and fills in an error condition if the file
+ * can't be mapped.
+ */
+struct ipset_mmap *
+ipset_mmap_open(const char *path, unsigned int flags);
+
+/**
+ * Unmap a file that was mapped with ipset_mmap_open.
+ */
+void
+ipset_mmap_close(struct ipset_mmap *mapped);
+
+
+/*-----------------------------------------------------------------------
+ * Stride tables
+ */
+
+/**
+ * The number of variables covered by each level of a stride table.
+ * The first level covers variable 0 on its own, since that's the
+ * discriminator for IP sets and maps; the next covers the following
+ * IPSET_STRIDE_ROOT_BITS variables, and each level after that covers
+ * IPSET_STRIDE_BITS variables.  For an IPv4 address, that gives a
+ * 16-8-8 table.
+ */
+#define IPSET_STRIDE_ROOT_BITS  16
+#define IPSET_STRIDE_BITS  8
+
+/**
+ * A multibit trie that's equivalent to a BDD, which trades memory for
+ * fewer memory accesses per lookup.  Each level is a table with an
+ * entry for every combination of the variables that it covers.  The
+ * entries use the same encoding as node IDs: a terminal entry holds
+ * the BDD's result, and the value of a nonterminal entry is the offset
+ * of the table for the next level.
+ */
+struct ipset_stride_table {
+    /** The entries of all of the tables. */
+    ipset_node_id  *entries;
+    /** The total number of entries. */
+    size_t  entry_count;
+    /** A terminal, or the offset of the table for variable 0. */
+    ipset_node_id  root;
+};
+
+/**
+ * Compile the BDD rooted at node into a stride table.  Tables are
+ * shared the same way that the BDD's nodes are, but a table that
+ * covers a stride of n variables always has 2^n entries, so this can
+ * use much more memory than the BDD itself.
+ */
+struct ipset_stride_table *
+ipset_node_compile_strides(const struct ipset_node_cache *cache,
+                           ipset_node_id node);
+
+/**
+ * Free a stride table.
+ */
+void
+ipset_stride_table_free(struct ipset_stride_table *table);
+
+/**
+ * Return the number of bytes used by a stride table.
+ */
+size_t
+ipset_stride_table_memory_size(const struct ipset_stride_table *table);
+
+
+/*-----------------------------------------------------------------------
+ * Publishing frozen BDDs
+ */
+
+/**
+ * Lets one writer thread replace a frozen BDD while any number of
+ * reader threads query it, without the readers taking any locks.  The
+ * writer swaps in each new version atomically.  Old versions are
+ * reclaimed once every reader that might still be using them has
+ * finished its lookup, which we track using epochs: each reader
+ * records the global epoch when it starts a lookup, and a version
+ * retired during epoch e can be freed once no reader is still in an
+ * epoch before e+1.
+ */
+struct ipset_publisher;
+
+/** The size of a cache line, which reader slots are padded to. */
+#define IPSET_CACHE_LINE_SIZE  64
+
+/**
+ * A registered reader of a publisher.  Each reader thread should have
+ * its own.
+ */
+struct ipset_reader {
+    /** The epoch that the current lookup started in, or 0 if the
+     * reader isn't in the middle of a lookup. */
+    volatile size_t  epoch;
+    /** Whether this reader slot has been claimed. */
+    volatile size_t  in_use;
+    /** The publisher that this reader belongs to. */
+    struct ipset_publisher  *publisher;
+    /* Keep each reader on its own cache line, so that readers don't
+     * slow each other down. */
+    char  padding[IPSET_CACHE_LINE_SIZE -
+                  2 * sizeof(size_t) - sizeof(void *)];
+};
+
+/** A version that has been replaced, but might still have readers. */
+struct ipset_retired {
+    struct ipset_frozen  *frozen;
+    size_t  epoch;
+};
+
+struct ipset_publisher {
+    /** The version that new lookups will see. */
+    struct ipset_frozen * volatile  current;
+    /** The current global epoch.  Starts at 1. */
+    volatile size_t  epoch;
+    /** The reader slots. */
+    struct ipset_reader  *readers;
+    size_t  reader_count;
+    /** Replaced versions that haven't been reclaimed yet.  Only the
+     * writer touches this. */
+    cork_array(struct ipset_retired)  retired;
+};
+
+/**
+ * Create a new publisher with room for max_readers readers.  Until
+ * something is published, readers see a BDD that evaluates to 0 for
+ * every input.
+ */
+struct ipset_publisher *
+ipset_publisher_new(size_t max_readers);
+
+/**
+ * Free a publisher, along with its current version and any retired
+ * versions.  There must not be any readers in the middle of a lookup.
+ */
+void
+ipset_publisher_free(struct ipset_publisher *publisher);
+
+/**
+ * Replace the publisher's current version with frozen.  The publisher
+ * takes control of frozen.  The old version is retired, and we reclaim
+ * any retired versions that no reader can still be using.  Only one
+ * thread can publish at a time.
+ */
+void
+ipset_publisher_publish(struct ipset_publisher *publisher,
+                        struct ipset_frozen *frozen);
+
+/**
+ * Free any retired versions that no reader can still be using.
+ * Returns the number of versions that are still waiting to be freed.
+ */
+size_t
+ipset_publisher_reclaim(struct ipset_publisher *publisher);
+
+/**
+ * Wait until every retired version has been freed.
+ */
+void
+ipset_publisher_synchronize(struct ipset_publisher *publisher);
+
+/**
+ * Claim one of the publisher's reader slots.  Returns NULL and sets an
+ * error if they're all in use.
+ */
+struct ipset_reader *
+ipset_publisher_add_reader(struct ipset_publisher *publisher);
+
+/**
+ * Release a reader slot.
+ */
+void
+ipset_reader_free(struct ipset_reader *reader);
+
+/**
+ * Start a lookup, returning the current version.  The version remains
+ * valid until you call ipset_reader_leave.  Lookups can't be nested.
+ */
+const struct ipset_frozen *
+ipset_reader_enter(struct ipset_reader *reader);
+
+/**
+ * Finish a lookup.
+ */
+void
+ipset_reader_leave(struct ipset_reader *reader);
+
 
 /*-----------------------------------------------------------------------
  * Variable assignments
@@ -54,4 +54,53 @@
      | ((val)? IPSET_BIT_ON_MASK(i): 0))
 
 
+
+/*-----------------------------------------------------------------------
+ * Bit arrays as native words
+ */
+
+/**
+ * The number of 64-bit words needed to hold a bit array of the given
+ * size.
+ */
+#define IPSET_BIT_WORD_COUNT(bit_size)  (((bit_size) + 63) / 64)
+
+/**
+ * Load a bit array into native 64-bit words.  Bit 0 of the array ends
+ * up in the most significant bit of the first word, so that we can
+ * extract bits with shifts instead of byte arithmetic.  bit_size must
+ * be a multiple of 8.
+ */
+static inline void
+ipset_bits_load_words(uint64_t *words, const void *array,
+                      unsigned int bit_size)
+{
+    const uint8_t  *bytes = array;
+    unsigned int  i;
+    for (i = 0; i < IPSET_BIT_WORD_COUNT(bit_size); i++) {
+        words[i] = 0;
+    }
+    for (i = 0; i < bit_size / 8; i++) {
+        words[i / 8] |= ((uint64_t) bytes[i]) << (56 - 8 * (i % 8));
+    }
+}
+
+/**
+ * Return whether a particular bit is set in an array of words loaded
+ * by ipset_bits_load_words.  Bits are numbered from 0, in the same
+ * big-endian order as IPSET_BIT_GET.
+ */
+#define IPSET_BIT_WORDS_GET(words, i) \
+    ((((words)[(i) / 64] >> (63 - ((i) % 64))) & 1) != 0)
+
+/**
+ * Extract n consecutive bits, starting at bit i, from an array of words
+ * loaded by ipset_bits_load_words.  The bits must all be in the same
+ * word.
+ */
+#define IPSET_BIT_WORDS_GET_RANGE(words, i, n) \
+    (((words)[(i) / 64] >> (64 - ((i) % 64) - (n))) & \
+     ((((uint64_t) 1) << (n)) - 1))
+
+
 #endif  /* IPSET_BITS_H */
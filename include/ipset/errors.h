@@ -23,7 +23,9 @@
 
 enum ipset_error {
     IPSET_IO_ERROR,
-    IPSET_PARSE_ERROR
+    IPSET_PARSE_ERROR,
+    IPSET_CAPACITY_ERROR,
+    IPSET_CACHE_ERROR
 };
 
 
@@ -21,6 +21,7 @@
 struct ip_set {
     struct ipset_node_cache  *cache;
     ipset_node_id  set_bdd;
+    bool  owns_cache;
 };
 
 
@@ -28,6 +29,19 @@ struct ip_map {
     struct ipset_node_cache  *cache;
     ipset_node_id  map_bdd;
     ipset_node_id  default_bdd;
+    bool  owns_cache;
+};
+
+
+struct ipset_ipv4_network {
+    struct cork_ipv4  address;
+    unsigned int  cidr_prefix;
+};
+
+
+struct ipset_ipv6_network {
+    struct cork_ipv6  address;
+    unsigned int  cidr_prefix;
 };
 
 
@@ -46,12 +60,18 @@ ipset_init_library(void);
 void
 ipset_init(struct ip_set *set);
 
+void
+ipset_init_in_cache(struct ip_set *set, struct ipset_node_cache *cache);
+
 void
 ipset_done(struct ip_set *set);
 
 struct ip_set *
 ipset_new(void);
 
+struct ip_set *
+ipset_new_in_cache(struct ipset_node_cache *cache);
+
 void
 ipset_free(struct ip_set *set);
 
@@ -64,6 +84,15 @@ ipset_is_equal(const struct ip_set *set1, const struct ip_set *set2);
 size_t
 ipset_memory_size(const struct ip_set *set);
 
+uint64_t
+ipset_ipv4_count(const struct ip_set *set);
+
+struct ipset_uint128
+ipset_ipv6_count(const struct ip_set *set);
+
+int
+ipset_compact(struct ip_set *set);
+
 int
 ipset_save(FILE *stream, const struct ip_set *set);
 
@@ -71,12 +100,44 @@ int
 ipset_save_to_stream(struct cork_stream_consumer *stream,
                      const struct ip_set *set);
 
+int
+ipset_save_fd(int fd, const struct ip_set *set);
+
+int
+ipset_save_with_flags(FILE *stream, const struct ip_set *set,
+                      unsigned int flags);
+
+int
+ipset_save_to_stream_with_flags(struct cork_stream_consumer *stream,
+                                const struct ip_set *set,
+                                unsigned int flags);
+
+int
+ipset_save_fd_with_flags(int fd, const struct ip_set *set,
+                         unsigned int flags);
+
+int
+ipset_save_v2(FILE *stream, const struct ip_set *set);
+
+int
+ipset_save_v2_fd(int fd, const struct ip_set *set);
+
+int
+ipset_save_v2_to_stream(struct cork_stream_consumer *stream,
+                        const struct ip_set *set);
+
 int
 ipset_save_dot(FILE *stream, const struct ip_set *set);
 
 struct ip_set *
 ipset_load(FILE *stream);
 
+struct ip_set *
+ipset_load_into(struct ipset_node_cache *cache, FILE *stream);
+
+struct ip_set *
+ipset_load_from_buffer(const void *buf, size_t size);
+
 bool
 ipset_ipv4_add(struct ip_set *set, struct cork_ipv4 *elem);
 
@@ -94,6 +155,36 @@ ipset_ipv4_remove_network(struct ip_set *set, struct cork_ipv4 *elem,
 bool
 ipset_contains_ipv4(const struct ip_set *set, struct cork_ipv4 *elem);
 
+void
+ipset_contains_ipv4_batch(const struct ip_set *set, const uint32_t *addrs,
+                          size_t count, uint8_t *out);
+
+int
+ipset_ipv4_build_from_sorted(struct ip_set *set,
+                             const struct ipset_ipv4_network *networks,
+                             size_t count);
+
+int
+ipset_ipv4_add_many(struct ip_set *set,
+                    const struct ipset_ipv4_network *networks, size_t count);
+
+int
+ipset_ipv4_remove_many(struct ip_set *set,
+                       const struct ipset_ipv4_network *networks,
+                       size_t count);
+
+uint64_t
+ipset_ipv4_count_in_network(const struct ip_set *set, struct cork_ipv4 *elem,
+                            unsigned int cidr_prefix);
+
+/* The most prefix bits that a histogram can split a network by. */
+#define IPSET_MAX_HISTOGRAM_BITS  24
+
+int
+ipset_ipv4_count_histogram(const struct ip_set *set, struct cork_ipv4 *elem,
+                           unsigned int cidr_prefix,
+                           unsigned int bucket_prefix, uint64_t *counts);
+
 bool
 ipset_ipv6_add(struct ip_set *set, struct cork_ipv6 *elem);
 
@@ -111,6 +202,35 @@ ipset_ipv6_remove_network(struct ip_set *set, struct cork_ipv6 *elem,
 bool
 ipset_contains_ipv6(const struct ip_set *set, struct cork_ipv6 *elem);
 
+void
+ipset_contains_ipv6_batch(const struct ip_set *set,
+                          const struct cork_ipv6 *addrs, size_t count,
+                          uint8_t *out);
+
+int
+ipset_ipv6_build_from_sorted(struct ip_set *set,
+                             const struct ipset_ipv6_network *networks,
+                             size_t count);
+
+int
+ipset_ipv6_add_many(struct ip_set *set,
+                    const struct ipset_ipv6_network *networks, size_t count);
+
+int
+ipset_ipv6_remove_many(struct ip_set *set,
+                       const struct ipset_ipv6_network *networks,
+                       size_t count);
+
+struct ipset_uint128
+ipset_ipv6_count_in_network(const struct ip_set *set, struct cork_ipv6 *elem,
+                            unsigned int cidr_prefix);
+
+int
+ipset_ipv6_count_histogram(const struct ip_set *set, struct cork_ipv6 *elem,
+                           unsigned int cidr_prefix,
+                           unsigned int bucket_prefix,
+                           struct ipset_uint128 *counts);
+
 bool
 ipset_ip_add(struct ip_set *set, struct cork_ip *addr);
 
@@ -128,6 +248,68 @@ ipset_ip_remove_network(struct ip_set *set, struct cork_ip *addr,
 bool
 ipset_contains_ip(const struct ip_set *set, struct cork_ip *elem);
 
+struct ipset_uint128
+ipset_count_in_network(const struct ip_set *set, struct cork_ip *addr,
+                       unsigned int cidr_prefix);
+
+void
+ipset_union(struct ip_set *set, const struct ip_set *other);
+
+void
+ipset_intersection(struct ip_set *set, const struct ip_set *other);
+
+void
+ipset_difference(struct ip_set *set, const struct ip_set *other);
+
+void
+ipset_symmetric_difference(struct ip_set *set, const struct ip_set *other);
+
+void
+ipset_invert(struct ip_set *set);
+
+struct ipset_frozen *
+ipset_freeze(const struct ip_set *set);
+
+bool
+ipset_frozen_contains_ipv4(const struct ipset_frozen *frozen,
+                           struct cork_ipv4 *elem);
+
+bool
+ipset_frozen_contains_ipv6(const struct ipset_frozen *frozen,
+                           struct cork_ipv6 *elem);
+
+bool
+ipset_frozen_contains_ip(const struct ipset_frozen *frozen,
+                         struct cork_ip *elem);
+
+void
+ipset_frozen_contains_ipv4_batch(const struct ipset_frozen *frozen,
+                                 const uint32_t *addrs, size_t count,
+                                 uint8_t *out);
+
+void
+ipset_frozen_contains_ipv6_batch(const struct ipset_frozen *frozen,
+                                 const struct cork_ipv6 *addrs, size_t count,
+                                 uint8_t *out);
+
+struct ipset_stride_table *
+ipset_compile_strides(const struct ip_set *set);
+
+bool
+ipset_stride_contains_ipv4(const struct ipset_stride_table *table,
+                           struct cork_ipv4 *elem);
+
+bool
+ipset_stride_contains_ipv6(const struct ipset_stride_table *table,
+                           struct cork_ipv6 *elem);
+
+bool
+ipset_stride_contains_ip(const struct ipset_stride_table *table,
+                         struct cork_ip *elem);
+
+void
+ipset_publish(struct ipset_publisher *publisher, const struct ip_set *set);
+
 
 /* An internal state type used by the ipset_iterator_multiple_expansion_state
  * field. */
@@ -199,15 +381,22 @@ ipset_iterator_advance(struct ipset_iterator *iterator);
  * IP map functions
  */
 
-void
+int
 ipmap_init(struct ip_map *map, int default_value);
 
+int
+ipmap_init_in_cache(struct ip_map *map, struct ipset_node_cache *cache,
+                    int default_value);
+
 void
 ipmap_done(struct ip_map *map);
 
 struct ip_map *
 ipmap_new(int default_value);
 
+struct ip_map *
+ipmap_new_in_cache(struct ipset_node_cache *cache, int default_value);
+
 void
 ipmap_free(struct ip_map *map);
 
@@ -220,6 +409,13 @@ ipmap_is_equal(const struct ip_map *map1, const struct ip_map *map2);
 size_t
 ipmap_memory_size(const struct ip_map *map);
 
+void
+ipmap_count_value(const struct ip_map *map, int value,
+                  uint64_t *ipv4_count, struct ipset_uint128 *ipv6_count);
+
+int
+ipmap_compact(struct ip_map *map);
+
 int
 ipmap_save(FILE *stream, const struct ip_map *map);
 
@@ -227,9 +423,41 @@ int
 ipmap_save_to_stream(struct cork_stream_consumer *stream,
                      const struct ip_map *map);
 
+int
+ipmap_save_fd(int fd, const struct ip_map *map);
+
+int
+ipmap_save_with_flags(FILE *stream, const struct ip_map *map,
+                      unsigned int flags);
+
+int
+ipmap_save_to_stream_with_flags(struct cork_stream_consumer *stream,
+                                const struct ip_map *map,
+                                unsigned int flags);
+
+int
+ipmap_save_fd_with_flags(int fd, const struct ip_map *map,
+                         unsigned int flags);
+
+int
+ipmap_save_v2(FILE *stream, const struct ip_map *map);
+
+int
+ipmap_save_v2_fd(int fd, const struct ip_map *map);
+
+int
+ipmap_save_v2_to_stream(struct cork_stream_consumer *stream,
+                        const struct ip_map *map);
+
 struct ip_map *
 ipmap_load(FILE *stream);
 
+struct ip_map *
+ipmap_load_into(struct ipset_node_cache *cache, FILE *stream);
+
+struct ip_map *
+ipmap_load_from_buffer(const void *buf, size_t size);
+
 void
 ipmap_ipv4_set(struct ip_map *map, struct cork_ipv4 *elem, int value);
 
@@ -237,6 +465,11 @@ void
 ipmap_ipv4_set_network(struct ip_map *map, struct cork_ipv4 *elem,
                        unsigned int cidr_prefix, int value);
 
+int
+ipmap_ipv4_set_many(struct ip_map *map,
+                    const struct ipset_ipv4_network *networks, size_t count,
+                    int value);
+
 int
 ipmap_ipv4_get(struct ip_map *map, struct cork_ipv4 *elem);
 
@@ -247,6 +480,11 @@ void
 ipmap_ipv6_set_network(struct ip_map *map, struct cork_ipv6 *elem,
                        unsigned int cidr_prefix, int value);
 
+int
+ipmap_ipv6_set_many(struct ip_map *map,
+                    const struct ipset_ipv6_network *networks, size_t count,
+                    int value);
+
 int
 ipmap_ipv6_get(struct ip_map *map, struct cork_ipv6 *elem);
 
@@ -260,5 +498,49 @@ ipmap_ip_set_network(struct ip_map *map, struct cork_ip *addr,
 int
 ipmap_ip_get(struct ip_map *map, struct cork_ip *addr);
 
+void
+ipmap_union(struct ip_map *map, const struct ip_map *other);
+
+void
+ipmap_intersection(struct ip_map *map, const struct ip_map *other);
+
+void
+ipmap_difference(struct ip_map *map, const struct ip_map *other);
+
+void
+ipmap_symmetric_difference(struct ip_map *map, const struct ip_map *other);
+
+struct ipset_frozen *
+ipmap_freeze(const struct ip_map *map);
+
+int
+ipmap_frozen_get_ipv4(const struct ipset_frozen *frozen,
+                      struct cork_ipv4 *elem);
+
+int
+ipmap_frozen_get_ipv6(const struct ipset_frozen *frozen,
+                      struct cork_ipv6 *elem);
+
+int
+ipmap_frozen_get_ip(const struct ipset_frozen *frozen, struct cork_ip *addr);
+
+struct ipset_stride_table *
+ipmap_compile_strides(const struct ip_map *map);
+
+int
+ipmap_stride_get_ipv4(const struct ipset_stride_table *table,
+                      struct cork_ipv4 *elem);
+
+int
+ipmap_stride_get_ipv6(const struct ipset_stride_table *table,
+                      struct cork_ipv6 *elem);
+
+int
+ipmap_stride_get_ip(const struct ipset_stride_table *table,
+                    struct cork_ip *addr);
+
+void
+ipmap_publish(struct ipset_publisher *publisher, const struct ip_map *map);
+
 
 #endif  /* IPSET_IPSET_H */
@@ -10,19 +10,28 @@
 #include <ctype.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include <libcork/core.h>
+#include <libcork/ds.h>
 
+#include "ipset/bdd/nodes.h"
 #include "ipset/ipset.h"
 
 
 static char  *output_filename = NULL;
 static bool  loose_cidr = false;
+static unsigned int  save_flags = 0;
 static int  verbosity = 0;
+static long  thread_count = 1;
+
+#define MAX_LINELENGTH  4096
+#define MAX_THREADS  1024
 
 struct removal {
     size_t  line;
@@ -32,27 +41,773 @@ struct removal {
     bool  has_cidr;
 };
 
+/* As long as the networks for an address family arrive in sorted
+ * order, we collect them here and build them into the set in a single
+ * bottom-up pass once we've read all of the input.  As soon as one
+ * arrives out of order, we add everything we've collected so far to the
+ * set, and go back to adding each network as we read it. */
+struct sorted_input {
+    bool  active;
+    bool  has_previous;
+    unsigned int  byte_size;
+    /* The network address of the most recent network. */
+    uint8_t  last_start[16];
+    /* The largest address covered by any network so far.  Since the
+     * networks are sorted, a new network is a duplicate if and only if
+     * it ends before this. */
+    uint8_t  max_end[16];
+};
+
+struct counts {
+    size_t  ip;
+    size_t  v4;
+    size_t  v4_block;
+    size_t  v6;
+    size_t  v6_block;
+    size_t  errors;
+};
+
+/* A diagnostic that a worker thread has to hold on to until every
+ * message for the earlier lines of the file has been printed. */
+struct message {
+    size_t  line;
+    size_t  offset;
+    size_t  size;
+};
+
+/* A line that a worker thread added to its own partial set.  We check
+ * these again, once the earlier parts of the input have been built, to
+ * find any duplicates that span more than one thread. */
+struct added_line {
+    size_t  line;
+    const char  *text;
+    struct cork_ip  address;
+    unsigned int  cidr;
+    bool  has_cidr;
+};
+
+/* Everything we need to build a set from a sequence of input lines.  A
+ * single-threaded build uses one of these for all of its input; with
+ * --threads, each worker thread has its own. */
+struct builder {
+    const char  *filename;
+    struct ip_set  set;
+    struct sorted_input  sorted_v4;
+    struct sorted_input  sorted_v6;
+    cork_array(struct ipset_ipv4_network)  pending_v4;
+    cork_array(struct ipset_ipv6_network)  pending_v6;
+    cork_array(struct removal)  removals;
+    struct counts  counts;
+    /* Worker threads save up their messages instead of printing them
+     * right away. */
+    bool  buffered;
+    struct cork_buffer  text;
+    cork_array(struct message)  messages;
+    cork_array(struct added_line)  added;
+};
+
 static struct option longopts[] = {
     { "help", no_argument, NULL, 'h' },
     { "output", required_argument, NULL, 'o' },
+    { "compact", 0, NULL, 'c' },
     { "loose-cidr", 0, NULL, 'l' },
+    { "threads", required_argument, NULL, 't' },
     { "verbose", 0, NULL, 'v' },
     { "quiet", 0, NULL, 'q' },
     { NULL, 0, NULL, 0 }
 };
 
 static bool
-is_string_whitespace(const char *str)
+is_string_whitespace(const char *str, size_t len)
 {
-    while (*str) {
+    while (len > 0) {
         if (isspace(*str) == 0) {
             return false;
         }
         str++;
+        len--;
     }
     return true;
 }
 
+static void
+builder_init(struct builder *builder, struct ipset_node_cache *cache,
+             bool buffered)
+{
+    struct sorted_input  sorted_v4 = { true, false, 4 };
+    struct sorted_input  sorted_v6 = { true, false, 16 };
+    builder->filename = NULL;
+    if (cache == NULL) {
+        ipset_init(&builder->set);
+    } else {
+        ipset_init_in_cache(&builder->set, cache);
+    }
+    builder->sorted_v4 = sorted_v4;
+    builder->sorted_v6 = sorted_v6;
+    cork_array_init(&builder->pending_v4);
+    cork_array_init(&builder->pending_v6);
+    cork_array_init(&builder->removals);
+    memset(&builder->counts, 0, sizeof(struct counts));
+    builder->buffered = buffered;
+    cork_buffer_init(&builder->text);
+    cork_array_init(&builder->messages);
+    cork_array_init(&builder->added);
+}
+
+static void
+builder_done(struct builder *builder)
+{
+    ipset_done(&builder->set);
+    cork_array_done(&builder->pending_v4);
+    cork_array_done(&builder->pending_v6);
+    cork_array_done(&builder->removals);
+    cork_buffer_done(&builder->text);
+    cork_array_done(&builder->messages);
+    cork_array_done(&builder->added);
+}
+
+static void
+report(struct builder *builder, size_t line, const char *fmt, ...)
+{
+    va_list  args;
+    va_start(args, fmt);
+    if (builder->buffered) {
+        struct message  *message = cork_array_append_get(&builder->messages);
+        message->line = line;
+        message->offset = builder->text.size;
+        cork_buffer_append_vprintf(&builder->text, fmt, args);
+        message->size = builder->text.size - message->offset;
+    } else {
+        vfprintf(stderr, fmt, args);
+    }
+    va_end(args);
+}
+
+static void
+remember_added_line(struct builder *builder, size_t line, const char *text,
+                    struct cork_ip *addr, unsigned int cidr, bool has_cidr)
+{
+    if (builder->buffered && verbosity >= 0) {
+        struct added_line  *added = cork_array_append_get(&builder->added);
+        added->line = line;
+        added->text = text;
+        added->address = *addr;
+        added->cidr = cidr;
+        added->has_cidr = has_cidr;
+    }
+}
+
+/* Returns -1 if the network is out of order, 1 if it's a duplicate of
+ * the networks that came before it, and 0 otherwise. */
+static int
+sorted_input_check(struct sorted_input *input, const uint8_t *addr,
+                   unsigned int cidr)
+{
+    uint8_t  start[16];
+    uint8_t  end[16];
+    unsigned int  i;
+
+    for (i = 0; i < input->byte_size; i++) {
+        unsigned int  bits = (cidr > i * 8)? cidr - i * 8: 0;
+        uint8_t  mask = (bits >= 8)? 0xff: (uint8_t) (0xff00 >> bits);
+        start[i] = addr[i] & mask;
+        end[i] = addr[i] | (uint8_t) ~mask;
+    }
+
+    if (input->has_previous) {
+        if (memcmp(start, input->last_start, input->byte_size) < 0) {
+            return -1;
+        }
+        if (memcmp(end, input->max_end, input->byte_size) <= 0) {
+            return 1;
+        }
+    }
+
+    memcpy(input->last_start, start, input->byte_size);
+    memcpy(input->max_end, end, input->byte_size);
+    input->has_previous = true;
+    return 0;
+}
+
+static void
+flush_sorted_input(struct builder *builder, int version)
+{
+    int  rc;
+    if (version == 4) {
+        rc = ipset_ipv4_build_from_sorted
+            (&builder->set, &cork_array_at(&builder->pending_v4, 0),
+             cork_array_size(&builder->pending_v4));
+        cork_array_clear(&builder->pending_v4);
+    } else {
+        rc = ipset_ipv6_build_from_sorted
+            (&builder->set, &cork_array_at(&builder->pending_v6, 0),
+             cork_array_size(&builder->pending_v6));
+        cork_array_clear(&builder->pending_v6);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "Error building IP set:\n  %s\n",
+                cork_error_message());
+        exit(1);
+    }
+}
+
+static void
+flush_all_sorted_input(struct builder *builder)
+{
+    if (builder->sorted_v4.active) {
+        flush_sorted_input(builder, 4);
+    }
+    if (builder->sorted_v6.active) {
+        flush_sorted_input(builder, 6);
+    }
+}
+
+/* Adds a network to the set, using the bulk builder if we can.  Returns
+ * whether the set was unchanged. */
+static bool
+add_network(struct builder *builder, struct cork_ip *addr, unsigned int cidr,
+            bool has_cidr)
+{
+    struct sorted_input  *input =
+        (addr->version == 4)? &builder->sorted_v4: &builder->sorted_v6;
+    unsigned int  bit_size = input->byte_size * 8;
+
+    if (!has_cidr) {
+        cidr = bit_size;
+    }
+
+    /* Let the regular functions report any invalid CIDR prefixes. */
+    if (input->active && cidr <= bit_size) {
+        int  rc = sorted_input_check(input, (uint8_t *) &addr->ip, cidr);
+        if (rc == 1) {
+            return true;
+        } else if (rc == 0) {
+            if (addr->version == 4) {
+                struct ipset_ipv4_network  *network =
+                    cork_array_append_get(&builder->pending_v4);
+                network->address = addr->ip.v4;
+                network->cidr_prefix = cidr;
+            } else {
+                struct ipset_ipv6_network  *network =
+                    cork_array_append_get(&builder->pending_v6);
+                network->address = addr->ip.v6;
+                network->cidr_prefix = cidr;
+            }
+            return false;
+        }
+
+        flush_sorted_input(builder, addr->version);
+        input->active = false;
+    }
+
+    if (has_cidr) {
+        return ipset_ip_add_network(&builder->set, addr, cidr);
+    } else {
+        return ipset_ip_add(&builder->set, addr);
+    }
+}
+
+/* Processes one line of input, which contains the len bytes that fgets
+ * would have returned for it. */
+static void
+process_line(struct builder *builder, char *line, size_t len, size_t line_num)
+{
+    char  *address;
+    char  *slash_pos;
+    unsigned int  cidr = 0;
+    struct cork_ip  addr;
+    struct removal  *entry;
+    bool  remove_ip = false;
+    bool  set_unchanged = false;
+
+    /* Skip empty lines and comments. Comments start with '#'
+     * in the first column. */
+    if ((line[0] == '#') || (is_string_whitespace(line, len))) {
+        return;
+    }
+
+    /* Chomp the trailing newline so we don't confuse our IP
+     * address parser. */
+    line[len-1] = '\0';
+
+    /* Check for a negating IP address.  If so, then the IP address
+     * starts just after the '!'. */
+    if (line[0] == '!') {
+        remove_ip = true;
+        address = line + 1;
+    } else {
+        address = line;
+    }
+
+    /* Check for a / indicating a CIDR block.  If one is
+     * present, split the string there and parse the trailing
+     * part as a CIDR prefix integer. */
+    if ((slash_pos = strchr(address, '/')) != NULL) {
+        char  *endptr;
+        *slash_pos = '\0';
+        slash_pos++;
+        cidr = (unsigned int) strtol(slash_pos, &endptr, 10);
+        if (endptr == slash_pos) {
+            report(builder, line_num,
+                   "Error: Line %zu: Missing CIDR prefix\n", line_num);
+            builder->counts.errors++;
+            return;
+        } else if (*slash_pos == '\0' || *endptr != '\0') {
+            report(builder, line_num,
+                   "Error: Line %zu: Invalid CIDR prefix \"%s\"\n",
+                   line_num, slash_pos);
+            builder->counts.errors++;
+            return;
+        }
+    }
+
+    /* Try to parse the line as an IP address. */
+    if (cork_ip_init(&addr, address) != 0) {
+        report(builder, line_num, "Error: Line %zu: %s\n",
+               line_num, cork_error_message());
+        cork_error_clear();
+        builder->counts.errors++;
+        return;
+    }
+
+    /* Add to address to the ipset and update the counters */
+    if (slash_pos == NULL) {
+        if (remove_ip) {
+            entry = cork_array_append_get(&builder->removals);
+            entry->line = line_num;
+            entry->filename = builder->filename;
+            entry->address = addr;
+            entry->cidr = 0;
+            entry->has_cidr = false;
+        } else {
+            set_unchanged = add_network(builder, &addr, 0, false);
+            if (set_unchanged && verbosity >= 0) {
+                report(builder, line_num,
+                       "Alert: %s, line %zu: %s is a duplicate\n",
+                       builder->filename, line_num, address);
+            } else {
+                if (addr.version == 4) {
+                    builder->counts.v4++;
+                } else {
+                    builder->counts.v6++;
+                }
+                builder->counts.ip++;
+                remember_added_line
+                    (builder, line_num, address, &addr, 0, false);
+            }
+        }
+    } else {
+        /* If loose-cidr was not a command line option, then check the
+         * alignment of the IP address with the CIDR block. */
+        if (!loose_cidr) {
+            if (!cork_ip_is_valid_network(&addr, cidr)) {
+                report(builder, line_num,
+                       "Error: %s, line %zu: Bad CIDR block: \"%s/%u\"\n",
+                       builder->filename, line_num, address, cidr);
+                builder->counts.errors++;
+                return;
+            }
+        }
+        if (remove_ip) {
+            entry = cork_array_append_get(&builder->removals);
+            entry->line = line_num;
+            entry->filename = builder->filename;
+            entry->address = addr;
+            entry->cidr = cidr;
+            entry->has_cidr = true;
+        } else {
+            set_unchanged = add_network(builder, &addr, cidr, true);
+        }
+        if (cork_error_occurred()) {
+            report(builder, line_num,
+                   "Error: %s, line %zu: Invalid IP address: "
+                   "\"%s/%u\": %s\n", builder->filename, line_num, address,
+                   cidr, cork_error_message());
+            cork_error_clear();
+            builder->counts.errors++;
+            return;
+        }
+        if (!remove_ip) {
+            if (set_unchanged && verbosity >= 0) {
+                report(builder, line_num,
+                       "Alert: %s, line %zu: %s/%u is a duplicate\n",
+                       builder->filename, line_num, address, cidr);
+            } else {
+                if (addr.version == 4) {
+                    builder->counts.v4_block++;
+                } else {
+                    builder->counts.v6_block++;
+                }
+                builder->counts.ip++;
+                remember_added_line
+                    (builder, line_num, address, &addr, cidr, true);
+            }
+        }
+    }
+}
+
+
+/*-----------------------------------------------------------------------
+ * Multi-threaded builds
+ */
+
+/* With --threads, we read each file into memory, and split it into one
+ * chunk for each thread.  Each thread builds a partial set from its
+ * chunk, and we then merge the partial sets together in a binary tree,
+ * doing all of the merges at each level of the tree in parallel.
+ *
+ * Each worker can only detect the duplicates within its own chunk.  To
+ * find the rest, we use the tree: the union of everything before chunk
+ * k is the union of at most log2(k) nodes in the tree (one for each bit
+ * that's set in k), plus whatever we built from any earlier files.
+ * Once we've built the tree, each worker compares the lines that it
+ * added against that union. */
+
+#define MAX_TREE_LEVELS  (sizeof(size_t) * 8)
+
+struct chunk {
+    pthread_t  thread;
+    size_t  index;
+    char  *start;
+    char  *end;
+    size_t  first_line;
+    struct builder  builder;
+};
+
+struct merge {
+    pthread_t  thread;
+    struct ip_set  *dest;
+    struct ip_set  *lhs;
+    struct ip_set  *rhs;
+};
+
+static struct ipset_node_cache  *shared_cache = NULL;
+/* Everything that we've built from the files that we've already read. */
+static struct ip_set  *earlier_files = NULL;
+static struct ip_set  **tree[MAX_TREE_LEVELS];
+static size_t  tree_sizes[MAX_TREE_LEVELS];
+static unsigned int  tree_height;
+
+static void
+start_thread(pthread_t *thread, void *(*func)(void *), void *user_data)
+{
+    int  rc = pthread_create(thread, NULL, func, user_data);
+    if (rc != 0) {
+        fprintf(stderr, "ipsetbuild: Cannot start thread:\n  %s\n",
+                strerror(rc));
+        exit(1);
+    }
+}
+
+/* Returns the length of the next line in the buffer, splitting lines
+ * in the same places that fgets would. */
+static size_t
+next_line_length(const char *curr, const char *end)
+{
+    size_t  max = end - curr;
+    const char  *newline;
+    if (max > MAX_LINELENGTH - 1) {
+        max = MAX_LINELENGTH - 1;
+    }
+    newline = memchr(curr, '\n', max);
+    return (newline == NULL)? max: (size_t) (newline - curr + 1);
+}
+
+static void *
+build_chunk(void *user_data)
+{
+    struct chunk  *chunk = user_data;
+    char  *curr = chunk->start;
+    size_t  line_num = chunk->first_line;
+
+    while (curr < chunk->end) {
+        size_t  len = next_line_length(curr, chunk->end);
+        process_line(&chunk->builder, curr, len, line_num);
+        curr += len;
+        line_num++;
+    }
+    flush_all_sorted_input(&chunk->builder);
+    return NULL;
+}
+
+static void *
+merge_sets(void *user_data)
+{
+    struct merge  *merge = user_data;
+    ipset_union(merge->dest, merge->lhs);
+    if (merge->rhs != NULL) {
+        ipset_union(merge->dest, merge->rhs);
+    }
+    return NULL;
+}
+
+static void
+build_tree(struct chunk *chunks, size_t chunk_count)
+{
+    struct merge  *merges;
+    size_t  i;
+
+    tree[0] = cork_calloc(chunk_count, sizeof(struct ip_set *));
+    tree_sizes[0] = chunk_count;
+    for (i = 0; i < chunk_count; i++) {
+        tree[0][i] = &chunks[i].builder.set;
+    }
+
+    merges = cork_calloc((chunk_count + 1) / 2, sizeof(struct merge));
+    for (tree_height = 1; tree_sizes[tree_height - 1] > 1; tree_height++) {
+        size_t  prev_size = tree_sizes[tree_height - 1];
+        size_t  size = (prev_size + 1) / 2;
+        tree[tree_height] = cork_calloc(size, sizeof(struct ip_set *));
+        tree_sizes[tree_height] = size;
+        for (i = 0; i < size; i++) {
+            tree[tree_height][i] = ipset_new_in_cache(shared_cache);
+            merges[i].dest = tree[tree_height][i];
+            merges[i].lhs = tree[tree_height - 1][i * 2];
+            merges[i].rhs = (i * 2 + 1 < prev_size)?
+                tree[tree_height - 1][i * 2 + 1]: NULL;
+            start_thread(&merges[i].thread, merge_sets, &merges[i]);
+        }
+        for (i = 0; i < size; i++) {
+            pthread_join(merges[i].thread, NULL);
+        }
+    }
+    free(merges);
+}
+
+static void
+free_tree(void)
+{
+    unsigned int  level;
+    size_t  i;
+    free(tree[0]);
+    for (level = 1; level < tree_height; level++) {
+        for (i = 0; i < tree_sizes[level]; i++) {
+            ipset_free(tree[level][i]);
+        }
+        free(tree[level]);
+    }
+}
+
+static void *
+find_duplicates(void *user_data)
+{
+    struct chunk  *chunk = user_data;
+    struct builder  *builder = &chunk->builder;
+    struct ip_set  before;
+    size_t  added_count = cork_array_size(&builder->added);
+    size_t  last_network = 0;
+    bool  has_network = false;
+    unsigned int  level;
+    size_t  i;
+
+    ipset_init_in_cache(&before, shared_cache);
+    ipset_union(&before, earlier_files);
+    for (level = 0; (chunk->index >> level) != 0; level++) {
+        if ((chunk->index >> level) & 1) {
+            ipset_union
+                (&before, tree[level][(chunk->index >> level) - 1]);
+        }
+    }
+
+    if (ipset_is_empty(&before)) {
+        ipset_done(&before);
+        return NULL;
+    }
+
+    /* A network might be covered by the earlier chunks and the earlier
+     * lines of this chunk together, so up through the last network we
+     * have to add each line to the set as we go.  After that, checking
+     * membership is enough. */
+    for (i = 0; i < added_count; i++) {
+        if (cork_array_at(&builder->added, i).has_cidr) {
+            last_network = i;
+            has_network = true;
+        }
+    }
+
+    for (i = 0; i < added_count; i++) {
+        struct added_line  *added = &cork_array_at(&builder->added, i);
+        bool  duplicate;
+        if (has_network && i <= last_network) {
+            if (added->has_cidr) {
+                duplicate = ipset_ip_add_network
+                    (&before, &added->address, added->cidr);
+            } else {
+                duplicate = ipset_ip_add(&before, &added->address);
+            }
+        } else {
+            duplicate = ipset_contains_ip(&before, &added->address);
+        }
+
+        if (!duplicate) {
+            continue;
+        }
+
+        if (added->has_cidr) {
+            report(builder, added->line,
+                   "Alert: %s, line %zu: %s/%u is a duplicate\n",
+                   builder->filename, added->line, added->text,
+                   added->cidr);
+            if (added->address.version == 4) {
+                builder->counts.v4_block--;
+            } else {
+                builder->counts.v6_block--;
+            }
+        } else {
+            report(builder, added->line,
+                   "Alert: %s, line %zu: %s is a duplicate\n",
+                   builder->filename, added->line, added->text);
+            if (added->address.version == 4) {
+                builder->counts.v4--;
+            } else {
+                builder->counts.v6--;
+            }
+        }
+        builder->counts.ip--;
+    }
+
+    ipset_done(&before);
+    return NULL;
+}
+
+static int
+message_cmp(const void *vm1, const void *vm2)
+{
+    const struct message  *m1 = vm1;
+    const struct message  *m2 = vm2;
+    return (m1->line < m2->line)? -1: (m1->line > m2->line)? 1: 0;
+}
+
+static void
+print_messages(struct builder *builder)
+{
+    size_t  count = cork_array_size(&builder->messages);
+    size_t  i;
+    if (count == 0) {
+        return;
+    }
+    qsort(&cork_array_at(&builder->messages, 0), count,
+          sizeof(struct message), message_cmp);
+    for (i = 0; i < count; i++) {
+        struct message  *message = &cork_array_at(&builder->messages, i);
+        fwrite((char *) builder->text.buf + message->offset, 1,
+               message->size, stderr);
+    }
+}
+
+static char *
+read_stream(FILE *stream, const char *filename, size_t *size)
+{
+    struct cork_buffer  buf;
+    size_t  read_size;
+
+    cork_buffer_init(&buf);
+    do {
+        cork_buffer_ensure_size(&buf, buf.size + 65536);
+        read_size = fread((char *) buf.buf + buf.size, 1,
+                          buf.allocated_size - buf.size, stream);
+        buf.size += read_size;
+    } while (read_size > 0);
+
+    if (ferror(stream)) {
+        /* There was an error reading from the stream. */
+        fprintf(stderr, "Error reading from %s:\n  %s\n",
+                filename, strerror(errno));
+        exit(1);
+    }
+
+    *size = buf.size;
+    return buf.buf;
+}
+
+/* Builds the contents of a stream using all of our threads, and adds
+ * them to the main builder's set. */
+static void
+build_stream_in_parallel(struct builder *main_builder, FILE *stream)
+{
+    struct chunk  *chunks;
+    size_t  chunk_count = thread_count;
+    size_t  size;
+    char  *buf = read_stream(stream, main_builder->filename, &size);
+    char  *end = buf + size;
+    char  *curr;
+    size_t  line_num = 1;
+    size_t  next = 1;
+    size_t  i;
+
+    /* Split the file into chunks of roughly the same size, at line
+     * boundaries. */
+    chunks = cork_calloc(chunk_count, sizeof(struct chunk));
+    chunks[0].start = buf;
+    chunks[0].first_line = 1;
+    for (curr = buf; curr < end; line_num++) {
+        if (next < chunk_count &&
+            (size_t) (curr - buf) >= size / chunk_count * next) {
+            chunks[next].start = curr;
+            chunks[next].first_line = line_num;
+            next++;
+        }
+        curr += next_line_length(curr, end);
+    }
+    for (; next < chunk_count; next++) {
+        chunks[next].start = end;
+        chunks[next].first_line = line_num;
+    }
+
+    for (i = 0; i < chunk_count; i++) {
+        chunks[i].index = i;
+        chunks[i].end = (i + 1 < chunk_count)? chunks[i + 1].start: end;
+        builder_init(&chunks[i].builder, shared_cache, true);
+        chunks[i].builder.filename = main_builder->filename;
+        start_thread(&chunks[i].thread, build_chunk, &chunks[i]);
+    }
+    for (i = 0; i < chunk_count; i++) {
+        pthread_join(chunks[i].thread, NULL);
+    }
+
+    build_tree(chunks, chunk_count);
+
+    if (verbosity >= 0) {
+        for (i = 0; i < chunk_count; i++) {
+            start_thread(&chunks[i].thread, find_duplicates, &chunks[i]);
+        }
+        for (i = 0; i < chunk_count; i++) {
+            pthread_join(chunks[i].thread, NULL);
+        }
+    }
+
+    /* Report everything in the same order that a single-threaded build
+     * would have. */
+    for (i = 0; i < chunk_count; i++) {
+        struct builder  *builder = &chunks[i].builder;
+        size_t  j;
+
+        print_messages(builder);
+        main_builder->counts.ip += builder->counts.ip;
+        main_builder->counts.v4 += builder->counts.v4;
+        main_builder->counts.v4_block += builder->counts.v4_block;
+        main_builder->counts.v6 += builder->counts.v6;
+        main_builder->counts.v6_block += builder->counts.v6_block;
+        main_builder->counts.errors += builder->counts.errors;
+        for (j = 0; j < cork_array_size(&builder->removals); j++) {
+            cork_array_append
+                (&main_builder->removals,
+                 cork_array_at(&builder->removals, j));
+        }
+    }
+
+    ipset_union(&main_builder->set, tree[tree_height - 1][0]);
+
+    free_tree();
+    for (i = 0; i < chunk_count; i++) {
+        builder_done(&chunks[i].builder);
+    }
+    free(chunks);
+    free(buf);
+    ipset_node_cache_gc(shared_cache);
+}
+
+
 #define USAGE \
 "Usage: ipsetbuild [options] <input file>...\n"
 
@@ -68,9 +823,16 @@ USAGE \
 "  --output=<filename>, -o <filename>\n" \
 "    Writes the binary IP set file to <filename>.  If this option isn't\n" \
 "    given, then the binary set will be written to standard output.\n" \
+"  --compact, -c\n" \
+"    Write the set using the compact (version 3) file format, which is\n" \
+"    usually several times smaller than the default format.\n" \
 "  --loose-cidr, -l\n" \
 "    Be more lenient about the address portion of any CIDR network blocks\n" \
 "    found in the input file.\n" \
+"  --threads=<count>, -t <count>\n" \
+"    Use <count> threads to build the set.  Each input file is read into\n" \
+"    memory and split into <count> pieces, which are built in parallel and\n" \
+"    then merged together.  The default is to use a single thread.\n" \
 "  --verbose, -v\n" \
 "    Show summary information about the IP set that's built, as well as\n" \
 "    progress information about the files being read and written.  If this\n" \
@@ -109,8 +871,9 @@ USAGE \
 "  \"holes\".\n" \
 "\n" \
 "  The order of the addresses and networks given to ipsetbuild does not\n" \
-"  matter.  If a particular address is added to the set more than once, or\n" \
-"  removed from the set more than once, whether on its own or via a CIDR\n" \
+"  matter, though the set can be built much more quickly if they're sorted\n" \
+"  by address.  If a particular address is added to the set more than once,\n" \
+"  or removed from the set more than once, whether on its own or via a CIDR\n" \
 "  network, then you will get a warning message.  (You can silence these\n" \
 "  warnings with the --quiet option.)  If an address is both added to and\n" \
 "  removed from the set, then the removal takes precedence, regardless of\n" \
@@ -125,8 +888,13 @@ main(int argc, char **argv)
     /* Parse the command-line options. */
 
     int  ch;
-    while ((ch = getopt_long(argc, argv, "hlo:vq", longopts, NULL)) != -1) {
+    char  *endptr;
+    while ((ch = getopt_long(argc, argv, "chlo:t:vq", longopts, NULL)) != -1) {
         switch (ch) {
+            case 'c':
+                save_flags |= IPSET_SAVE_COMPACT;
+                break;
+
             case 'h':
                 fprintf(stdout, FULL_USAGE);
                 exit(0);
@@ -139,6 +907,17 @@ main(int argc, char **argv)
                 output_filename = optarg;
                 break;
 
+            case 't':
+                thread_count = strtol(optarg, &endptr, 10);
+                if (*optarg == '\0' || *endptr != '\0' ||
+                    thread_count < 1 || thread_count > MAX_THREADS) {
+                    fprintf(stderr,
+                            "ipsetbuild: Thread count must be between "
+                            "1 and %d.\n", MAX_THREADS);
+                    exit(1);
+                }
+                break;
+
             case 'v':
                 verbosity++;
                 break;
@@ -180,14 +959,22 @@ main(int argc, char **argv)
     size_t  total_ip_v4_block = 0;
     size_t  total_ip_v6 = 0;
     size_t  total_ip_v6_block = 0;
-    struct ip_set  set;
+    struct builder  builder;
+    struct ip_set  *set = &builder.set;
     struct removal  *entry;
-    cork_array(struct removal)  removals;
     bool  read_from_stdin = false;
     bool  set_unchanged = false;
 
-    ipset_init(&set);
-    cork_array_init(&removals);
+    if (thread_count > 1) {
+        shared_cache = ipset_node_cache_new_sized
+            (IPSET_CONCURRENT_MIN_CHUNK_BIT_SIZE,
+             IPSET_NODE_CACHE_CONCURRENT |
+             IPSET_NODE_CACHE_COMPLEMENT_EDGES);
+        builder_init(&builder, shared_cache, false);
+        earlier_files = set;
+    } else {
+        builder_init(&builder, NULL, false);
+    }
 
     int  i;
     for (i = 0; i < argc; i++) {
@@ -222,179 +1009,47 @@ main(int argc, char **argv)
             close_stream = true;
         }
 
-        /* Read in one IP address per line in the file. */
-        size_t  ip_count = 0;
-        size_t  ip_count_v4 = 0;
-        size_t  ip_count_v4_block = 0;
-        size_t  ip_count_v6 = 0;
-        size_t  ip_count_v6_block = 0;
-        size_t  line_num = 0;
-        size_t  ip_error_num = 0;
-        bool  ip_error = false;
-
-#define MAX_LINELENGTH  4096
-        char  line[MAX_LINELENGTH];
-        char  *slash_pos;
-        unsigned int  cidr = 0;
-
-        while (fgets(line, MAX_LINELENGTH, stream) != NULL) {
-            char  *address;
-            struct cork_ip  addr;
-            bool  remove_ip = false;
-
-            line_num++;
+        builder.filename = filename;
+        memset(&builder.counts, 0, sizeof(struct counts));
 
-            /* Skip empty lines and comments. Comments start with '#'
-             * in the first column. */
-            if ((line[0] == '#') || (is_string_whitespace(line))) {
-                continue;
-            }
-
-            /* Check for a negating IP address.  If so, then the IP address
-             * starts just after the '!'. */
-            if (line[0] == '!') {
-                remove_ip = true;
-                address = line + 1;
-            } else {
-                address = line;
-            }
-
-            /* Chomp the trailing newline so we don't confuse our IP
-             * address parser. */
-            size_t  len = strlen(address);
-            address[len-1] = '\0';
-
-            /* Check for a / indicating a CIDR block.  If one is
-             * present, split the string there and parse the trailing
-             * part as a CIDR prefix integer. */
-            if ((slash_pos = strchr(address, '/')) != NULL) {
-                char  *endptr;
-                *slash_pos = '\0';
-                slash_pos++;
-                cidr = (unsigned int) strtol(slash_pos, &endptr, 10);
-                if (endptr == slash_pos) {
-                    fprintf(stderr,
-                            "Error: Line %zu: Missing CIDR prefix\n",
-                            line_num);
-                    ip_error_num++;
-                    ip_error = true;
-                    continue;
-                } else if (*slash_pos == '\0' || *endptr != '\0') {
-                    fprintf(stderr,
-                            "Error: Line %zu: Invalid CIDR prefix \"%s\"\n",
-                            line_num, slash_pos);
-                    ip_error_num++;
-                    ip_error = true;
-                    continue;
-                }
-            }
+        if (thread_count > 1) {
+            build_stream_in_parallel(&builder, stream);
+        } else {
+            /* Read in one IP address per line in the file. */
+            size_t  line_num = 0;
+            char  line[MAX_LINELENGTH];
 
-            /* Try to parse the line as an IP address. */
-            if (cork_ip_init(&addr, address) != 0) {
-                fprintf(stderr, "Error: Line %zu: %s\n",
-                        line_num, cork_error_message());
-                cork_error_clear();
-                ip_error_num++;
-                ip_error = true;
-                continue;
+            while (fgets(line, MAX_LINELENGTH, stream) != NULL) {
+                line_num++;
+                process_line(&builder, line, strlen(line), line_num);
             }
 
-            /* Add to address to the ipset and update the counters */
-            if (slash_pos == NULL) {
-                if (remove_ip) {
-                    entry = cork_array_append_get(&removals);
-                    entry->line = line_num;
-                    entry->filename = filename;
-                    entry->address = addr;
-                    entry->cidr = 0;
-                    entry->has_cidr = false;
-                } else {
-                    set_unchanged = ipset_ip_add(&set, &addr);
-                    if (set_unchanged && verbosity >= 0) {
-                        fprintf(stderr,
-                                "Alert: %s, line %zu: %s is a duplicate\n",
-                                filename, line_num, address);
-                    } else {
-                        if (addr.version == 4) {
-                            ip_count_v4++;
-                        } else {
-                            ip_count_v6++;
-                        }
-                        ip_count++;
-                    }
-                }
-            } else {
-                /* If loose-cidr was not a command line option, then check the
-                 * alignment of the IP address with the CIDR block. */
-                if (!loose_cidr) {
-                    if (!cork_ip_is_valid_network(&addr, cidr)) {
-                        fprintf(stderr, "Error: %s, line %zu: Bad CIDR block: "
-                                "\"%s/%u\"\n",
-                                filename, line_num, address, cidr);
-                        ip_error_num++;
-                        ip_error = true;
-                        continue;
-                    }
-                }
-                if (remove_ip) {
-                    entry = cork_array_append_get(&removals);
-                    entry->line = line_num;
-                    entry->filename = filename;
-                    entry->address = addr;
-                    entry->cidr = cidr;
-                    entry->has_cidr = true;
-                } else {
-                    set_unchanged = ipset_ip_add_network(&set, &addr, cidr);
-                }
-                if (cork_error_occurred()) {
-                    fprintf(stderr, "Error: %s, line %zu: Invalid IP address: "
-                            "\"%s/%u\": %s\n", filename, line_num, address,
-                            cidr, cork_error_message());
-                    cork_error_clear();
-                    ip_error_num++;
-                    ip_error = true;
-                    continue;
-                }
-                if (!remove_ip) {
-                    if (set_unchanged && verbosity >= 0) {
-                        fprintf(stderr,
-                                "Alert: %s, line %zu: %s/%u is a duplicate\n",
-                                filename, line_num, address, cidr);
-                    } else {
-                        if (addr.version == 4) {
-                            ip_count_v4_block++;
-                        } else {
-                            ip_count_v6_block++;
-                        }
-                        ip_count++;
-                    }
-                }
+            if (ferror(stream)) {
+                /* There was an error reading from the stream. */
+                fprintf(stderr, "Error reading from %s:\n  %s\n",
+                        filename, strerror(errno));
+                exit(1);
             }
         }
 
-        if (ferror(stream)) {
-            /* There was an error reading from the stream. */
-            fprintf(stderr, "Error reading from %s:\n  %s\n",
-                    filename, strerror(errno));
-            exit(1);
-        }
-
         if (verbosity > 0) {
             fprintf(stderr,
                     "Summary: Read %zu valid IP address records from %s.\n",
-                    ip_count, filename);
-            fprintf(stderr, "  IPv4: %zu addresses, %zu block%s\n", ip_count_v4,
-                    ip_count_v4_block, (ip_count_v4_block == 1)? "": "s");
-            fprintf(stderr, "  IPv6: %zu addresses, %zu block%s\n", ip_count_v6,
-                    ip_count_v6_block, (ip_count_v6_block == 1)? "": "s");
+                    builder.counts.ip, filename);
+            fprintf(stderr, "  IPv4: %zu addresses, %zu block%s\n",
+                    builder.counts.v4, builder.counts.v4_block,
+                    (builder.counts.v4_block == 1)? "": "s");
+            fprintf(stderr, "  IPv6: %zu addresses, %zu block%s\n",
+                    builder.counts.v6, builder.counts.v6_block,
+                    (builder.counts.v6_block == 1)? "": "s");
         }
 
         /* Update the total IP counters. */
-        total_ip_added += ip_count;
-        total_ip_v4 += ip_count_v4;
-        total_ip_v4_block += ip_count_v4_block;
-        total_ip_v6 += ip_count_v6;
-        total_ip_v6_block += ip_count_v6_block;
+        total_ip_added += builder.counts.ip;
+        total_ip_v4 += builder.counts.v4;
+        total_ip_v4_block += builder.counts.v4_block;
+        total_ip_v6 += builder.counts.v6;
+        total_ip_v6_block += builder.counts.v6_block;
 
         /* Free the streams before opening the next file. */
         if (close_stream) {
@@ -402,7 +1057,8 @@ main(int argc, char **argv)
         }
 
         /* If the input file has errors, then terminate the program. */
-        if (ip_error) {
+        if (builder.counts.errors > 0) {
+            size_t  ip_error_num = builder.counts.errors;
             fprintf(stderr, "The program halted on %s with %zu "
                     "input error%s.\n",
                     filename, ip_error_num, (ip_error_num == 1)? "": "s");
@@ -410,13 +1066,16 @@ main(int argc, char **argv)
         }
     }
 
+    /* Build any sorted networks that we've been collecting. */
+    flush_all_sorted_input(&builder);
+
     /* Combine the removals array with the set */
-    size_t  removal_count = cork_array_size(&removals);
+    size_t  removal_count = cork_array_size(&builder.removals);
     for (i = 0; i < removal_count; i++) {
-        entry = &cork_array_at(&removals, i);
+        entry = &cork_array_at(&builder.removals, i);
         if (entry->has_cidr == true) {
             set_unchanged =
-                ipset_ip_remove_network(&set, &entry->address, entry->cidr);
+                ipset_ip_remove_network(set, &entry->address, entry->cidr);
             if (set_unchanged) {
                 if (verbosity >= 0) {
                     char  ip_buf[CORK_IP_STRING_LENGTH];
@@ -434,7 +1093,7 @@ main(int argc, char **argv)
                 total_ip_removed++;
             }
         } else {
-            set_unchanged = ipset_ip_remove(&set, &entry->address);
+            set_unchanged = ipset_ip_remove(set, &entry->address);
             if (set_unchanged) {
                 if (verbosity >= 0) {
                     char  ip_buf[CORK_IP_STRING_LENGTH];
@@ -453,7 +1112,6 @@ main(int argc, char **argv)
             }
         }
     }
-    cork_array_done(&removals);
 
     /* Print the total counter values and set size. */
     if (verbosity > 0) {
@@ -468,7 +1126,7 @@ main(int argc, char **argv)
                 total_ip_v6, total_ip_v6_block,
                 (total_ip_v6_block == 1)? "": "s");
         fprintf(stderr, "Set uses %zu bytes of memory.\n",
-                ipset_memory_size(&set));
+                ipset_memory_size(set));
     }
 
     /* Serialize the IP set to the desired output file. */
@@ -495,7 +1153,7 @@ main(int argc, char **argv)
         close_ostream = true;
     }
 
-    if (ipset_save(ostream, &set) != 0) {
+    if (ipset_save_with_flags(ostream, set, save_flags) != 0) {
         fprintf(stderr, "Error saving IP set:\n  %s\n",
                 cork_error_message());
         exit(1);
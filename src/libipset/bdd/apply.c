@@ -0,0 +1,242 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/threads.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/logging.h"
+
+
+/*-----------------------------------------------------------------------
+ * Binary APPLY
+ */
+
+/* The memoization for an APPLY uses the operation cache in the node
+ * cache that we're creating the result in.  The cache doesn't hold a
+ * reference to the result; every result that we calculate is reachable
+ * from the final result of the APPLY, which keeps it alive until we're
+ * done.  Each APPLY gets a new epoch, so we never see results from an
+ * earlier APPLY, which might use a different operator or might refer to
+ * nodes that have since been freed.
+ *
+ * The operation cache is lossy: if two pairs of nodes hash to the same
+ * slot, the later one overwrites the earlier one.  That only means that
+ * we might calculate a result more than once; we'll still get the same
+ * node back from the node cache.
+ *
+ * Several APPLYs can run at the same time in a concurrent node cache,
+ * so each of them gets its own private operation cache instead. */
+
+/* All of the state that stays the same throughout one APPLY. */
+struct ipset_apply_data {
+    struct ipset_node_cache  *cache;
+    const struct ipset_node_cache  *rhs_cache;
+    ipset_binary_operator  op;
+    const void  *user_data;
+    struct ipset_op_cache_entry  *op_cache;
+    size_t  op_cache_size;
+    unsigned int  op_cache_epoch;
+    size_t  op_cache_hits;
+    size_t  op_cache_misses;
+};
+
+static struct ipset_op_cache_entry *
+ipset_op_cache_slot(struct ipset_apply_data *data,
+                    ipset_node_id lhs, ipset_node_id rhs)
+{
+    /* Hash of "ipset_apply" */
+    cork_hash  hash = 0x1c0bd2f3;
+    hash = cork_hash_variable(hash, lhs);
+    hash = cork_hash_variable(hash, rhs);
+    return &data->op_cache[hash & (data->op_cache_size - 1)];
+}
+
+/* Make sure that the operation cache is large enough for an APPLY with
+ * operands of the given size, and start a new epoch. */
+static void
+ipset_op_cache_start(struct ipset_apply_data *data, size_t node_count)
+{
+    struct ipset_node_cache  *cache = data->cache;
+    size_t  size = 1 << IPSET_OP_CACHE_MIN_BIT_SIZE;
+    while (size < node_count &&
+           size < (1 << IPSET_OP_CACHE_MAX_BIT_SIZE)) {
+        size <<= 1;
+    }
+
+    if (cache->flags & IPSET_NODE_CACHE_CONCURRENT) {
+        data->op_cache =
+            cork_calloc(size, sizeof(struct ipset_op_cache_entry));
+        data->op_cache_size = size;
+        data->op_cache_epoch = 1;
+        return;
+    }
+
+    if (size > cache->op_cache_size) {
+        DEBUG("Resizing operation cache to %zu entries", size);
+        free(cache->op_cache);
+        cache->op_cache =
+            cork_calloc(size, sizeof(struct ipset_op_cache_entry));
+        cache->op_cache_size = size;
+        cache->op_cache_epoch = 0;
+    }
+
+    /* Epoch 0 marks an empty entry, so if the epoch counter wraps
+     * around, we have to clear out the whole table. */
+    if (++cache->op_cache_epoch == 0) {
+        memset(cache->op_cache, 0,
+               cache->op_cache_size * sizeof(struct ipset_op_cache_entry));
+        cache->op_cache_epoch = 1;
+    }
+
+    data->op_cache = cache->op_cache;
+    data->op_cache_size = cache->op_cache_size;
+    data->op_cache_epoch = cache->op_cache_epoch;
+}
+
+/* Record the statistics for an APPLY, and free its private operation
+ * cache if it had one. */
+static void
+ipset_op_cache_finish(struct ipset_apply_data *data)
+{
+    struct ipset_node_cache  *cache = data->cache;
+    if (cache->flags & IPSET_NODE_CACHE_CONCURRENT) {
+        free(data->op_cache);
+        cork_size_atomic_add(&cache->op_cache_hits, data->op_cache_hits);
+        cork_size_atomic_add(&cache->op_cache_misses, data->op_cache_misses);
+    } else {
+        cache->op_cache_hits += data->op_cache_hits;
+        cache->op_cache_misses += data->op_cache_misses;
+    }
+}
+
+
+/* Terminals sort after every nonterminal variable. */
+#define IPSET_TERMINAL_VARIABLE  ((ipset_variable) -1)
+
+static ipset_node_id
+ipset_apply_binary(struct ipset_apply_data *data,
+                   ipset_node_id lhs, ipset_node_id rhs)
+{
+    ipset_variable  lhs_var = IPSET_TERMINAL_VARIABLE;
+    ipset_variable  rhs_var = IPSET_TERMINAL_VARIABLE;
+    ipset_variable  var;
+    ipset_node_id  lhs_low = lhs;
+    ipset_node_id  lhs_high = lhs;
+    ipset_node_id  rhs_low = rhs;
+    ipset_node_id  rhs_high = rhs;
+    ipset_node_id  result_low;
+    ipset_node_id  result_high;
+
+    /* If both operands are terminals, the operator gives us the
+     * result directly. */
+    if (ipset_node_get_type(lhs) == IPSET_TERMINAL_NODE &&
+        ipset_node_get_type(rhs) == IPSET_TERMINAL_NODE) {
+        ipset_value  value = data->op
+            (data->user_data,
+             ipset_terminal_value(lhs), ipset_terminal_value(rhs));
+        DEBUG("Applying to terminals %u and %u = %u",
+              ipset_terminal_value(lhs), ipset_terminal_value(rhs), value);
+        return ipset_terminal_node_id(value);
+    }
+
+    /* Check whether we've already calculated the result for this pair
+     * of nodes. */
+    struct ipset_node_cache  *cache = data->cache;
+    struct ipset_op_cache_entry  *entry =
+        ipset_op_cache_slot(data, lhs, rhs);
+    if (entry->epoch == data->op_cache_epoch &&
+        entry->lhs == lhs && entry->rhs == rhs) {
+        DEBUG("Reusing result " IPSET_NODE_ID_FORMAT " for ("
+              IPSET_NODE_ID_FORMAT ", " IPSET_NODE_ID_FORMAT ")",
+              IPSET_NODE_ID_VALUES(entry->result),
+              IPSET_NODE_ID_VALUES(lhs), IPSET_NODE_ID_VALUES(rhs));
+        data->op_cache_hits++;
+        return ipset_node_incref(cache, entry->result);
+    }
+    data->op_cache_misses++;
+
+    /* We recurse on the smaller of the two variables.  Any operand whose
+     * variable is larger (including terminals) is passed down unchanged
+     * to both recursive calls. */
+
+    if (ipset_node_get_type(lhs) == IPSET_NONTERMINAL_NODE) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(cache, lhs);
+        lhs_var = ipset_node_variable(node);
+    }
+
+    if (ipset_node_get_type(rhs) == IPSET_NONTERMINAL_NODE) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(data->rhs_cache, rhs);
+        rhs_var = ipset_node_variable(node);
+    }
+
+    var = (lhs_var < rhs_var)? lhs_var: rhs_var;
+
+    if (lhs_var == var) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(cache, lhs);
+        lhs_low = ipset_edge_low(lhs, node);
+        lhs_high = ipset_edge_high(lhs, node);
+    }
+
+    if (rhs_var == var) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(data->rhs_cache, rhs);
+        rhs_low = ipset_edge_low(rhs, node);
+        rhs_high = ipset_edge_high(rhs, node);
+    }
+
+    DEBUG("[%3u] Recursing low", var);
+    result_low = ipset_apply_binary(data, lhs_low, rhs_low);
+    DEBUG("[%3u] Recursing high", var);
+    result_high = ipset_apply_binary(data, lhs_high, rhs_high);
+
+    ipset_node_id  result =
+        ipset_node_cache_nonterminal(cache, var, result_low, result_high);
+
+    /* The recursive calls might have overwritten the slot, so look it up
+     * again. */
+    entry = ipset_op_cache_slot(data, lhs, rhs);
+    entry->lhs = lhs;
+    entry->rhs = rhs;
+    entry->result = result;
+    entry->epoch = data->op_cache_epoch;
+    return result;
+}
+
+
+ipset_node_id
+ipset_node_apply(struct ipset_node_cache *cache, ipset_node_id lhs,
+                 const struct ipset_node_cache *rhs_cache, ipset_node_id rhs,
+                 ipset_binary_operator op, const void *user_data)
+{
+    struct ipset_apply_data  data;
+    ipset_node_id  result;
+
+    DEBUG("Applying binary operator");
+    data.cache = cache;
+    data.rhs_cache = rhs_cache;
+    data.op = op;
+    data.user_data = user_data;
+    data.op_cache_hits = 0;
+    data.op_cache_misses = 0;
+    ipset_node_cache_maybe_gc(cache);
+    ipset_op_cache_start
+        (&data, ipset_node_cache_index_count(cache) +
+         ipset_node_cache_index_count(rhs_cache));
+
+    result = ipset_apply_binary(&data, lhs, rhs);
+    ipset_op_cache_finish(&data);
+    return result;
+}
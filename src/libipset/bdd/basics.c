@@ -7,10 +7,14 @@
  * ----------------------------------------------------------------------
  */
 
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 #include <libcork/core.h>
+#include <libcork/threads.h>
 
 #include "ipset/bdd/nodes.h"
 #include "ipset/bits.h"
@@ -23,60 +27,326 @@ ipset_node_fprint(FILE *stream, struct ipset_node *node)
     fprintf(stream,
             "nonterminal(x%u? " IPSET_NODE_ID_FORMAT
             ": " IPSET_NODE_ID_FORMAT ")",
-            node->variable,
-            IPSET_NODE_ID_VALUES(node->high),
-            IPSET_NODE_ID_VALUES(node->low));
+            ipset_node_variable(node),
+            IPSET_NODE_ID_VALUES(ipset_node_high(node)),
+            IPSET_NODE_ID_VALUES(ipset_node_low(node)));
 }
 
 
+/* The free list in an ipset_node_cache is represented by a
+ * singly-linked list of indices into the chunk array.  Since the
+ * reference count is unused for nodes in the free list, we reuse it to
+ * store the "next" index. */
+
+#define IPSET_NULL_INDEX ((ipset_variable) -1)
+
+
+/*-----------------------------------------------------------------------
+ * Locking
+ */
+
+/* Concurrent caches protect their shared structures with spin locks.
+ * Each critical section is only a handful of instructions long, so
+ * it's not worth putting a waiting thread to sleep; we just give up the
+ * rest of our time slice so that the thread holding the lock can
+ * finish. */
+
+#define ipset_node_cache_is_concurrent(cache) \
+    (((cache)->flags & IPSET_NODE_CACHE_CONCURRENT) != 0)
+
+static void
+ipset_spin_lock(volatile unsigned int *lock)
+{
+    while (cork_uint_cas(lock, 0, 1) != 0) {
+        sched_yield();
+    }
+}
+
+static void
+ipset_spin_unlock(volatile unsigned int *lock)
+{
+    __sync_lock_release(lock);
+}
+
+#define ipset_node_cache_lock(cache, lock) \
+    do { \
+        if (ipset_node_cache_is_concurrent((cache))) { \
+            ipset_spin_lock((lock)); \
+        } \
+    } while (0)
+
+#define ipset_node_cache_unlock(cache, lock) \
+    do { \
+        if (ipset_node_cache_is_concurrent((cache))) { \
+            ipset_spin_unlock((lock)); \
+        } \
+    } while (0)
+
+
+/*-----------------------------------------------------------------------
+ * Unique table
+ */
+
+/* Each shard of the unique table is resized when it's more than 3/4
+ * full. */
+
 static cork_hash
-ipset_node_hash(void *user_data, const void *key)
+ipset_node_hash(ipset_variable variable, ipset_node_id low, ipset_node_id high)
 {
-    const struct ipset_node  *node = key;
     /* Hash of "ipset_node" */
     cork_hash  hash = 0xf3b7dc44;
-    hash = cork_hash_variable(hash, node->variable);
-    hash = cork_hash_variable(hash, node->low);
-    hash = cork_hash_variable(hash, node->high);
+    hash = cork_hash_variable(hash, variable);
+    hash = cork_hash_variable(hash, low);
+    hash = cork_hash_variable(hash, high);
     return hash;
 }
 
-static bool
-ipset_node_equals(void *user_data, const void *key1, const void *key2)
+#define ipset_unique_table_shard(cache, hash) \
+    (&(cache)->unique_table \
+     [((hash) >> (32 - IPSET_UNIQUE_TABLE_SHARD_BITS)) & \
+      (cache)->unique_table_shard_mask])
+
+static struct ipset_unique_slot *
+ipset_unique_table_new_slots(size_t size)
+{
+    struct ipset_unique_slot  *slots =
+        cork_malloc(size * sizeof(struct ipset_unique_slot));
+    size_t  i;
+    for (i = 0; i < size; i++) {
+        slots[i].index = IPSET_NULL_INDEX;
+    }
+    return slots;
+}
+
+static void
+ipset_unique_shard_init(struct ipset_unique_shard *shard, size_t size)
 {
-    const struct ipset_node  *node1 = key1;
-    const struct ipset_node  *node2 = key2;
+    shard->slots = ipset_unique_table_new_slots(size);
+    shard->size = size;
+    shard->count = 0;
+    shard->lock = 0;
+}
 
-    if (node1 == node2) {
-        return true;
+/* Add a node to a shard, which must have room for it. */
+static void
+ipset_unique_shard_add(struct ipset_unique_shard *shard,
+                       cork_hash hash, ipset_value index)
+{
+    size_t  mask = shard->size - 1;
+    size_t  i = hash & mask;
+    while (shard->slots[i].index != IPSET_NULL_INDEX) {
+        i = (i + 1) & mask;
     }
+    shard->slots[i].hash = hash;
+    shard->slots[i].index = index;
+}
 
-    return
-        (node1->variable == node2->variable) &&
-        (node1->low == node2->low) &&
-        (node1->high == node2->high);
+static void
+ipset_unique_shard_resize(struct ipset_unique_shard *shard, size_t new_size)
+{
+    struct ipset_unique_slot  *old_slots = shard->slots;
+    size_t  old_size = shard->size;
+    size_t  i;
+
+    DEBUG("        (resizing unique table shard to %zu slots)", new_size);
+    shard->slots = ipset_unique_table_new_slots(new_size);
+    shard->size = new_size;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_slots[i].index != IPSET_NULL_INDEX) {
+            ipset_unique_shard_add
+                (shard, old_slots[i].hash, old_slots[i].index);
+        }
+    }
+
+    free(old_slots);
 }
 
+/* Remove the node with the given index from the unique table.  We use
+ * backward-shift deletion, so that there are never any tombstones
+ * lengthening the probe sequences.  This is only ever called while a
+ * single thread has access to the cache. */
+static void
+ipset_unique_table_remove(struct ipset_node_cache *cache,
+                          struct ipset_node *node, ipset_value index)
+{
+    cork_hash  hash = ipset_node_hash
+        (ipset_node_variable(node), ipset_node_low(node),
+         ipset_node_high(node));
+    struct ipset_unique_shard  *shard = ipset_unique_table_shard(cache, hash);
+    size_t  mask = shard->size - 1;
+    size_t  i = hash & mask;
+    size_t  j;
 
-/* The free list in an ipset_node_cache is represented by a
- * singly-linked list of indices into the chunk array.  Since the
- * ipset_node instance is unused for nodes in the free list, we reuse
- * the refcount field to store the "next" index. */
+    while (shard->slots[i].index != index) {
+        i = (i + 1) & mask;
+    }
 
-#define IPSET_NULL_INDEX ((ipset_variable) -1)
+    /* Move any later entries in the same run of slots back into the
+     * hole, as long as that doesn't move them in front of their home
+     * slot. */
+    for (j = (i + 1) & mask; shard->slots[j].index != IPSET_NULL_INDEX;
+         j = (j + 1) & mask) {
+        size_t  home = shard->slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            shard->slots[i] = shard->slots[j];
+            i = j;
+        }
+    }
+
+    shard->slots[i].index = IPSET_NULL_INDEX;
+    shard->count--;
+    cache->unique_table_count--;
+}
+
+/*-----------------------------------------------------------------------
+ * Chunk allocation
+ */
+
+/* A mapping always takes up at least one (huge) page, so we only give a
+ * chunk its own mapping if it's large enough to fill a huge page.
+ * Smaller chunks, like the refcount chunks for a mid-sized node chunk,
+ * come from the regular heap. */
+#define IPSET_HUGE_PAGE_SIZE  ((size_t) 2 * 1024 * 1024)
+#define ipset_node_cache_maps_chunk(cache, size) \
+    (((cache)->flags & IPSET_NODE_CACHE_HUGE_PAGES) && \
+     (size) >= IPSET_HUGE_PAGE_SIZE)
+
+static void *
+ipset_node_cache_alloc_chunk(struct ipset_node_cache *cache, size_t size)
+{
+    if (ipset_node_cache_maps_chunk(cache, size)) {
+        void  *chunk = mmap
+            (NULL, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (CORK_UNLIKELY(chunk == MAP_FAILED)) {
+            fprintf(stderr, "Cannot map %zu bytes for BDD nodes\n", size);
+            abort();
+        }
+#if defined(MADV_HUGEPAGE)
+        /* This is only a hint, so we don't care if it fails. */
+        madvise(chunk, size, MADV_HUGEPAGE);
+#endif
+        /* Anonymous mappings are already zeroed. */
+        return chunk;
+    } else {
+        return cork_calloc(1, size);
+    }
+}
+
+static void
+ipset_node_cache_free_chunk(struct ipset_node_cache *cache,
+                            void *chunk, size_t size)
+{
+    if (ipset_node_cache_maps_chunk(cache, size)) {
+        munmap(chunk, size);
+    } else {
+        free(chunk);
+    }
+}
+
+#define ipset_node_chunk_size(cache) \
+    (((size_t) 1 << (cache)->chunk_bit_size) * sizeof(struct ipset_node))
+#define ipset_refcount_chunk_size(cache) \
+    (((size_t) 1 << (cache)->chunk_bit_size) * sizeof(unsigned int))
+
+/* Node indices have to fit into a node ID, with bits left over for
+ * the node type and the complement bit. */
+#define IPSET_MAX_NODE_COUNT  ((size_t) 1 << 30)
+#define ipset_node_cache_max_chunks(cache) \
+    (IPSET_MAX_NODE_COUNT >> (cache)->chunk_bit_size)
+
+static void
+ipset_node_cache_add_chunk(struct ipset_node_cache *cache)
+{
+    DEBUG("        (allocating chunk %zu)", cork_array_size(&cache->chunks));
+    if (CORK_UNLIKELY(cork_array_size(&cache->chunks) >=
+                      ipset_node_cache_max_chunks(cache))) {
+        fprintf(stderr, "Too many nodes in BDD node cache\n");
+        abort();
+    }
+    struct ipset_node  *new_chunk =
+        ipset_node_cache_alloc_chunk(cache, ipset_node_chunk_size(cache));
+    unsigned int  *new_refcounts =
+        ipset_node_cache_alloc_chunk(cache, ipset_refcount_chunk_size(cache));
+    cork_array_append(&cache->chunks, new_chunk);
+    cork_array_append(&cache->refcount_chunks, new_refcounts);
+}
+
+
+/*-----------------------------------------------------------------------
+ * Node caches
+ */
+
+/* Gives each concurrent cache (and each renumbering of its nodes) a
+ * distinct ID, so that a thread can tell whether the indices in its
+ * allocation slab belong to a particular cache. */
+static volatile size_t  ipset_next_alloc_id = 0;
 
 struct ipset_node_cache *
 ipset_node_cache_new()
+{
+    return ipset_node_cache_new_sized(IPSET_BDD_NODE_CACHE_BIT_SIZE, 0);
+}
+
+struct ipset_node_cache *
+ipset_node_cache_new_sized(unsigned int chunk_bit_size, unsigned int flags)
 {
     struct ipset_node_cache  *cache = cork_new(struct ipset_node_cache);
+    unsigned int  shard_count = 1;
+    unsigned int  i;
+
+    if (flags & IPSET_NODE_CACHE_CONCURRENT) {
+        flags |= IPSET_NODE_CACHE_DEFERRED_GC;
+        shard_count = 1 << IPSET_UNIQUE_TABLE_SHARD_BITS;
+        if (chunk_bit_size < IPSET_CONCURRENT_MIN_CHUNK_BIT_SIZE) {
+            chunk_bit_size = IPSET_CONCURRENT_MIN_CHUNK_BIT_SIZE;
+        }
+    }
+    if (chunk_bit_size > IPSET_BDD_NODE_CACHE_MAX_BIT_SIZE) {
+        chunk_bit_size = IPSET_BDD_NODE_CACHE_MAX_BIT_SIZE;
+    }
     cork_array_init(&cache->chunks);
+    cork_array_init(&cache->refcount_chunks);
+    cache->chunk_bit_size = chunk_bit_size;
+    cache->chunk_mask = (1 << chunk_bit_size) - 1;
+    cache->flags = flags;
     cache->largest_index = 0;
     cache->free_list = IPSET_NULL_INDEX;
-    cache->node_cache = cork_hash_table_new(0, 0);
-    cork_hash_table_set_hash
-        (cache->node_cache, (cork_hash_f) ipset_node_hash);
-    cork_hash_table_set_equals
-        (cache->node_cache, (cork_equals_f) ipset_node_equals);
+    cache->unique_table =
+        cork_calloc(shard_count, sizeof(struct ipset_unique_shard));
+    cache->unique_table_shard_mask = shard_count - 1;
+    cache->unique_table_count = 0;
+    for (i = 0; i < shard_count; i++) {
+        ipset_unique_shard_init
+            (&cache->unique_table[i], 1 << IPSET_UNIQUE_TABLE_MIN_BIT_SIZE);
+    }
+    cache->alloc_lock = 0;
+    cache->alloc_id = 0;
+    /* The operation cache is allocated the first time we need it. */
+    cache->op_cache = NULL;
+    cache->op_cache_size = 0;
+    cache->op_cache_epoch = 0;
+    cache->op_cache_hits = 0;
+    cache->op_cache_misses = 0;
+    cache->dead_count = 0;
+    cache->gc_threshold = IPSET_NODE_CACHE_DEFAULT_GC_THRESHOLD;
+    cache->gc_runs = 0;
+    cache->gc_last_reclaimed = 0;
+    cache->gc_total_reclaimed = 0;
+
+    if (flags & IPSET_NODE_CACHE_CONCURRENT) {
+        /* Other threads read the chunk arrays without any locks, so
+         * they can never be reallocated. */
+        cork_array_ensure_size
+            (&cache->chunks, ipset_node_cache_max_chunks(cache));
+        cork_array_ensure_size
+            (&cache->refcount_chunks, ipset_node_cache_max_chunks(cache));
+        cache->alloc_id = cork_size_atomic_add(&ipset_next_alloc_id, 1);
+        /* We can only collect garbage when asked to, since other
+         * threads might be in the middle of an operation. */
+        cache->gc_threshold = SIZE_MAX;
+    }
     return cache;
 }
 
@@ -85,53 +355,172 @@ ipset_node_cache_free(struct ipset_node_cache *cache)
 {
     size_t  i;
     for (i = 0; i < cork_array_size(&cache->chunks); i++) {
-        free(cork_array_at(&cache->chunks, i));
+        ipset_node_cache_free_chunk
+            (cache, cork_array_at(&cache->chunks, i),
+             ipset_node_chunk_size(cache));
+        ipset_node_cache_free_chunk
+            (cache, cork_array_at(&cache->refcount_chunks, i),
+             ipset_refcount_chunk_size(cache));
     }
     cork_array_done(&cache->chunks);
-    cork_hash_table_free(cache->node_cache);
+    cork_array_done(&cache->refcount_chunks);
+    for (i = 0; i <= cache->unique_table_shard_mask; i++) {
+        free(cache->unique_table[i].slots);
+    }
+    free(cache->unique_table);
+    free(cache->op_cache);
     free(cache);
 }
 
 
+/* Each thread that creates nodes in a concurrent cache claims a slab of
+ * node indices at a time, so that it only needs to take the cache's
+ * allocation lock once per slab.  A thread keeps a few slabs, for the
+ * last few caches it has used; if it switches between more caches than
+ * that, the unused indices in the slab that it drops are lost until the
+ * cache is compacted. */
+
+#define IPSET_NODE_CACHE_THREAD_SLABS  4
+
+struct ipset_node_slab {
+    size_t  alloc_id;
+    unsigned int  count;
+    ipset_value  indices[IPSET_NODE_CACHE_SLAB_SIZE];
+};
+
+static __thread struct ipset_node_slab
+    ipset_thread_slabs[IPSET_NODE_CACHE_THREAD_SLABS];
+
+static void
+ipset_node_cache_refill_slab(struct ipset_node_cache *cache,
+                             struct ipset_node_slab *slab)
+{
+    ipset_spin_lock(&cache->alloc_lock);
+    slab->alloc_id = cache->alloc_id;
+    slab->count = 0;
+
+    /* Reuse freed nodes if there are any... */
+    while (slab->count < IPSET_NODE_CACHE_SLAB_SIZE &&
+           cache->free_list != IPSET_NULL_INDEX) {
+        ipset_value  index = cache->free_list;
+        cache->free_list = *ipset_node_cache_get_refcount_by_index(cache, index);
+        slab->indices[slab->count++] = index;
+    }
+
+    /* ...and otherwise claim a fresh range.  We hand out the indices
+     * from the end of the slab, so store them in reverse to use them in
+     * increasing order. */
+    if (slab->count == 0) {
+        ipset_value  first = cache->largest_index;
+        unsigned int  i;
+        cache->largest_index += IPSET_NODE_CACHE_SLAB_SIZE;
+        while ((cork_array_size(&cache->chunks) << cache->chunk_bit_size) <
+               cache->largest_index) {
+            ipset_node_cache_add_chunk(cache);
+        }
+        for (i = 0; i < IPSET_NODE_CACHE_SLAB_SIZE; i++) {
+            slab->indices[i] = first + IPSET_NODE_CACHE_SLAB_SIZE - 1 - i;
+        }
+        slab->count = IPSET_NODE_CACHE_SLAB_SIZE;
+    }
+
+    ipset_spin_unlock(&cache->alloc_lock);
+}
+
 /**
  * Returns the index of a new ipset_node instance.
  */
 static ipset_value
 ipset_node_cache_alloc_node(struct ipset_node_cache *cache)
 {
+    if (ipset_node_cache_is_concurrent(cache)) {
+        struct ipset_node_slab  *slab = &ipset_thread_slabs
+            [cache->alloc_id % IPSET_NODE_CACHE_THREAD_SLABS];
+        if (slab->alloc_id != cache->alloc_id || slab->count == 0) {
+            ipset_node_cache_refill_slab(cache, slab);
+        }
+        return slab->indices[--slab->count];
+    }
+
     if (cache->free_list == IPSET_NULL_INDEX) {
         /* Nothing in the free list; need to allocate a new node. */
         ipset_value  next_index = cache->largest_index++;
-        ipset_value  chunk_index = next_index >> IPSET_BDD_NODE_CACHE_BIT_SIZE;
+        ipset_value  chunk_index =
+            ipset_nonterminal_chunk_index(cache, next_index);
         if (chunk_index >= cork_array_size(&cache->chunks)) {
             /* We've filled up all of the existing chunks, and need to
              * create a new one. */
-            DEBUG("        (allocating chunk %zu)",
-                  cork_array_size(&cache->chunks));
-            struct ipset_node  *new_chunk = cork_calloc
-                (IPSET_BDD_NODE_CACHE_SIZE, sizeof(struct ipset_node));
-            cork_array_append(&cache->chunks, new_chunk);
+            ipset_node_cache_add_chunk(cache);
         }
         return next_index;
     } else {
         /* Reuse a recently freed node. */
         ipset_value  next_index = cache->free_list;
-        struct ipset_node  *node =
-            ipset_node_cache_get_nonterminal_by_index(cache, next_index);
-        cache->free_list = node->refcount;
+        cache->free_list =
+            *ipset_node_cache_get_refcount_by_index(cache, next_index);
         return next_index;
     }
 }
 
+size_t
+ipset_node_cache_index_count(const struct ipset_node_cache *cache)
+{
+    /* Taking the lock doesn't change anything that a caller could see,
+     * so we can still promise not to modify the cache. */
+    volatile unsigned int  *lock = (volatile unsigned int *) &cache->alloc_lock;
+    size_t  result;
+    ipset_node_cache_lock(cache, lock);
+    result = cache->largest_index;
+    ipset_node_cache_unlock(cache, lock);
+    return result;
+}
+
+void
+ipset_node_cache_reserve(struct ipset_node_cache *cache, size_t node_count)
+{
+    size_t  needed_index = cache->largest_index + node_count;
+    size_t  shard_count = cache->unique_table_shard_mask + 1;
+    size_t  i;
+
+    DEBUG("Reserving space for %zu nodes", node_count);
+    while ((cork_array_size(&cache->chunks) << cache->chunk_bit_size) <
+           needed_index) {
+        ipset_node_cache_add_chunk(cache);
+    }
+
+    /* Assume that the new nodes will be spread evenly across the
+     * shards. */
+    for (i = 0; i < shard_count; i++) {
+        struct ipset_unique_shard  *shard = &cache->unique_table[i];
+        size_t  needed_count = shard->count + node_count / shard_count;
+        size_t  table_size = shard->size;
+        while (needed_count * 4 > table_size * 3) {
+            table_size *= 2;
+        }
+        if (table_size > shard->size) {
+            ipset_unique_shard_resize(shard, table_size);
+        }
+    }
+}
+
 ipset_node_id
 ipset_node_incref(struct ipset_node_cache *cache, ipset_node_id node_id)
 {
     if (ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE) {
-        struct ipset_node  *node =
-            ipset_node_cache_get_nonterminal(cache, node_id);
+        unsigned int  *refcount = ipset_node_cache_get_refcount_by_index
+            (cache, ipset_nonterminal_value(node_id));
         DEBUG("        [incref " IPSET_NODE_ID_FORMAT "]",
               IPSET_NODE_ID_VALUES(node_id));
-        node->refcount++;
+        if (ipset_node_cache_is_concurrent(cache)) {
+            if (CORK_UNLIKELY(cork_uint_atomic_add(refcount, 1) == 1)) {
+                cork_size_atomic_sub(&cache->dead_count, 1);
+            }
+        } else if (CORK_UNLIKELY((*refcount)++ == 0)) {
+            /* This was a dead node that hadn't been collected yet. */
+            DEBUG("        [revive " IPSET_NODE_ID_FORMAT "]",
+                  IPSET_NODE_ID_VALUES(node_id));
+            cache->dead_count--;
+        }
     }
     return node_id;
 }
@@ -140,20 +529,40 @@ void
 ipset_node_decref(struct ipset_node_cache *cache, ipset_node_id node_id)
 {
     if (ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE) {
-        struct ipset_node  *node =
-            ipset_node_cache_get_nonterminal(cache, node_id);
+        ipset_value  index = ipset_nonterminal_value(node_id);
+        unsigned int  *refcount =
+            ipset_node_cache_get_refcount_by_index(cache, index);
         DEBUG("        [decref " IPSET_NODE_ID_FORMAT "]",
               IPSET_NODE_ID_VALUES(node_id));
-        if (--node->refcount == 0) {
+        if (ipset_node_cache_is_concurrent(cache)) {
+            /* Concurrent caches always defer garbage collection. */
+            if (cork_uint_atomic_sub(refcount, 1) == 0) {
+                cork_size_atomic_add(&cache->dead_count, 1);
+            }
+            return;
+        }
+
+        if (--(*refcount) == 0) {
+            if (cache->flags & IPSET_NODE_CACHE_DEFERRED_GC) {
+                /* Leave the node (and its references to its children)
+                 * in place until the next garbage collection. */
+                DEBUG("        [dead   " IPSET_NODE_ID_FORMAT "]",
+                      IPSET_NODE_ID_VALUES(node_id));
+                cache->dead_count++;
+                return;
+            }
+
+            struct ipset_node  *node =
+                ipset_node_cache_get_nonterminal_by_index(cache, index);
             DEBUG("        [free   " IPSET_NODE_ID_FORMAT "]",
                   IPSET_NODE_ID_VALUES(node_id));
-            ipset_node_decref(cache, node->low);
-            ipset_node_decref(cache, node->high);
-            cork_hash_table_delete(cache->node_cache, node, NULL, NULL);
+            ipset_unique_table_remove(cache, node, index);
+            ipset_node_decref(cache, ipset_node_low(node));
+            ipset_node_decref(cache, ipset_node_high(node));
 
             /* Add the node to the free list */
-            node->refcount = cache->free_list;
-            cache->free_list = ipset_nonterminal_value(node_id);
+            *refcount = cache->free_list;
+            cache->free_list = index;
         }
     }
 }
@@ -171,16 +580,25 @@ ipset_node_cache_nodes_equal(const struct ipset_node_cache *cache1,
         return false;
     }
 
-    if (ipset_node_get_type(node_id1) == IPSET_TERMINAL_NODE) {
+    /* Since BDDs are reduced, two nodes from the same cache are equal
+     * exactly when they have the same ID. */
+    if (cache1 == cache2 ||
+        ipset_node_get_type(node_id1) == IPSET_TERMINAL_NODE) {
         return node_id1 == node_id2;
     }
 
+    /* Only one of the caches might use complement edges, so we compare
+     * the functions that the edges stand for, not the edges. */
     node1 = ipset_node_cache_get_nonterminal(cache1, node_id1);
     node2 = ipset_node_cache_get_nonterminal(cache2, node_id2);
     return
-        (node1->variable == node2->variable) &&
-        ipset_node_cache_nodes_equal(cache1, node1->low, cache2, node2->low) &&
-        ipset_node_cache_nodes_equal(cache1, node1->high, cache2, node2->high);
+        (ipset_node_variable(node1) == ipset_node_variable(node2)) &&
+        ipset_node_cache_nodes_equal
+            (cache1, ipset_edge_low(node_id1, node1),
+             cache2, ipset_edge_low(node_id2, node2)) &&
+        ipset_node_cache_nodes_equal
+            (cache1, ipset_edge_high(node_id1, node1),
+             cache2, ipset_edge_high(node_id2, node2));
 }
 
 ipset_node_id
@@ -198,50 +616,345 @@ ipset_node_cache_nonterminal(struct ipset_node_cache *cache,
         return low;
     }
 
+    /* With complement edges, a node and its negation share storage.  To
+     * keep that representation canonical, the low edge of a stored node
+     * is never complemented, and is never the 1 terminal; if it would
+     * be, we store the negated node instead, and complement the edge
+     * that points to it. */
+    if ((cache->flags & IPSET_NODE_CACHE_COMPLEMENT_EDGES) &&
+        (low & IPSET_COMPLEMENT_BIT)) {
+        return ipset_node_complement
+            (ipset_node_cache_nonterminal
+             (cache, variable, ipset_node_complement(low),
+              ipset_node_complement(high)));
+    }
+
     /* Check to see if there's already a nonterminal with these contents
      * in the cache. */
     DEBUG("        [search nonterminal(x%u? "
           IPSET_NODE_ID_FORMAT ": " IPSET_NODE_ID_FORMAT ")]",
           variable, IPSET_NODE_ID_VALUES(high), IPSET_NODE_ID_VALUES(low));
 
-    struct ipset_node  search_node;
-    search_node.variable = variable;
-    search_node.low = low;
-    search_node.high = high;
+    cork_hash  hash = ipset_node_hash(variable, low, high);
+    struct ipset_unique_shard  *shard = ipset_unique_table_shard(cache, hash);
+    size_t  mask;
+    size_t  i;
 
-    bool  is_new;
-    struct cork_hash_table_entry  *entry =
-        cork_hash_table_get_or_create
-        (cache->node_cache, &search_node, &is_new);
+    ipset_node_cache_lock(cache, &shard->lock);
+    mask = shard->size - 1;
+    for (i = hash & mask; shard->slots[i].index != IPSET_NULL_INDEX;
+         i = (i + 1) & mask) {
+        if (shard->slots[i].hash == hash) {
+            ipset_value  index = shard->slots[i].index;
+            struct ipset_node  *node =
+                ipset_node_cache_get_nonterminal_by_index(cache, index);
+            if (ipset_node_variable(node) == variable &&
+                ipset_node_low(node) == low &&
+                ipset_node_high(node) == high) {
+                /* There's already a node with these contents, so return
+                 * its ID.  (Nodes in a concurrent cache are only freed
+                 * while no other threads are using it, so it's safe to
+                 * release the lock before taking our reference.) */
+                ipset_node_id  node_id = ipset_nonterminal_node_id(index);
+                ipset_node_cache_unlock(cache, &shard->lock);
+                DEBUG("        [reuse  " IPSET_NODE_ID_FORMAT "]",
+                      IPSET_NODE_ID_VALUES(node_id));
+                ipset_node_incref(cache, node_id);
+                ipset_node_decref(cache, low);
+                ipset_node_decref(cache, high);
+                return node_id;
+            }
+        }
+    }
 
-    if (!is_new) {
-        /* There's already a node with these contents, so return its ID. */
-        ipset_node_id  node_id = (uintptr_t) entry->value;
-        DEBUG("        [reuse  " IPSET_NODE_ID_FORMAT "]",
-              IPSET_NODE_ID_VALUES(node_id));
-        ipset_node_incref(cache, node_id);
-        ipset_node_decref(cache, low);
-        ipset_node_decref(cache, high);
-        return node_id;
+    /* This node doesn't exist yet.  Allocate a permanent copy of the
+     * node, add it to the cache, and then return its ID.  If the shard
+     * is getting full, we have to grow it first, which means finding a
+     * new empty slot. */
+    if (CORK_UNLIKELY((shard->count + 1) * 4 > shard->size * 3)) {
+        ipset_unique_shard_resize(shard, shard->size * 2);
+        mask = shard->size - 1;
+        for (i = hash & mask;
+             shard->slots[i].index != IPSET_NULL_INDEX;
+             i = (i + 1) & mask) {
+        }
+    }
+
+    ipset_value  new_index = ipset_node_cache_alloc_node(cache);
+    ipset_node_id  new_node_id = ipset_nonterminal_node_id(new_index);
+#if IPSET_COMPACT_NODES
+    if (CORK_UNLIKELY((new_node_id | IPSET_COMPLEMENT_BIT) > IPSET_MAX_NODE_ID ||
+                      low > IPSET_MAX_NODE_ID || high > IPSET_MAX_NODE_ID)) {
+        fprintf(stderr, "Node ID too large for compact BDD nodes\n");
+        abort();
+    }
+#endif
+    struct ipset_node  *real_node =
+        ipset_node_cache_get_nonterminal_by_index(cache, new_index);
+    *ipset_node_cache_get_refcount_by_index(cache, new_index) = 1;
+    ipset_node_set(real_node, variable, low, high);
+    shard->slots[i].hash = hash;
+    shard->slots[i].index = new_index;
+    shard->count++;
+    ipset_node_cache_unlock(cache, &shard->lock);
+
+    if (ipset_node_cache_is_concurrent(cache)) {
+        cork_size_atomic_add(&cache->unique_table_count, 1);
     } else {
-        /* This node doesn't exist yet.  Allocate a permanent copy of
-         * the node, add it to the cache, and then return its ID. */
-        ipset_value  new_index = ipset_node_cache_alloc_node(cache);
-        ipset_node_id  new_node_id = ipset_nonterminal_node_id(new_index);
-        struct ipset_node  *real_node =
-            ipset_node_cache_get_nonterminal_by_index(cache, new_index);
-        real_node->refcount = 1;
-        real_node->variable = variable;
-        real_node->low = low;
-        real_node->high = high;
-        entry->key = real_node;
-        entry->value = (void *) (uintptr_t) new_node_id;
-        DEBUG("        [new    " IPSET_NODE_ID_FORMAT "]",
-              IPSET_NODE_ID_VALUES(new_node_id));
-        return new_node_id;
+        cache->unique_table_count++;
+    }
+    DEBUG("        [new    " IPSET_NODE_ID_FORMAT "]",
+          IPSET_NODE_ID_VALUES(new_node_id));
+    return new_node_id;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Garbage collection
+ */
+
+void
+ipset_node_cache_set_gc_threshold(struct ipset_node_cache *cache,
+                                  size_t threshold)
+{
+    if (!ipset_node_cache_is_concurrent(cache)) {
+        cache->gc_threshold = threshold;
     }
 }
 
+size_t
+ipset_node_cache_gc(struct ipset_node_cache *cache)
+{
+    cork_array(ipset_value)  dead;
+    size_t  reclaimed = 0;
+    size_t  i;
+    size_t  j;
+
+    if (cache->dead_count == 0) {
+        return 0;
+    }
+
+    /* Find all of the dead nodes.  We have to collect them first, since
+     * removing them from the unique table moves other entries around. */
+    DEBUG("Collecting %zu dead nodes", cache->dead_count);
+    cork_array_init(&dead);
+    for (i = 0; i <= cache->unique_table_shard_mask; i++) {
+        struct ipset_unique_shard  *shard = &cache->unique_table[i];
+        for (j = 0; j < shard->size; j++) {
+            ipset_value  index = shard->slots[j].index;
+            if (index != IPSET_NULL_INDEX &&
+                *ipset_node_cache_get_refcount_by_index(cache, index) == 0) {
+                cork_array_append(&dead, index);
+            }
+        }
+    }
+
+    /* Free each dead node.  That releases its references to its
+     * children, which might cause them to die, too; if so, we free them
+     * in the same pass. */
+    while (cork_array_size(&dead) > 0) {
+        ipset_value  index = cork_array_at(&dead, --dead.size);
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal_by_index(cache, index);
+        ipset_node_id  children[2] = {
+            ipset_node_low(node), ipset_node_high(node)
+        };
+
+        ipset_unique_table_remove(cache, node, index);
+        for (j = 0; j < 2; j++) {
+            if (ipset_node_get_type(children[j]) == IPSET_NONTERMINAL_NODE) {
+                ipset_value  child = ipset_nonterminal_value(children[j]);
+                if (--(*ipset_node_cache_get_refcount_by_index
+                       (cache, child)) == 0) {
+                    cork_array_append(&dead, child);
+                }
+            }
+        }
+
+        *ipset_node_cache_get_refcount_by_index(cache, index) =
+            cache->free_list;
+        cache->free_list = index;
+        reclaimed++;
+    }
+
+    cork_array_done(&dead);
+    cache->dead_count = 0;
+    cache->gc_runs++;
+    cache->gc_last_reclaimed = reclaimed;
+    cache->gc_total_reclaimed += reclaimed;
+    DEBUG("Reclaimed %zu nodes", reclaimed);
+    return reclaimed;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Compaction
+ */
+
+/* The largest variable index that fits into a node. */
+#define IPSET_VARIABLE_COUNT  256
+
+static ipset_node_id
+ipset_compact_remap(const ipset_value *new_indices, ipset_node_id node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_NONTERMINAL_NODE) {
+        return ipset_nonterminal_node_id
+            (new_indices[ipset_nonterminal_value(node_id)]) |
+            (node_id & IPSET_COMPLEMENT_BIT);
+    } else {
+        return node_id;
+    }
+}
+
+void
+ipset_node_cache_compact(struct ipset_node_cache *cache,
+                         ipset_node_id **roots, size_t root_count)
+{
+    ipset_value  old_count = cache->largest_index;
+    ipset_value  live_count = 0;
+    ipset_value  *new_indices;
+    size_t  level_starts[IPSET_VARIABLE_COUNT + 1];
+    ipset_value  index;
+    size_t  i;
+    size_t  j;
+
+    /* Make sure that every node in the unique table is live. */
+    ipset_node_cache_gc(cache);
+    old_count = cache->largest_index;
+    DEBUG("Compacting node cache with %u nodes", old_count);
+
+    /* Mark which of the nodes are in the unique table, and count how
+     * many live nodes there are at each level.  Any other index is
+     * either in the free list, or was claimed by a thread's allocation
+     * slab but never used. */
+    new_indices = cork_malloc((old_count + 1) * sizeof(ipset_value));
+    for (index = 0; index <= old_count; index++) {
+        new_indices[index] = IPSET_NULL_INDEX;
+    }
+    for (i = 0; i <= cache->unique_table_shard_mask; i++) {
+        struct ipset_unique_shard  *shard = &cache->unique_table[i];
+        for (j = 0; j < shard->size; j++) {
+            if (shard->slots[j].index != IPSET_NULL_INDEX) {
+                new_indices[shard->slots[j].index] = 0;
+            }
+        }
+    }
+
+    memset(level_starts, 0, sizeof(level_starts));
+    for (index = 0; index < old_count; index++) {
+        if (new_indices[index] != IPSET_NULL_INDEX) {
+            struct ipset_node  *node =
+                ipset_node_cache_get_nonterminal_by_index(cache, index);
+            level_starts[ipset_node_variable(node) + 1]++;
+            live_count++;
+        }
+    }
+
+    /* Renumber the live nodes in level order, so that all of the nodes
+     * for a variable are next to each other, and a node's parents come
+     * before it.  Within a level, nodes keep their old relative
+     * order. */
+    for (i = 0; i < IPSET_VARIABLE_COUNT; i++) {
+        level_starts[i + 1] += level_starts[i];
+    }
+
+    for (index = 0; index < old_count; index++) {
+        if (new_indices[index] != IPSET_NULL_INDEX) {
+            struct ipset_node  *node =
+                ipset_node_cache_get_nonterminal_by_index(cache, index);
+            new_indices[index] = level_starts[ipset_node_variable(node)]++;
+        }
+    }
+
+    /* Copy the live nodes into a fresh set of chunks. */
+    struct ipset_node_cache  old_cache = *cache;
+    cork_array_init(&cache->chunks);
+    cork_array_init(&cache->refcount_chunks);
+    cache->largest_index = live_count;
+    cache->free_list = IPSET_NULL_INDEX;
+    if (ipset_node_cache_is_concurrent(cache)) {
+        cork_array_ensure_size
+            (&cache->chunks, ipset_node_cache_max_chunks(cache));
+        cork_array_ensure_size
+            (&cache->refcount_chunks, ipset_node_cache_max_chunks(cache));
+        /* Any indices in threads' allocation slabs are now stale. */
+        cache->alloc_id = cork_size_atomic_add(&ipset_next_alloc_id, 1);
+    }
+    while ((cork_array_size(&cache->chunks) << cache->chunk_bit_size) <
+           live_count) {
+        ipset_node_cache_add_chunk(cache);
+    }
+
+    for (index = 0; index < old_count; index++) {
+        ipset_value  new_index = new_indices[index];
+        if (new_index != IPSET_NULL_INDEX) {
+            struct ipset_node  *old_node =
+                ipset_node_cache_get_nonterminal_by_index(&old_cache, index);
+            struct ipset_node  *new_node =
+                ipset_node_cache_get_nonterminal_by_index(cache, new_index);
+            ipset_node_set
+                (new_node, ipset_node_variable(old_node),
+                 ipset_compact_remap(new_indices, ipset_node_low(old_node)),
+                 ipset_compact_remap(new_indices, ipset_node_high(old_node)));
+            *ipset_node_cache_get_refcount_by_index(cache, new_index) =
+                *ipset_node_cache_get_refcount_by_index(&old_cache, index);
+        }
+    }
+
+    for (i = 0; i < cork_array_size(&old_cache.chunks); i++) {
+        ipset_node_cache_free_chunk
+            (cache, cork_array_at(&old_cache.chunks, i),
+             ipset_node_chunk_size(cache));
+        ipset_node_cache_free_chunk
+            (cache, cork_array_at(&old_cache.refcount_chunks, i),
+             ipset_refcount_chunk_size(cache));
+    }
+    cork_array_done(&old_cache.chunks);
+    cork_array_done(&old_cache.refcount_chunks);
+
+    /* Rebuild the unique table, starting each shard at the smallest
+     * size and growing it as needed to hold the live nodes. */
+    for (i = 0; i <= cache->unique_table_shard_mask; i++) {
+        free(cache->unique_table[i].slots);
+        ipset_unique_shard_init
+            (&cache->unique_table[i], 1 << IPSET_UNIQUE_TABLE_MIN_BIT_SIZE);
+    }
+    cache->unique_table_count = live_count;
+    for (index = 0; index < live_count; index++) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal_by_index(cache, index);
+        cork_hash  hash = ipset_node_hash
+            (ipset_node_variable(node), ipset_node_low(node),
+             ipset_node_high(node));
+        struct ipset_unique_shard  *shard =
+            ipset_unique_table_shard(cache, hash);
+        if ((shard->count + 1) * 4 > shard->size * 3) {
+            ipset_unique_shard_resize(shard, shard->size * 2);
+        }
+        ipset_unique_shard_add(shard, hash, index);
+        shard->count++;
+    }
+
+    /* The operation cache refers to the old node IDs, so throw it
+     * away; it will be reallocated by the next APPLY. */
+    free(cache->op_cache);
+    cache->op_cache = NULL;
+    cache->op_cache_size = 0;
+    cache->op_cache_epoch = 0;
+
+    /* And finally update the caller's roots. */
+    for (i = 0; i < root_count; i++) {
+        *roots[i] = ipset_compact_remap(new_indices, *roots[i]);
+    }
+
+    DEBUG("Compacted node cache to %u nodes", live_count);
+    free(new_indices);
+}
+
+
+/*-----------------------------------------------------------------------
+ * BDD operators
+ */
 
 bool
 ipset_bool_array_assignment(const void *user_data, ipset_variable variable)
@@ -272,20 +985,21 @@ ipset_node_evaluate(const struct ipset_node_cache *cache, ipset_node_id node_id,
         /* We have to look up this variable in the assignment. */
         struct ipset_node  *node =
             ipset_node_cache_get_nonterminal(cache, curr_node_id);
-        bool  this_value = assignment(user_data, node->variable);
+        ipset_variable  variable = ipset_node_variable(node);
+        bool  this_value = assignment(user_data, variable);
         DEBUG("[%3u] Nonterminal " IPSET_NODE_ID_FORMAT,
-              node->variable, IPSET_NODE_ID_VALUES(curr_node_id));
+              variable, IPSET_NODE_ID_VALUES(curr_node_id));
         DEBUG("[%3u]   x%u = %s",
-              node->variable, node->variable, this_value? "TRUE": "FALSE");
+              variable, variable, this_value? "TRUE": "FALSE");
 
         if (this_value) {
             /* This node's variable is true in the assignment vector, so
              * trace down the high subtree. */
-            curr_node_id = node->high;
+            curr_node_id = ipset_edge_high(curr_node_id, node);
         } else {
             /* This node's variable is false in the assignment vector,
              * so trace down the low subtree. */
-            curr_node_id = node->low;
+            curr_node_id = ipset_edge_low(curr_node_id, node);
         }
     }
 
@@ -304,9 +1018,6 @@ struct ipset_fake_node {
     ipset_value  value;
 };
 
-/* A fake BDD node representing the terminal 0 value. */
-static struct ipset_fake_node  fake_terminal_0 = { 0, 0, NULL, 0, 0 };
-
 /* We set elements in a map using the if-then-else (ITE) operator:
  *
  *   new_set = new_element? new_value: old_set
@@ -316,6 +1027,12 @@ static struct ipset_fake_node  fake_terminal_0 = { 0, 0, NULL, 0, 0 };
  * wrinkle that the F argument to ITE (i.e., new_element) is given by an
  * assignment, and not by a BDD node.  (This lets us skip constructing the BDD
  * for the assignment, saving us a few cycles.)
+ *
+ * We don't need the result cache because F is a single path through the
+ * variables, and H's variable is never smaller than F's.  At each level, one
+ * of the recursive calls sees the 0 terminal for F and returns right away, so
+ * each (F, H) pair is visited at most once.  (Compare with the binary APPLY
+ * in apply.c, which does use a cache.)
  */
 
 static ipset_node_id
@@ -326,6 +1043,10 @@ ipset_apply_ite(struct ipset_node_cache *cache, struct ipset_fake_node *f,
     ipset_node_id  h_high;
     ipset_node_id  result_low;
     ipset_node_id  result_high;
+    /* A fake BDD node representing the terminal 0 value.  This lives on
+     * the stack so that several threads can insert into the same cache
+     * at once. */
+    struct ipset_fake_node  fake_terminal_0;
 
     /* If F is a terminal, then we're in one of the following two
      * cases:
@@ -378,24 +1099,24 @@ ipset_apply_ite(struct ipset_node_cache *cache, struct ipset_fake_node *f,
             ipset_node_cache_get_nonterminal(cache, h);
 
         DEBUG("[%3u] H is nonterminal (variable %u)",
-              f->current_var, h_node->variable);
+              f->current_var, ipset_node_variable(h_node));
 
-        if (h_node->variable < f->current_var) {
+        if (ipset_node_variable(h_node) < f->current_var) {
             /* var(F) > var(H), so we only recurse down the H branches. */
             DEBUG("[%3u] Recursing only down H", f->current_var);
             DEBUG("[%3u]   Recursing high", f->current_var);
-            result_high = ipset_apply_ite(cache, f, g, h_node->high);
+            result_high = ipset_apply_ite(cache, f, g, ipset_edge_high(h, h_node));
             DEBUG("[%3u]   Back from high recursion", f->current_var);
             DEBUG("[%3u]   Recursing low", f->current_var);
-            result_low = ipset_apply_ite(cache, f, g, h_node->low);
+            result_low = ipset_apply_ite(cache, f, g, ipset_edge_low(h, h_node));
             DEBUG("[%3u]   Back from low recursion", f->current_var);
             return ipset_node_cache_nonterminal
-                (cache, h_node->variable, result_low, result_high);
-        } else if (h_node->variable == f->current_var) {
+                (cache, ipset_node_variable(h_node), result_low, result_high);
+        } else if (ipset_node_variable(h_node) == f->current_var) {
             /* var(F) == var(H), so we recurse down both branches. */
             DEBUG("[%3u] Recursing down both F and H", f->current_var);
-            h_low = h_node->low;
-            h_high = h_node->high;
+            h_low = ipset_edge_low(h, h_node);
+            h_high = ipset_edge_high(h, h_node);
         } else {
             /* var(F) < var(H), so we only recurse down the F branches. */
             DEBUG("[%3u] Recursing only down F", f->current_var);
@@ -430,6 +1151,7 @@ ipset_apply_ite(struct ipset_node_cache *cache, struct ipset_fake_node *f,
         DEBUG("[%3u]   Recursing low", f->current_var);
         fake_terminal_0.current_var = f->var_count;
         fake_terminal_0.var_count = f->var_count;
+        fake_terminal_0.value = 0;
         result_low = ipset_apply_ite(cache, &fake_terminal_0, g, h_low);
         DEBUG("[%3u]   Back from low recursion: " IPSET_NODE_ID_FORMAT,
               f->current_var, IPSET_NODE_ID_VALUES(result_low));
@@ -440,6 +1162,7 @@ ipset_apply_ite(struct ipset_node_cache *cache, struct ipset_fake_node *f,
         DEBUG("[%3u]   Recursing high", f->current_var);
         fake_terminal_0.current_var = f->var_count;
         fake_terminal_0.var_count = f->var_count;
+        fake_terminal_0.value = 0;
         result_high = ipset_apply_ite(cache, &fake_terminal_0, g, h_high);
         DEBUG("[%3u]   Back from high recursion: " IPSET_NODE_ID_FORMAT,
               f->current_var, IPSET_NODE_ID_VALUES(result_high));
@@ -462,5 +1185,6 @@ ipset_node_insert(struct ipset_node_cache *cache, ipset_node_id node,
 {
     struct ipset_fake_node  f = { 0, var_count, assignment, user_data, 1 };
     DEBUG("Inserting new element");
+    ipset_node_cache_maybe_gc(cache);
     return ipset_apply_ite(cache, &f, value, node);
 }
@@ -33,9 +33,10 @@ add_node(struct ipset_bdd_iterator *iterator, ipset_node_id node_id)
             ipset_node_cache_get_nonterminal(iterator->cache, node_id);
 
         cork_array_append(&iterator->stack, node_id);
-        ipset_assignment_set(iterator->assignment, node->variable, false);
+        ipset_assignment_set
+            (iterator->assignment, ipset_node_variable(node), false);
 
-        node_id = node->low;
+        node_id = ipset_edge_low(node_id, node);
     }
 
     /* Once we find a terminal node, save it away in the iterator result
@@ -95,9 +96,10 @@ ipset_bdd_iterator_advance(struct ipset_bdd_iterator *iterator)
 
         struct ipset_node  *last_node =
             ipset_node_cache_get_nonterminal(iterator->cache, last_node_id);
+        ipset_variable  last_variable = ipset_node_variable(last_node);
 
         enum ipset_tribool  current_value =
-            ipset_assignment_get(iterator->assignment, last_node->variable);
+            ipset_assignment_get(iterator->assignment, last_variable);
 
         /* The current value can't be EITHER, because we definitely
          * assign a TRUE or FALSE to the variables of the nodes that we
@@ -110,14 +112,14 @@ ipset_bdd_iterator_advance(struct ipset_bdd_iterator *iterator)
             /* Before continuing, reset this node's variable to
              * indeterminate in the assignment. */
             ipset_assignment_set
-                (iterator->assignment, last_node->variable, IPSET_EITHER);
+                (iterator->assignment, last_variable, IPSET_EITHER);
         } else {
             /* We've checked this node's low edge, but not its high
              * edge.  Set the variable to TRUE in the assignment, and
              * add the high edge's node to the node stack. */
             ipset_assignment_set
-                (iterator->assignment, last_node->variable, IPSET_TRUE);
-            add_node(iterator, last_node->high);
+                (iterator->assignment, last_variable, IPSET_TRUE);
+            add_node(iterator, ipset_edge_high(last_node_id, last_node));
             return;
         }
     }
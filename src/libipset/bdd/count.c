@@ -0,0 +1,258 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/logging.h"
+
+
+/*-----------------------------------------------------------------------
+ * 128-bit arithmetic
+ */
+
+static const struct ipset_uint128  IPSET_UINT128_MAX =
+    { UINT64_MAX, UINT64_MAX };
+
+static struct ipset_uint128
+ipset_uint128_add(struct ipset_uint128 a, struct ipset_uint128 b)
+{
+    struct ipset_uint128  result;
+    uint64_t  carry;
+    result.low = a.low + b.low;
+    carry = (result.low < a.low);
+    if (b.high > UINT64_MAX - a.high ||
+        (carry && a.high + b.high == UINT64_MAX)) {
+        return IPSET_UINT128_MAX;
+    }
+    result.high = a.high + b.high + carry;
+    return result;
+}
+
+/* Multiply a by 2^shift. */
+static struct ipset_uint128
+ipset_uint128_shl(struct ipset_uint128 a, unsigned int shift)
+{
+    struct ipset_uint128  result;
+    if (shift == 0 || (a.high == 0 && a.low == 0)) {
+        return a;
+    }
+    if (shift >= 128) {
+        return IPSET_UINT128_MAX;
+    }
+    if (shift >= 64) {
+        if (a.high != 0 ||
+            (shift > 64 && (a.low >> (128 - shift)) != 0)) {
+            return IPSET_UINT128_MAX;
+        }
+        result.high = a.low << (shift - 64);
+        result.low = 0;
+    } else {
+        if ((a.high >> (64 - shift)) != 0) {
+            return IPSET_UINT128_MAX;
+        }
+        result.high = (a.high << shift) | (a.low >> (64 - shift));
+        result.low = a.low << shift;
+    }
+    return result;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Model counting
+ */
+
+struct ipset_count_data {
+    const struct ipset_node_cache  *cache;
+    ipset_value  value;
+    ipset_variable  var_count;
+    /* Maps each node ID that we've already counted to one more than the
+     * index of its count in counts.  We key on the whole node ID, since
+     * a complemented edge has a different count than a regular one. */
+    struct cork_hash_table  *visited;
+    cork_array(struct ipset_uint128)  counts;
+};
+
+/* The variable that a node branches on.  Terminals act like they're
+ * just past the last variable. */
+static ipset_variable
+ipset_count_variable(struct ipset_count_data *data, ipset_node_id node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
+        return data->var_count + 1;
+    } else {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(data->cache, node_id);
+        return ipset_node_variable(node);
+    }
+}
+
+/* Count the assignments of the variables from node_id's own variable
+ * through the last one that lead to the value we're looking for. */
+static struct ipset_uint128
+ipset_count_visit(struct ipset_count_data *data, ipset_node_id node_id)
+{
+    struct ipset_uint128  result = { 0, 0 };
+    struct ipset_node  *node;
+    ipset_variable  var;
+    ipset_node_id  low;
+    ipset_node_id  high;
+    uintptr_t  existing;
+
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
+        result.low = (ipset_terminal_value(node_id) == data->value);
+        return result;
+    }
+
+    existing = (uintptr_t) cork_hash_table_get
+        (data->visited, (void *) (uintptr_t) node_id);
+    if (existing != 0) {
+        return cork_array_at(&data->counts, existing - 1);
+    }
+
+    /* Each child's count covers the variables from the child's own
+     * variable onwards; any variables that the edge skips over can
+     * take either value. */
+    node = ipset_node_cache_get_nonterminal(data->cache, node_id);
+    var = ipset_node_variable(node);
+    low = ipset_edge_low(node_id, node);
+    high = ipset_edge_high(node_id, node);
+    result = ipset_uint128_add
+        (ipset_uint128_shl(ipset_count_visit(data, low),
+                           ipset_count_variable(data, low) - var - 1),
+         ipset_uint128_shl(ipset_count_visit(data, high),
+                           ipset_count_variable(data, high) - var - 1));
+
+    cork_array_append(&data->counts, result);
+    cork_hash_table_put
+        (data->visited, (void *) (uintptr_t) node_id,
+         (void *) (uintptr_t) cork_array_size(&data->counts),
+         NULL, NULL, NULL);
+    return result;
+}
+
+/* Count the assignments of the variables from var through the last one
+ * that lead to the value we're looking for.  node_id can't branch on
+ * any variable before var. */
+static struct ipset_uint128
+ipset_count_from(struct ipset_count_data *data, ipset_node_id node_id,
+                 ipset_variable var)
+{
+    return ipset_uint128_shl
+        (ipset_count_visit(data, node_id),
+         ipset_count_variable(data, node_id) - var);
+}
+
+/* Fill in the 2^bits histogram buckets starting at counts, for bucket
+ * variables var through var+bits-1.  Like a stride table, if the BDD
+ * skips over a variable, both halves of the histogram are the same, so
+ * we only count one of them and copy it into the other. */
+static void
+ipset_count_fill(struct ipset_count_data *data, struct ipset_uint128 *counts,
+                 ipset_node_id node_id, ipset_variable var, unsigned int bits)
+{
+    size_t  half;
+
+    if (bits == 0) {
+        counts[0] = ipset_count_from(data, node_id, var);
+        return;
+    }
+
+    half = (size_t) 1 << (bits - 1);
+    if (ipset_count_variable(data, node_id) == var) {
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(data->cache, node_id);
+        ipset_count_fill
+            (data, counts, ipset_edge_low(node_id, node), var + 1, bits - 1);
+        ipset_count_fill
+            (data, counts + half, ipset_edge_high(node_id, node),
+             var + 1, bits - 1);
+    } else {
+        ipset_count_fill(data, counts, node_id, var + 1, bits - 1);
+        memcpy(counts + half, counts, half * sizeof(struct ipset_uint128));
+    }
+}
+
+static void
+ipset_count_data_init(struct ipset_count_data *data,
+                      const struct ipset_node_cache *cache,
+                      ipset_value value, ipset_variable var_count)
+{
+    data->cache = cache;
+    data->value = value;
+    data->var_count = var_count;
+    data->visited = cork_pointer_hash_table_new(0, 0);
+    cork_array_init(&data->counts);
+}
+
+static void
+ipset_count_data_done(struct ipset_count_data *data)
+{
+    DEBUG("Counted %zu distinct nodes", cork_array_size(&data->counts));
+    cork_hash_table_free(data->visited);
+    cork_array_done(&data->counts);
+}
+
+
+struct ipset_uint128
+ipset_node_count_value(const struct ipset_node_cache *cache,
+                       ipset_node_id node, ipset_value value,
+                       bool discriminator, ipset_variable var_count)
+{
+    struct ipset_count_data  data;
+    struct ipset_uint128  result;
+
+    /* Pick out the side of the BDD for the discriminator value that we
+     * want. */
+    if (ipset_node_get_type(node) == IPSET_NONTERMINAL_NODE) {
+        struct ipset_node  *root =
+            ipset_node_cache_get_nonterminal(cache, node);
+        if (ipset_node_variable(root) == 0) {
+            node = discriminator?
+                ipset_edge_high(node, root): ipset_edge_low(node, root);
+        }
+    }
+
+    ipset_count_data_init(&data, cache, value, var_count);
+    result = ipset_count_from(&data, node, 1);
+    ipset_count_data_done(&data);
+    return result;
+}
+
+
+void
+ipset_node_count_histogram(const struct ipset_node_cache *cache,
+                           ipset_node_id node, ipset_value value,
+                           ipset_assignment_func assignment,
+                           const void *user_data, ipset_variable prefix_var,
+                           ipset_variable bucket_var, ipset_variable var_count,
+                           struct ipset_uint128 *counts)
+{
+    struct ipset_count_data  data;
+
+    /* Follow the prefix down to the subgraph that it leads to. */
+    while (ipset_node_get_type(node) == IPSET_NONTERMINAL_NODE) {
+        struct ipset_node  *curr =
+            ipset_node_cache_get_nonterminal(cache, node);
+        ipset_variable  var = ipset_node_variable(curr);
+        if (var > prefix_var) {
+            break;
+        }
+        node = assignment(user_data, var)?
+            ipset_edge_high(node, curr): ipset_edge_low(node, curr);
+    }
+
+    ipset_count_data_init(&data, cache, value, var_count);
+    ipset_count_fill
+        (&data, counts, node, prefix_var + 1, bucket_var - prefix_var);
+    ipset_count_data_done(&data);
+}
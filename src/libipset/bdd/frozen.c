@@ -0,0 +1,143 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/logging.h"
+
+
+/*-----------------------------------------------------------------------
+ * Frozen BDDs
+ */
+
+/**
+ * Translate a node ID from the node cache into the corresponding ID in
+ * the frozen BDD.  new_indices maps each cache index to one more than
+ * its frozen index, so that 0 can mean “not visited yet”.
+ */
+static ipset_node_id
+ipset_frozen_translate(const ipset_value *new_indices, ipset_node_id node)
+{
+    if (ipset_node_get_type(node) == IPSET_TERMINAL_NODE) {
+        return node;
+    } else {
+        ipset_value  index = ipset_nonterminal_value(node);
+        return ipset_nonterminal_node_id(new_indices[index] - 1) |
+            (node & IPSET_COMPLEMENT_BIT);
+    }
+}
+
+
+struct ipset_frozen *
+ipset_node_freeze(const struct ipset_node_cache *cache, ipset_node_id node)
+{
+    struct ipset_frozen  *frozen = cork_new(struct ipset_frozen);
+    cork_array(ipset_node_id)  queue;
+    ipset_value  *new_indices;
+    size_t  i;
+
+    frozen->nodes = NULL;
+    frozen->node_count = 0;
+
+    if (ipset_node_get_type(node) == IPSET_TERMINAL_NODE) {
+        frozen->root = node;
+        return frozen;
+    }
+
+    /* Visit the nodes in breadth-first order, assigning each one its
+     * position in the frozen array the first time we see it.  The
+     * queue of nodes to visit is also the list of nodes in their final
+     * order.  A frozen node keeps the complement edges of the node
+     * that it's copied from, so the queue holds regular node IDs. */
+    new_indices = cork_calloc(cache->largest_index, sizeof(ipset_value));
+    cork_array_init(&queue);
+    cork_array_append(&queue, ipset_node_regular(node));
+    new_indices[ipset_nonterminal_value(node)] = 1;
+
+    for (i = 0; i < cork_array_size(&queue); i++) {
+        struct ipset_node  *curr =
+            ipset_node_cache_get_nonterminal(cache, cork_array_at(&queue, i));
+        ipset_node_id  children[2];
+        unsigned int  j;
+
+        children[0] = ipset_node_low(curr);
+        children[1] = ipset_node_high(curr);
+        for (j = 0; j < 2; j++) {
+            if (ipset_node_get_type(children[j]) == IPSET_NONTERMINAL_NODE) {
+                ipset_value  index = ipset_nonterminal_value(children[j]);
+                if (new_indices[index] == 0) {
+                    cork_array_append
+                        (&queue, ipset_node_regular(children[j]));
+                    new_indices[index] = cork_array_size(&queue);
+                }
+            }
+        }
+    }
+
+    /* Then copy the nodes into one contiguous array, translating their
+     * children's IDs as we go. */
+    frozen->node_count = cork_array_size(&queue);
+    frozen->nodes =
+        cork_malloc(frozen->node_count * sizeof(struct ipset_node));
+    for (i = 0; i < frozen->node_count; i++) {
+        struct ipset_node  *curr =
+            ipset_node_cache_get_nonterminal(cache, cork_array_at(&queue, i));
+        ipset_node_set
+            (&frozen->nodes[i], ipset_node_variable(curr),
+             ipset_frozen_translate(new_indices, ipset_node_low(curr)),
+             ipset_frozen_translate(new_indices, ipset_node_high(curr)));
+    }
+
+    frozen->root = ipset_frozen_translate(new_indices, node);
+    DEBUG("Froze %zu nodes", frozen->node_count);
+    free(new_indices);
+    cork_array_done(&queue);
+    return frozen;
+}
+
+
+void
+ipset_frozen_free(struct ipset_frozen *frozen)
+{
+    if (frozen->nodes != NULL) {
+        free(frozen->nodes);
+    }
+    free(frozen);
+}
+
+
+size_t
+ipset_frozen_memory_size(const struct ipset_frozen *frozen)
+{
+    return sizeof(struct ipset_frozen) +
+        frozen->node_count * sizeof(struct ipset_node);
+}
+
+
+ipset_value
+ipset_frozen_evaluate(const struct ipset_frozen *frozen,
+                      ipset_assignment_func assignment,
+                      const void *user_data)
+{
+    ipset_node_id  curr_node_id = frozen->root;
+    while (ipset_node_get_type(curr_node_id) == IPSET_NONTERMINAL_NODE) {
+        const struct ipset_node  *node =
+            ipset_frozen_get_nonterminal(frozen, curr_node_id);
+        if (assignment(user_data, ipset_node_variable(node))) {
+            curr_node_id = ipset_edge_high(curr_node_id, node);
+        } else {
+            curr_node_id = ipset_edge_low(curr_node_id, node);
+        }
+    }
+    return ipset_terminal_value(curr_node_id);
+}
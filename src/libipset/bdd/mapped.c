@@ -0,0 +1,194 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libcork/core.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/errors.h"
+#include "ipset/logging.h"
+
+
+static const char  MAGIC_NUMBER[] = "IP set";
+static const size_t  MAGIC_NUMBER_LENGTH = sizeof(MAGIC_NUMBER) - 1;
+
+
+/*-----------------------------------------------------------------------
+ * Memory-mapped BDDs
+ */
+
+static uint32_t
+header_le_uint32(const uint8_t *header, size_t offset)
+{
+    uint32_t  val;
+    memcpy(&val, header + offset, sizeof(uint32_t));
+    return CORK_UINT32_LITTLE_TO_HOST(val);
+}
+
+static uint64_t
+header_le_uint64(const uint8_t *header, size_t offset)
+{
+    uint64_t  val;
+    memcpy(&val, header + offset, sizeof(uint64_t));
+    return CORK_UINT64_LITTLE_TO_HOST(val);
+}
+
+/**
+ * Check that a mapped file has a v2 header that we can use in place,
+ * and fill in the frozen BDD that it contains.
+ */
+static int
+ipset_mmap_check(struct ipset_mmap *mapped, const char *path)
+{
+    const uint8_t  *header = mapped->base;
+    uint16_t  version;
+    uint32_t  node_size;
+    uint64_t  node_count;
+    uint64_t  length;
+    ipset_node_id  root;
+
+    if (mapped->size < IPSET_V2_HEADER_SIZE ||
+        memcmp(header, MAGIC_NUMBER, MAGIC_NUMBER_LENGTH) != 0) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: Magic number doesn't match; this isn't an IP set.", path);
+        return -1;
+    }
+
+    memcpy(&version, header + MAGIC_NUMBER_LENGTH, sizeof(uint16_t));
+    CORK_UINT16_BIG_TO_HOST_IN_PLACE(version);
+    if (version != 0x0002) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: Can only map v2 files, not v%" PRIu16, path, version);
+        return -1;
+    }
+
+    node_size = header_le_uint32(header, 8);
+    root = header_le_uint32(header, 12);
+    node_count = header_le_uint64(header, 16);
+    length = header_le_uint64(header, 24);
+
+    if (CORK_UINT32_HOST_TO_LITTLE(1) != 1 ||
+        node_size != sizeof(struct ipset_node)) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: File's node layout doesn't match this machine's", path);
+        return -1;
+    }
+
+    if (length != mapped->size ||
+        node_count > (mapped->size - IPSET_V2_HEADER_SIZE) / node_size ||
+        IPSET_V2_HEADER_SIZE + node_count * node_size != length) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: Malformed set: wrong length", path);
+        return -1;
+    }
+
+    if (ipset_node_get_type(root) == IPSET_NONTERMINAL_NODE &&
+        ipset_nonterminal_value(root) >= node_count) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: Malformed set: root node out of range", path);
+        return -1;
+    }
+
+    mapped->frozen.nodes =
+        (struct ipset_node *) (header + IPSET_V2_HEADER_SIZE);
+    mapped->frozen.node_count = node_count;
+    mapped->frozen.root = root;
+    return 0;
+}
+
+
+struct ipset_mmap *
+ipset_mmap_open(const char *path, unsigned int flags)
+{
+    struct ipset_mmap  *mapped;
+    struct stat  st;
+    int  mmap_flags = MAP_SHARED;
+    int  fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_IO_ERROR, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_IO_ERROR, "%s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (st.st_size < IPSET_V2_HEADER_SIZE) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "%s: Unexpected end of file", path);
+        close(fd);
+        return NULL;
+    }
+
+#if defined(MAP_POPULATE)
+    if (flags & IPSET_MMAP_POPULATE) {
+        mmap_flags |= MAP_POPULATE;
+    }
+#endif
+
+    mapped = cork_new(struct ipset_mmap);
+    mapped->size = st.st_size;
+    mapped->base = mmap(NULL, mapped->size, PROT_READ, mmap_flags, fd, 0);
+    close(fd);
+    if (mapped->base == MAP_FAILED) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_IO_ERROR, "%s: %s", path, strerror(errno));
+        free(mapped);
+        return NULL;
+    }
+
+    if (ipset_mmap_check(mapped, path) != 0) {
+        munmap(mapped->base, mapped->size);
+        free(mapped);
+        return NULL;
+    }
+
+    /* The advice is only a hint, so we don't care if it fails. */
+#if !defined(MAP_POPULATE)
+    if (flags & IPSET_MMAP_POPULATE) {
+        flags |= IPSET_MMAP_WILLNEED;
+    }
+#endif
+    if (flags & IPSET_MMAP_RANDOM) {
+        madvise(mapped->base, mapped->size, MADV_RANDOM);
+    }
+    if (flags & IPSET_MMAP_WILLNEED) {
+        madvise(mapped->base, mapped->size, MADV_WILLNEED);
+    }
+
+    DEBUG("Mapped %zu nodes from %s", mapped->frozen.node_count, path);
+    return mapped;
+}
+
+
+void
+ipset_mmap_close(struct ipset_mmap *mapped)
+{
+    munmap(mapped->base, mapped->size);
+    free(mapped);
+}
@@ -0,0 +1,203 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <sched.h>
+#include <stdlib.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+#include <libcork/threads.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/errors.h"
+#include "ipset/logging.h"
+
+
+/*-----------------------------------------------------------------------
+ * Publishing frozen BDDs
+ */
+
+/* All of the shared fields are only ever read or written as whole
+ * words, and we use full memory barriers to order those accesses. */
+#define ipset_memory_barrier()  __sync_synchronize()
+
+
+static struct ipset_frozen *
+ipset_frozen_new_empty(void)
+{
+    struct ipset_frozen  *frozen = cork_new(struct ipset_frozen);
+    frozen->nodes = NULL;
+    frozen->node_count = 0;
+    frozen->root = ipset_terminal_node_id(0);
+    return frozen;
+}
+
+
+struct ipset_publisher *
+ipset_publisher_new(size_t max_readers)
+{
+    struct ipset_publisher  *publisher = cork_new(struct ipset_publisher);
+    size_t  i;
+
+    publisher->current = ipset_frozen_new_empty();
+    publisher->epoch = 1;
+    publisher->reader_count = max_readers;
+
+    /* The padding only keeps each reader on its own cache line if the
+     * array starts on a cache line boundary. */
+    if (posix_memalign
+        ((void **) &publisher->readers, IPSET_CACHE_LINE_SIZE,
+         max_readers * sizeof(struct ipset_reader)) != 0) {
+        abort();
+    }
+    for (i = 0; i < max_readers; i++) {
+        publisher->readers[i].epoch = 0;
+        publisher->readers[i].in_use = 0;
+        publisher->readers[i].publisher = publisher;
+    }
+    cork_array_init(&publisher->retired);
+    return publisher;
+}
+
+
+void
+ipset_publisher_free(struct ipset_publisher *publisher)
+{
+    size_t  i;
+    for (i = 0; i < cork_array_size(&publisher->retired); i++) {
+        ipset_frozen_free(cork_array_at(&publisher->retired, i).frozen);
+    }
+    cork_array_done(&publisher->retired);
+    ipset_frozen_free(publisher->current);
+    free(publisher->readers);
+    free(publisher);
+}
+
+
+/**
+ * Return the oldest epoch that any reader is currently in, or the
+ * current global epoch if there aren't any lookups in progress.
+ */
+static size_t
+ipset_publisher_oldest_epoch(struct ipset_publisher *publisher)
+{
+    size_t  oldest = publisher->epoch;
+    size_t  i;
+
+    ipset_memory_barrier();
+    for (i = 0; i < publisher->reader_count; i++) {
+        size_t  epoch = publisher->readers[i].epoch;
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+
+size_t
+ipset_publisher_reclaim(struct ipset_publisher *publisher)
+{
+    size_t  oldest;
+    size_t  i;
+    size_t  kept = 0;
+
+    if (cork_array_size(&publisher->retired) == 0) {
+        return 0;
+    }
+
+    /* A version retired during epoch e was replaced before the global
+     * epoch moved on to e+1, so any reader that started in e+1 or
+     * later can't have seen it. */
+    oldest = ipset_publisher_oldest_epoch(publisher);
+    for (i = 0; i < cork_array_size(&publisher->retired); i++) {
+        struct ipset_retired  retired = cork_array_at(&publisher->retired, i);
+        if (retired.epoch < oldest) {
+            DEBUG("Reclaiming version retired in epoch %zu", retired.epoch);
+            ipset_frozen_free(retired.frozen);
+        } else {
+            cork_array_at(&publisher->retired, kept++) = retired;
+        }
+    }
+    publisher->retired.size = kept;
+    return kept;
+}
+
+
+void
+ipset_publisher_publish(struct ipset_publisher *publisher,
+                        struct ipset_frozen *frozen)
+{
+    struct ipset_retired  retired;
+
+    retired.frozen = publisher->current;
+    publisher->current = frozen;
+    ipset_memory_barrier();
+    retired.epoch = cork_size_atomic_add(&publisher->epoch, 1) - 1;
+    DEBUG("Published new version in epoch %zu", retired.epoch + 1);
+    cork_array_append(&publisher->retired, retired);
+    ipset_publisher_reclaim(publisher);
+}
+
+
+void
+ipset_publisher_synchronize(struct ipset_publisher *publisher)
+{
+    while (ipset_publisher_reclaim(publisher) > 0) {
+        sched_yield();
+    }
+}
+
+
+struct ipset_reader *
+ipset_publisher_add_reader(struct ipset_publisher *publisher)
+{
+    size_t  i;
+    for (i = 0; i < publisher->reader_count; i++) {
+        struct ipset_reader  *reader = &publisher->readers[i];
+        if (cork_size_cas(&reader->in_use, 0, 1) == 0) {
+            return reader;
+        }
+    }
+
+    cork_error_set
+        (IPSET_ERROR, IPSET_CAPACITY_ERROR,
+         "All %zu reader slots are in use", publisher->reader_count);
+    return NULL;
+}
+
+
+void
+ipset_reader_free(struct ipset_reader *reader)
+{
+    reader->epoch = 0;
+    ipset_memory_barrier();
+    reader->in_use = 0;
+}
+
+
+const struct ipset_frozen *
+ipset_reader_enter(struct ipset_reader *reader)
+{
+    /* The barrier makes sure that the writer can see our epoch before
+     * we read the current version.  If the writer retires the version
+     * we're about to read, it will see that we're in an epoch that
+     * isn't newer than the retirement, and will wait for us. */
+    reader->epoch = reader->publisher->epoch;
+    ipset_memory_barrier();
+    return reader->publisher->current;
+}
+
+
+void
+ipset_reader_leave(struct ipset_reader *reader)
+{
+    ipset_memory_barrier();
+    reader->epoch = 0;
+}
@@ -25,9 +25,11 @@ ipset_node_reachable_count(const struct ipset_node_cache *cache,
     cork_array(ipset_node_id)  queue;
     cork_array_init(&queue);
 
+    /* A node and its complement share storage, so we only look at
+     * regular node IDs. */
     if (ipset_node_get_type(node) == IPSET_NONTERMINAL_NODE) {
         DEBUG("Adding node %u to queue", node);
-        cork_array_append(&queue, node);
+        cork_array_append(&queue, ipset_node_regular(node));
     }
 
     /* And somewhere to store the result. */
@@ -54,15 +56,17 @@ ipset_node_reachable_count(const struct ipset_node_cache *cache,
              * queue. */
             struct ipset_node  *node =
                 ipset_node_cache_get_nonterminal(cache, curr);
+            ipset_node_id  low = ipset_node_low(node);
+            ipset_node_id  high = ipset_node_high(node);
 
-            if (ipset_node_get_type(node->low) == IPSET_NONTERMINAL_NODE) {
-                DEBUG("Adding node %u to queue", node->low);
-                cork_array_append(&queue, node->low);
+            if (ipset_node_get_type(low) == IPSET_NONTERMINAL_NODE) {
+                DEBUG("Adding node %u to queue", low);
+                cork_array_append(&queue, ipset_node_regular(low));
             }
 
-            if (ipset_node_get_type(node->high) == IPSET_NONTERMINAL_NODE) {
-                DEBUG("Adding node %u to queue", node->high);
-                cork_array_append(&queue, node->high);
+            if (ipset_node_get_type(high) == IPSET_NONTERMINAL_NODE) {
+                DEBUG("Adding node %u to queue", high);
+                cork_array_append(&queue, ipset_node_regular(high));
             }
         }
     }
@@ -78,5 +82,8 @@ size_t
 ipset_node_memory_size(const struct ipset_node_cache *cache,
                        ipset_node_id node)
 {
-    return ipset_node_reachable_count(cache, node) * sizeof(struct ipset_node);
+    /* Each node's reference count lives in a separate array that
+     * parallels the node chunks, but still takes up space. */
+    return ipset_node_reachable_count(cache, node) *
+        (sizeof(struct ipset_node) + sizeof(unsigned int));
 }
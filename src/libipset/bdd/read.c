@@ -9,6 +9,7 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <libcork/core.h>
@@ -34,92 +35,197 @@ static const size_t  MAGIC_NUMBER_LENGTH = sizeof(MAGIC_NUMBER) - 1;
 typedef int  serialized_id;
 
 
+/*-----------------------------------------------------------------------
+ * Input sources
+ */
+
 /**
- * Sets a libcork error based on the contents of errno.
+ * When reading from a stream, we read the nodes in blocks of this many
+ * bytes, and decode them straight out of the block.
  */
-static void
-create_errno_error(FILE *stream)
+#define IPSET_READ_BLOCK_SIZE  65536
+
+/**
+ * Where we read a serialized BDD from.  If stream is non-NULL, each
+ * read goes into block, which must be large enough for the largest
+ * read that we make.  Otherwise, we decode straight out of the
+ * caller's buffer, without copying anything.
+ */
+struct load_source {
+    FILE  *stream;
+    uint8_t  *block;
+    const uint8_t  *buf;
+    size_t  size;
+    size_t  pos;
+};
+
+/**
+ * Return a pointer to the next size bytes of input, which is valid
+ * until the next call.  If we can't read that many bytes for some
+ * reason, return NULL with an error condition.
+ */
+static const uint8_t *
+source_next(struct load_source *source, size_t size)
 {
-    if (ferror(stream)) {
-        cork_error_set(IPSET_ERROR, IPSET_IO_ERROR, "%s", strerror(errno));
-    } else {
-        cork_unknown_error();
+    const uint8_t  *result;
+
+    if (source->stream != NULL) {
+        size_t  num_read = fread(source->block, 1, size, source->stream);
+        if (num_read == size) {
+            return source->block;
+        }
+
+        if (ferror(source->stream)) {
+            cork_error_set
+                (IPSET_ERROR, IPSET_IO_ERROR, "%s", strerror(errno));
+        } else {
+            cork_error_set
+                (IPSET_ERROR, IPSET_PARSE_ERROR, "Unexpected end of file");
+        }
+        return NULL;
     }
+
+    if (size > source->size - source->pos) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR, "Unexpected end of buffer");
+        return NULL;
+    }
+
+    result = source->buf + source->pos;
+    source->pos += size;
+    return result;
 }
 
 
 /**
- * Read in a big-endian uint8 from a stream.  If we can't read the
+ * Decode big-endian and little-endian integers from a block of input.
+ */
+
+static uint16_t
+get_uint16(const uint8_t *src)
+{
+    uint16_t  val;
+    memcpy(&val, src, sizeof(uint16_t));
+    return CORK_UINT16_BIG_TO_HOST(val);
+}
+
+static uint32_t
+get_uint32(const uint8_t *src)
+{
+    uint32_t  val;
+    memcpy(&val, src, sizeof(uint32_t));
+    return CORK_UINT32_BIG_TO_HOST(val);
+}
+
+static uint64_t
+get_uint64(const uint8_t *src)
+{
+    uint64_t  val;
+    memcpy(&val, src, sizeof(uint64_t));
+    return CORK_UINT64_BIG_TO_HOST(val);
+}
+
+static uint32_t
+get_le_uint32(const uint8_t *src)
+{
+    uint32_t  val;
+    memcpy(&val, src, sizeof(uint32_t));
+    return CORK_UINT32_LITTLE_TO_HOST(val);
+}
+
+static uint64_t
+get_le_uint64(const uint8_t *src)
+{
+    uint64_t  val;
+    memcpy(&val, src, sizeof(uint64_t));
+    return CORK_UINT64_LITTLE_TO_HOST(val);
+}
+
+
+/**
+ * Read in a big-endian uint16 from the input.  If we can't read the
  * integer for some reason, return an error.
  */
 static int
-read_uint8(FILE *stream, uint8_t *dest)
+read_uint16(struct load_source *source, uint16_t *dest)
 {
-    size_t  num_read = fread(dest, sizeof(uint8_t), 1, stream);
-    if (num_read != 1) {
-        create_errno_error(stream);
+    const uint8_t  *src = source_next(source, sizeof(uint16_t));
+    if (src == NULL) {
         return -1;
     }
-
-    /* for a byte, we don't need to endian-swap */
+    *dest = get_uint16(src);
     return 0;
 }
 
 
 /**
- * Read in a big-endian uint16 from a stream.  If we can't read the
+ * Read in a big-endian uint32 from the input.  If we can't read the
  * integer for some reason, return an error.
  */
-static uint16_t
-read_uint16(FILE *stream, uint16_t *dest)
+static int
+read_uint32(struct load_source *source, uint32_t *dest)
 {
-    size_t  num_read = fread(dest, sizeof(uint16_t), 1, stream);
-    if (num_read != 1) {
-        create_errno_error(stream);
+    const uint8_t  *src = source_next(source, sizeof(uint32_t));
+    if (src == NULL) {
         return -1;
     }
-
-    CORK_UINT16_BIG_TO_HOST_IN_PLACE(*dest);
+    *dest = get_uint32(src);
     return 0;
 }
 
 
 /**
- * Read in a big-endian uint32 from a stream.  If we can't read the
+ * Read in a big-endian uint64 from the input.  If we can't read the
  * integer for some reason, return an error.
  */
-static uint32_t
-read_uint32(FILE *stream, uint32_t *dest)
+static int
+read_uint64(struct load_source *source, uint64_t *dest)
 {
-    size_t  num_read = fread(dest, sizeof(uint32_t), 1, stream);
-    if (num_read != 1) {
-        create_errno_error(stream);
+    const uint8_t  *src = source_next(source, sizeof(uint64_t));
+    if (src == NULL) {
         return -1;
     }
-
-    CORK_UINT32_BIG_TO_HOST_IN_PLACE(*dest);
+    *dest = get_uint64(src);
     return 0;
 }
 
 
 /**
- * Read in a big-endian uint64 from a stream.  If we can't read the
+ * Read in a little-endian uint32 from the input.  If we can't read the
  * integer for some reason, return an error.
  */
-static uint64_t
-read_uint64(FILE *stream, uint64_t *dest)
+static int
+read_le_uint32(struct load_source *source, uint32_t *dest)
 {
-    size_t  num_read = fread(dest, sizeof(uint64_t), 1, stream);
-    if (num_read != 1) {
-        create_errno_error(stream);
+    const uint8_t  *src = source_next(source, sizeof(uint32_t));
+    if (src == NULL) {
         return -1;
     }
+    *dest = get_le_uint32(src);
+    return 0;
+}
+
 
-    CORK_UINT64_BIG_TO_HOST_IN_PLACE(*dest);
+/**
+ * Read in a little-endian uint64 from the input.  If we can't read the
+ * integer for some reason, return an error.
+ */
+static int
+read_le_uint64(struct load_source *source, uint64_t *dest)
+{
+    const uint8_t  *src = source_next(source, sizeof(uint64_t));
+    if (src == NULL) {
+        return -1;
+    }
+    *dest = get_le_uint64(src);
     return 0;
 }
 
 
+/*-----------------------------------------------------------------------
+ * Version 1
+ */
+
 /**
  * A helper function that verifies that we've read exactly as many bytes
  * as we should, returning an error otherwise.
@@ -144,21 +250,76 @@ verify_cap(size_t bytes_read, size_t cap)
     return 0;
 }
 
+/**
+ * Release the reference that cache_ids holds for each of the first
+ * count serialized nonterminals, and free the array.
+ */
+static void
+release_cache_ids(struct ipset_node_cache *cache,
+                  ipset_node_id *cache_ids, size_t count)
+{
+    size_t  i;
+    for (i = 0; i < count; i++) {
+        ipset_node_decref(cache, cache_ids[i]);
+    }
+    free(cache_ids);
+}
+
+/**
+ * Each serialized node consists of an 8-bit variable index, a 32-bit
+ * low pointer, and a 32-bit high pointer.
+ */
+#define V1_NODE_SIZE  (sizeof(uint8_t) + 2 * sizeof(uint32_t))
+
+/**
+ * Turn a serialized node pointer into a node ID.  If the pointer is
+ * >= 0, it's a terminal value.  Otherwise, it's a nonterminal ID,
+ * indexing into the serialized nonterminal array.  The file format
+ * guarantees that any node reference points to a node earlier in the
+ * serialized array, so cache_ids has already been filled in for it;
+ * read_count is how many nodes that is.  Serialized ID -1 is stored in
+ * cache_ids[0], -2 in cache_ids[1], and so on.
+ */
+static int
+load_v1_pointer(struct ipset_node_cache *cache,
+                const ipset_node_id *cache_ids, size_t read_count,
+                int32_t pointer, ipset_node_id *dest)
+{
+    if (pointer >= 0) {
+        *dest = ipset_terminal_node_id(pointer);
+        return 0;
+    }
+
+    if ((uint64_t) -(int64_t) pointer > read_count) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: bad node reference %" PRId32, pointer);
+        return -1;
+    }
+
+    *dest = cache_ids[-(int64_t) pointer - 1];
+    ipset_node_incref(cache, *dest);
+    DEBUG("  Serialized ID %" PRId32 " is internal ID %u", pointer, *dest);
+    return 0;
+}
+
 /**
  * A helper function for reading a version 1 BDD stream.
  */
 static ipset_node_id
-load_v1(FILE *stream, struct ipset_node_cache *cache)
+load_v1(struct load_source *source, struct ipset_node_cache *cache)
 {
     DEBUG("Stream contains v1 IP set");
-    ipset_node_id  result;
-    struct cork_hash_table  *cache_ids = cork_pointer_hash_table_new(0, 0);
+    ipset_node_id  result = 0;
+    ipset_node_id  *cache_ids = NULL;
+    size_t  allocated;
+    size_t  i = 0;
 
     /* We've already read in the magic number and version.  Next should
      * be the length of the encoded set. */
     uint64_t  length;
     DEBUG("Reading encoded length");
-    ei_check(read_uint64(stream, &length));
+    ei_check(read_uint64(source, &length));
 
     /* The length includes the magic number, version number, and the
      * length field itself.  Remove those to get the cap on the
@@ -176,7 +337,7 @@ load_v1(FILE *stream, struct ipset_node_cache *cache)
 
     uint32_t  nonterminal_count;
     DEBUG("Reading number of nonterminals");
-    ei_check(read_uint32(stream, &nonterminal_count));
+    ei_check(read_uint32(source, &nonterminal_count));
     bytes_read += sizeof(uint32_t);
 
     /* If there are no nonterminals, then there's only a single terminal
@@ -185,140 +346,624 @@ load_v1(FILE *stream, struct ipset_node_cache *cache)
     if (nonterminal_count == 0) {
         uint32_t  value;
         DEBUG("Reading single terminal value");
-        ei_check(read_uint32(stream, &value));
+        ei_check(read_uint32(source, &value));
         bytes_read += sizeof(uint32_t);
 
         /* We should have reached the end of the encoded set. */
         ei_check(verify_cap(bytes_read, cap));
 
         /* Create a terminal node for this value and return it. */
-        cork_hash_table_free(cache_ids);
         return ipset_terminal_node_id(value);
     }
 
-    /* Otherwise, read in each nonterminal.  We need to keep track of a
-     * mapping between each nonterminal's ID in the stream (which are
-     * number consecutively from -1), and its ID in the node cache
-     * (which could be anything). */
+    /* Otherwise, the rest of the encoded set is the nonterminals, so we
+     * know how much data we should see before we read any of it. */
+    bytes_read += (size_t) nonterminal_count * V1_NODE_SIZE;
+    ei_check(verify_cap(bytes_read, cap));
 
-    size_t  i;
-    for (i = 0; i < nonterminal_count; i++) {
-        serialized_id  serialized_id = -(i+1);
+    /* Make sure a bad header can't make us allocate more space than the
+     * nodes could possibly fill. */
+    if (source->stream == NULL &&
+        bytes_read - sizeof(uint32_t) > source->size - source->pos) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR, "Unexpected end of buffer");
+        return 0;
+    }
 
-        /* Each serialized node consists of a variable index, a low
-         * pointer, and a high pointer. */
+    /* Read in the nonterminals a block at a time.  We need to keep
+     * track of a mapping between each nonterminal's ID in the stream
+     * (which are number consecutively from -1), and its ID in the node
+     * cache (which could be anything).  The serialized IDs are dense, so
+     * the mapping is just an array.  cache_ids holds a reference to
+     * each of the nonterminals until we're done, since the node cache
+     * might be shared with other sets, and nodes can be referenced by
+     * more than one parent.  When reading from a stream, we can't check
+     * the header's node count up front, so we grow cache_ids as each
+     * block of nodes arrives. */
+
+    allocated = nonterminal_count;
+    if (source->stream != NULL &&
+        allocated > IPSET_READ_BLOCK_SIZE / V1_NODE_SIZE) {
+        allocated = IPSET_READ_BLOCK_SIZE / V1_NODE_SIZE;
+    }
+    cache_ids = cork_calloc(allocated, sizeof(ipset_node_id));
 
-        uint8_t  variable;
-        ei_check(read_uint8(stream, &variable));
-        bytes_read += sizeof(uint8_t);
+    while (i < nonterminal_count) {
+        size_t  block_count = nonterminal_count - i;
+        const uint8_t  *block;
+        size_t  j;
 
-        int32_t  low;
-        ei_check(read_uint32(stream, (uint32_t *) &low));
-        bytes_read += sizeof(int32_t);
+        if (source->stream != NULL &&
+            block_count > IPSET_READ_BLOCK_SIZE / V1_NODE_SIZE) {
+            block_count = IPSET_READ_BLOCK_SIZE / V1_NODE_SIZE;
+        }
+        ep_check(block = source_next(source, block_count * V1_NODE_SIZE));
+
+        if (i + block_count > allocated) {
+            size_t  new_allocated = allocated * 2;
+            if (new_allocated > nonterminal_count) {
+                new_allocated = nonterminal_count;
+            }
+            cache_ids = cork_realloc
+                (cache_ids, allocated * sizeof(ipset_node_id),
+                 new_allocated * sizeof(ipset_node_id));
+            allocated = new_allocated;
+        }
 
-        int32_t  high;
-        ei_check(read_uint32(stream, (uint32_t *) &high));
-        bytes_read += sizeof(int32_t);
+        for (j = 0; j < block_count; j++, block += V1_NODE_SIZE) {
+            uint8_t  variable = block[0];
+            int32_t  low = (int32_t) get_uint32(block + 1);
+            int32_t  high = (int32_t) get_uint32(block + 5);
+            ipset_node_id  low_id;
+            ipset_node_id  high_id;
 
-        DEBUG("Read serialized node %d = (x%d? %" PRId32 ": %" PRId32 ")",
-              serialized_id, variable, high, low);
+            DEBUG("Read serialized node -%zu = (x%d? %" PRId32 ": %" PRId32 ")",
+                  i+1, variable, high, low);
 
-        /* Turn the low pointer into a node ID.  If the pointer is >= 0,
-         * it's a terminal value.  Otherwise, its a nonterminal ID,
-         * indexing into the serialized nonterminal array.*/
+            ei_check(load_v1_pointer(cache, cache_ids, i, low, &low_id));
+            if (load_v1_pointer(cache, cache_ids, i, high, &high_id) != 0) {
+                ipset_node_decref(cache, low_id);
+                goto error;
+            }
 
-        ipset_node_id  low_id;
+            /* Create a nonterminal node in the node cache. */
+            result = ipset_node_cache_nonterminal
+                (cache, variable, low_id, high_id);
 
-        if (low >= 0) {
-            low_id = ipset_terminal_node_id(low);
-        } else {
-            /* The file format guarantees that any node reference points
-             * to a node earlier in the serialized array.  That means we
-             * can assume that cache_ids has already been filled in for
-             * this node. */
+            DEBUG("Internal node %u = nonterminal(x%d? %u: %u)",
+                  result, (int) variable, high_id, low_id);
 
-            low_id = (ipset_node_id) (uintptr_t)
-                cork_hash_table_get(cache_ids, (void *) (intptr_t) low);
+            /* Remember the internal node ID for this new node, in case
+             * any later serialized nodes point to it. */
 
-            DEBUG("  Serialized ID %" PRId32 " is internal ID %u",
-                  low, low_id);
+            cache_ids[i++] = result;
         }
+    }
 
-        /* Do the same for the high pointer. */
+    /* The last node is the nonterminal for the entire set. */
+    ipset_node_incref(cache, result);
+    release_cache_ids(cache, cache_ids, nonterminal_count);
+    return result;
 
-        ipset_node_id  high_id;
+  error:
+    /* If there's an error, clean up the objects that we've created
+     * before returning. */
 
-        if (high >= 0) {
-            high_id = ipset_terminal_node_id(high);
-        } else {
-            /* The file format guarantees that any node reference points
-             * to a node earlier in the serialized array.  That means we
-             * can assume that cache_ids has already been filled in for
-             * this node. */
+    if (cache_ids != NULL) {
+        release_cache_ids(cache, cache_ids, i);
+    }
+    return 0;
+}
 
-            high_id = (ipset_node_id) (uintptr_t)
-                cork_hash_table_get(cache_ids, (void *) (intptr_t) high);
 
-            DEBUG("  Serialized ID %" PRId32 " is internal ID %u",
-                  high, high_id);
-        }
+/*-----------------------------------------------------------------------
+ * Version 2
+ */
 
-        /* Create a nonterminal node in the node cache. */
-        result = ipset_node_cache_nonterminal
-            (cache, variable, low_id, high_id);
+/**
+ * A v2 file might have been written with either node layout, so we
+ * decode its nodes by hand instead of using the ipset_node macros.
+ */
 
-        DEBUG("Internal node %u = nonterminal(x%d? %u: %u)",
-              result, (int) variable, high_id, low_id);
+struct v2_node {
+    ipset_variable  variable;
+    ipset_node_id  low;
+    ipset_node_id  high;
+};
+
+#define V2_COMPACT_ID_BITS  28
+#define V2_COMPACT_ID_MASK  ((1u << V2_COMPACT_ID_BITS) - 1)
+
+struct v2_data {
+    struct ipset_node_cache  *cache;
+    struct v2_node  *nodes;
+    size_t  node_count;
+    /* The cache node for each frozen node ID that we've loaded, indexed
+     * by the ID without its type bit.  (A complemented edge and a
+     * regular one stand for different functions.)  Each one holds a
+     * reference until we're done. */
+    ipset_node_id  *cache_ids;
+    bool  *loaded;
+};
+
+/* Check that a frozen node ID points to a node in the file, and that
+ * the BDD is ordered, which guarantees that load_v2_node terminates. */
+static int
+check_v2_edge(struct v2_data *data, ipset_variable parent_var,
+              ipset_node_id node_id)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
+        return 0;
+    }
 
-        /* Remember the internal node ID for this new node, in case any
-         * later serialized nodes point to it. */
+    if (ipset_nonterminal_value(node_id) >= data->node_count ||
+        data->nodes[ipset_nonterminal_value(node_id)].variable <=
+        parent_var) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: bad node reference %u", node_id);
+        return -1;
+    }
+    return 0;
+}
 
-        cork_hash_table_put
-            (cache_ids, (void *) (intptr_t) serialized_id,
-             (void *) (uintptr_t) result, NULL, NULL, NULL);
+static ipset_node_id
+load_v2_node(struct v2_data *data, ipset_node_id node_id)
+{
+    struct v2_node  *node;
+    size_t  slot;
+    ipset_node_id  low;
+    ipset_node_id  high;
+    ipset_node_id  result;
+
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
+        return node_id;
     }
 
-    /* We should have reached the end of the encoded set. */
-    ei_check(verify_cap(bytes_read, cap));
+    slot = node_id >> 1;
+    if (data->loaded[slot]) {
+        return ipset_node_incref(data->cache, data->cache_ids[slot]);
+    }
 
-    /* The last node is the nonterminal for the entire set. */
-    cork_hash_table_free(cache_ids);
-    return result;
+    node = &data->nodes[ipset_nonterminal_value(node_id)];
+    low = load_v2_node
+        (data, node->low ^ (node_id & IPSET_COMPLEMENT_BIT));
+    high = load_v2_node
+        (data, node->high ^ (node_id & IPSET_COMPLEMENT_BIT));
+    result = ipset_node_cache_nonterminal
+        (data->cache, node->variable, low, high);
+    DEBUG("Internal node %u = nonterminal(x%u? %u: %u)",
+          result, node->variable, high, low);
+
+    data->cache_ids[slot] = result;
+    data->loaded[slot] = true;
+    return ipset_node_incref(data->cache, result);
+}
 
-  error:
-    /* If there's an error, clean up the objects that we've created
-     * before returning. */
+/**
+ * A helper function for reading a version 2 BDD stream.
+ */
+static ipset_node_id
+load_v2(struct load_source *source, struct ipset_node_cache *cache)
+{
+    DEBUG("Stream contains v2 IP set");
+    struct v2_data  data;
+    ipset_node_id  result = 0;
+    uint32_t  node_size;
+    uint32_t  root;
+    uint64_t  node_count;
+    uint64_t  length;
+    size_t  allocated;
+    size_t  i;
 
-    cork_hash_table_free(cache_ids);
-    return 0;
+    /* We've already read in the magic number and version. */
+    xi_check(0, read_le_uint32(source, &node_size));
+    xi_check(0, read_le_uint32(source, &root));
+    xi_check(0, read_le_uint64(source, &node_count));
+    xi_check(0, read_le_uint64(source, &length));
+
+    if (node_size != 8 && node_size != 12) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: unknown node size %" PRIu32, node_size);
+        return 0;
+    }
+
+    if (node_count > (UINT_MAX >> 2) ||
+        length != IPSET_V2_HEADER_SIZE + node_count * node_size) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: wrong length");
+        return 0;
+    }
+
+    /* Make sure a bad header can't make us allocate more space than the
+     * nodes could possibly fill. */
+    if (source->stream == NULL &&
+        node_count * node_size > source->size - source->pos) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR, "Unexpected end of buffer");
+        return 0;
+    }
+
+    /* When reading from a stream, we can't check the node count up
+     * front, so we grow the node array as each block arrives, and only
+     * allocate the rest once we know that the nodes are all there. */
+    data.cache = cache;
+    data.node_count = node_count;
+    data.cache_ids = NULL;
+    data.loaded = NULL;
+    allocated = node_count;
+    if (source->stream != NULL &&
+        allocated > IPSET_READ_BLOCK_SIZE / node_size) {
+        allocated = IPSET_READ_BLOCK_SIZE / node_size;
+    }
+    data.nodes = cork_calloc(allocated, sizeof(struct v2_node));
+
+    for (i = 0; i < node_count; ) {
+        size_t  block_count = node_count - i;
+        const uint8_t  *block;
+        size_t  j;
+
+        if (source->stream != NULL &&
+            block_count > IPSET_READ_BLOCK_SIZE / node_size) {
+            block_count = IPSET_READ_BLOCK_SIZE / node_size;
+        }
+        ep_check(block = source_next(source, block_count * node_size));
+
+        if (i + block_count > allocated) {
+            size_t  new_allocated = allocated * 2;
+            if (new_allocated > node_count) {
+                new_allocated = node_count;
+            }
+            data.nodes = cork_realloc
+                (data.nodes, allocated * sizeof(struct v2_node),
+                 new_allocated * sizeof(struct v2_node));
+            allocated = new_allocated;
+        }
+
+        for (j = 0; j < block_count; j++, i++, block += node_size) {
+            if (node_size == 12) {
+                data.nodes[i].variable = get_le_uint32(block);
+                data.nodes[i].low = get_le_uint32(block + 4);
+                data.nodes[i].high = get_le_uint32(block + 8);
+            } else {
+                uint32_t  low = get_le_uint32(block);
+                uint32_t  high = get_le_uint32(block + 4);
+                data.nodes[i].variable =
+                    ((low >> V2_COMPACT_ID_BITS) << 4) |
+                    (high >> V2_COMPACT_ID_BITS);
+                data.nodes[i].low = low & V2_COMPACT_ID_MASK;
+                data.nodes[i].high = high & V2_COMPACT_ID_MASK;
+            }
+
+            /* The variable has to fit into 8 bits like in a v1 set.
+             * Since the BDD is ordered, that also limits how deeply
+             * load_v2_node can recurse. */
+            if (data.nodes[i].variable > 0xff) {
+                cork_error_set
+                    (IPSET_ERROR, IPSET_PARSE_ERROR,
+                     "Malformed set: bad variable %u",
+                     data.nodes[i].variable);
+                goto error;
+            }
+        }
+    }
+
+    data.cache_ids = cork_calloc(node_count * 2, sizeof(ipset_node_id));
+    data.loaded = cork_calloc(node_count * 2, sizeof(bool));
+
+    if (ipset_node_get_type(root) == IPSET_NONTERMINAL_NODE &&
+        ipset_nonterminal_value(root) >= node_count) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: root node out of range");
+        goto error;
+    }
+    for (i = 0; i < node_count; i++) {
+        ei_check(check_v2_edge
+                 (&data, data.nodes[i].variable, data.nodes[i].low));
+        ei_check(check_v2_edge
+                 (&data, data.nodes[i].variable, data.nodes[i].high));
+    }
+
+    result = load_v2_node(&data, root);
+
+  error:
+    if (data.loaded != NULL) {
+        for (i = 0; i < node_count * 2; i++) {
+            if (data.loaded[i]) {
+                ipset_node_decref(cache, data.cache_ids[i]);
+            }
+        }
+    }
+    free(data.nodes);
+    free(data.cache_ids);
+    free(data.loaded);
+    return result;
 }
 
 
-ipset_node_id
-ipset_node_cache_load(FILE *stream, struct ipset_node_cache *cache)
+/*-----------------------------------------------------------------------
+ * Version 3
+ */
+
+/**
+ * Read in the whole body of a v3 set, which we decode in place.  When
+ * reading from a buffer, we just point into it.  When reading from a
+ * stream, we copy the body into owned one block at a time, so that a bad
+ * length can't make us allocate more than the stream actually holds.
+ */
+static const uint8_t *
+load_v3_body(struct load_source *source, size_t size,
+             struct cork_buffer *owned)
 {
-    size_t bytes_read;
+    if (source->stream == NULL) {
+        return source_next(source, size);
+    }
 
-    /* First, read in the magic number from the stream to ensure that
-     * this is an IP set. */
+    while (owned->size < size) {
+        size_t  block_size = size - owned->size;
+        const uint8_t  *block;
+        if (block_size > IPSET_READ_BLOCK_SIZE) {
+            block_size = IPSET_READ_BLOCK_SIZE;
+        }
+        block = source_next(source, block_size);
+        if (block == NULL) {
+            return NULL;
+        }
+        cork_buffer_append(owned, block, block_size);
+    }
+    return owned->buf;
+}
 
-    uint8_t  magic[MAGIC_NUMBER_LENGTH];
+/**
+ * Decode a LEB128 varint, advancing *src past it.  Returns an error if
+ * the varint runs past end, or doesn't fit into 64 bits.
+ */
+static int
+get_varint_slow(const uint8_t **src, const uint8_t *end, uint64_t *dest)
+{
+    const uint8_t  *p = *src;
+    uint64_t  val = 0;
+    unsigned int  shift = 0;
+
+    while (p < end) {
+        uint8_t  byte = *p++;
+        if (shift == 63 && byte > 1) {
+            break;
+        }
+        val |= (uint64_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            *src = p;
+            *dest = val;
+            return 0;
+        }
+        shift += 7;
+        if (shift > 63) {
+            break;
+        }
+    }
 
-    DEBUG("Reading IP set magic number");
-    bytes_read = fread(magic, 1, MAGIC_NUMBER_LENGTH, stream);
+    cork_error_set
+        (IPSET_ERROR, IPSET_PARSE_ERROR, "Malformed set: bad varint");
+    return -1;
+}
 
-    if (ferror(stream)) {
-        create_errno_error(stream);
+/* Most varints in a set fit into a single byte, so we decode those
+ * inline, and only loop over the bytes of the longer ones. */
+static inline int
+get_varint(const uint8_t **src, const uint8_t *end, uint64_t *dest)
+{
+    if (CORK_LIKELY(*src < end && **src < 0x80)) {
+        *dest = *(*src)++;
         return 0;
     }
+    return get_varint_slow(src, end, dest);
+}
 
-    if (bytes_read != MAGIC_NUMBER_LENGTH) {
-        /* We reached EOF before reading the entire magic number. */
+/**
+ * Turn a v3 node reference into a node ID.  If the low bit is set, the
+ * rest is a terminal value.  Otherwise, the rest is how many nodes
+ * before the current one (serialized node i) the nonterminal is.
+ */
+static int
+load_v3_pointer(struct ipset_node_cache *cache,
+                const ipset_node_id *cache_ids, size_t i,
+                uint64_t pointer, ipset_node_id *dest)
+{
+    uint64_t  value = pointer >> 1;
+
+    if (pointer & 1) {
+        if (value > INT32_MAX) {
+            cork_error_set
+                (IPSET_ERROR, IPSET_PARSE_ERROR,
+                 "Malformed set: bad terminal value %" PRIu64, value);
+            return -1;
+        }
+        *dest = ipset_terminal_node_id(value);
+        return 0;
+    }
+
+    if (value == 0 || value > i) {
         cork_error_set
             (IPSET_ERROR, IPSET_PARSE_ERROR,
-             "Unexpected end of file");
+             "Malformed set: bad node reference %" PRIu64, value);
+        return -1;
+    }
+
+    *dest = cache_ids[i - value];
+    ipset_node_incref(cache, *dest);
+    return 0;
+}
+
+/**
+ * Apply a zigzag-encoded variable delta to the previous node's
+ * variable, making sure that the result still fits into 8 bits like in
+ * a v1 set.
+ */
+static int
+load_v3_variable(ipset_variable *variable, uint64_t delta)
+{
+    uint64_t  magnitude = delta >> 1;
+
+    if (delta & 1) {
+        if (magnitude < *variable) {
+            *variable -= magnitude + 1;
+            return 0;
+        }
+    } else {
+        if (magnitude <= 0xff - *variable) {
+            *variable += magnitude;
+            return 0;
+        }
+    }
+
+    cork_error_set
+        (IPSET_ERROR, IPSET_PARSE_ERROR,
+         "Malformed set: bad variable delta %" PRIu64, delta);
+    return -1;
+}
+
+/**
+ * A helper function for reading a version 3 BDD stream.
+ */
+static ipset_node_id
+load_v3(struct load_source *source, struct ipset_node_cache *cache)
+{
+    DEBUG("Stream contains v3 IP set");
+    struct cork_buffer  owned;
+    ipset_node_id  result = 0;
+    ipset_node_id  *cache_ids = NULL;
+    const uint8_t  *p;
+    const uint8_t  *end;
+    uint64_t  length;
+    uint64_t  nonterminal_count;
+    size_t  body_size;
+    ipset_variable  variable = 0;
+    size_t  i = 0;
+
+    /* We've already read in the magic number and version.  Next should
+     * be the length of the encoded set, which includes the magic
+     * number, version number, and the length field itself.  The
+     * smallest body is a zero count followed by a terminal value. */
+    DEBUG("Reading encoded length");
+    xi_check(0, read_uint64(source, &length));
+    if (length < MAGIC_NUMBER_LENGTH + sizeof(uint16_t) +
+                 sizeof(uint64_t) + 2 ||
+        length - MAGIC_NUMBER_LENGTH - sizeof(uint16_t) -
+                 sizeof(uint64_t) > SIZE_MAX) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR, "Malformed set: wrong length");
         return 0;
     }
+    body_size = length - MAGIC_NUMBER_LENGTH - sizeof(uint16_t) -
+        sizeof(uint64_t);
+
+    cork_buffer_init(&owned);
+    ep_check(p = load_v3_body(source, body_size, &owned));
+    end = p + body_size;
+
+    DEBUG("Reading number of nonterminals");
+    ei_check(get_varint(&p, end, &nonterminal_count));
+
+    /* If there are no nonterminals, then there's only a single terminal
+     * left to read. */
+    if (nonterminal_count == 0) {
+        uint64_t  value;
+        DEBUG("Reading single terminal value");
+        ei_check(get_varint(&p, end, &value));
+        if (value > INT32_MAX) {
+            cork_error_set
+                (IPSET_ERROR, IPSET_PARSE_ERROR,
+                 "Malformed set: bad terminal value %" PRIu64, value);
+            goto error;
+        }
+        result = ipset_terminal_node_id(value);
+        goto done;
+    }
+
+    /* Each nonterminal takes up at least three bytes, which keeps a bad
+     * count from making us allocate too much space. */
+    if (nonterminal_count > (size_t) (end - p) / 3) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: too many nonterminals");
+        goto error;
+    }
+
+    /* Like in a v1 set, cache_ids maps each serialized nonterminal to
+     * its node in the cache, and holds a reference to it until we're
+     * done. */
+    cache_ids = cork_calloc(nonterminal_count, sizeof(ipset_node_id));
+
+    for (i = 0; i < nonterminal_count; ) {
+        uint64_t  delta;
+        uint64_t  low;
+        uint64_t  high;
+        ipset_node_id  low_id;
+        ipset_node_id  high_id;
+
+        ei_check(get_varint(&p, end, &delta));
+        ei_check(get_varint(&p, end, &low));
+        ei_check(get_varint(&p, end, &high));
+
+        ei_check(load_v3_variable(&variable, delta));
+
+        DEBUG("Read serialized node -%zu = (x%u? %" PRIu64 ": %" PRIu64 ")",
+              i+1, variable, high, low);
+
+        ei_check(load_v3_pointer(cache, cache_ids, i, low, &low_id));
+        if (load_v3_pointer(cache, cache_ids, i, high, &high_id) != 0) {
+            ipset_node_decref(cache, low_id);
+            goto error;
+        }
+
+        cache_ids[i++] = ipset_node_cache_nonterminal
+            (cache, variable, low_id, high_id);
+    }
+
+    /* The last node is the nonterminal for the entire set. */
+    result = cache_ids[nonterminal_count - 1];
+    ipset_node_incref(cache, result);
+
+  done:
+    if (p != end) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: extra data at end of stream.");
+        ipset_node_decref(cache, result);
+        result = 0;
+    }
+    if (cache_ids != NULL) {
+        release_cache_ids(cache, cache_ids, i);
+    }
+    cork_buffer_done(&owned);
+    return result;
+
+  error:
+    if (cache_ids != NULL) {
+        release_cache_ids(cache, cache_ids, i);
+    }
+    cork_buffer_done(&owned);
+    return 0;
+}
+
+
+/*-----------------------------------------------------------------------
+ * Loading
+ */
+
+static ipset_node_id
+load(struct load_source *source, struct ipset_node_cache *cache)
+{
+    const uint8_t  *magic;
+
+    /* First, read in the magic number from the stream to ensure that
+     * this is an IP set. */
+
+    DEBUG("Reading IP set magic number");
+    xp_check(0, magic = source_next(source, MAGIC_NUMBER_LENGTH));
 
     if (memcmp(magic, MAGIC_NUMBER, MAGIC_NUMBER_LENGTH) != 0) {
         /* The magic number doesn't match, so this isn't a BDD. */
@@ -333,11 +978,17 @@ ipset_node_cache_load(FILE *stream, struct ipset_node_cache *cache)
 
     uint16_t  version;
     DEBUG("Reading IP set version");
-    xi_check(0, read_uint16(stream, &version));
+    xi_check(0, read_uint16(source, &version));
 
     switch (version) {
         case 0x0001:
-            return load_v1(stream, cache);
+            return load_v1(source, cache);
+
+        case 0x0002:
+            return load_v2(source, cache);
+
+        case 0x0003:
+            return load_v3(source, cache);
 
         default:
             /* We don't know how to read this version number. */
@@ -347,3 +998,41 @@ ipset_node_cache_load(FILE *stream, struct ipset_node_cache *cache)
             return 0;
     }
 }
+
+
+ipset_node_id
+ipset_node_cache_load(FILE *stream, struct ipset_node_cache *cache)
+{
+    struct load_source  source = { stream, NULL, NULL, 0, 0 };
+    ipset_node_id  result;
+
+    source.block = cork_malloc(IPSET_READ_BLOCK_SIZE);
+    result = load(&source, cache);
+    free(source.block);
+    return result;
+}
+
+
+ipset_node_id
+ipset_node_cache_load_from_buffer(const void *buf, size_t size,
+                                  struct ipset_node_cache *cache)
+{
+    struct load_source  source = { NULL, NULL, buf, size, 0 };
+    ipset_node_id  result;
+
+    result = load(&source, cache);
+    if (cork_error_occurred()) {
+        return 0;
+    }
+
+    /* Unlike a stream, the buffer should hold exactly one BDD. */
+    if (source.pos != size) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Malformed set: extra data at end of buffer.");
+        ipset_node_decref(cache, result);
+        return 0;
+    }
+
+    return result;
+}
@@ -0,0 +1,223 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libcork/core.h>
+#include <libcork/ds.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/logging.h"
+
+
+/*-----------------------------------------------------------------------
+ * Stride tables
+ */
+
+/* The most levels that a stride table can have: one for variable 0,
+ * one for the root stride, and enough 8-bit strides to cover the rest
+ * of a 128-bit address. */
+#define IPSET_STRIDE_MAX_LEVELS \
+    (2 + (128 - IPSET_STRIDE_ROOT_BITS) / IPSET_STRIDE_BITS)
+
+struct ipset_stride_builder {
+    const struct ipset_node_cache  *cache;
+    struct ipset_stride_table  *table;
+    size_t  allocated;
+    /* For each level, a map from a BDD node to one more than the offset
+     * of the table that we've already built for it. */
+    struct cork_hash_table  *tables[IPSET_STRIDE_MAX_LEVELS];
+};
+
+
+static ipset_variable
+ipset_stride_first_var(unsigned int level)
+{
+    if (level == 0) {
+        return 0;
+    } else if (level == 1) {
+        return 1;
+    } else {
+        return 1 + IPSET_STRIDE_ROOT_BITS + (level - 2) * IPSET_STRIDE_BITS;
+    }
+}
+
+static unsigned int
+ipset_stride_bits(unsigned int level)
+{
+    if (level == 0) {
+        return 1;
+    } else if (level == 1) {
+        return IPSET_STRIDE_ROOT_BITS;
+    } else {
+        return IPSET_STRIDE_BITS;
+    }
+}
+
+
+static size_t
+ipset_stride_builder_get_table(struct ipset_stride_builder *builder,
+                               ipset_node_id node, unsigned int level);
+
+/**
+ * Fill in the 2^stride entries starting at start, for variables var
+ * through var+stride-1.  Any variables that the BDD skips don't affect
+ * the result, so we fill in the entries for the first value of those
+ * variables, and copy them into the rest.
+ */
+static void
+ipset_stride_builder_fill(struct ipset_stride_builder *builder, size_t start,
+                          ipset_node_id node, ipset_variable var,
+                          unsigned int stride, unsigned int level)
+{
+    struct ipset_node  *bdd_node = NULL;
+    size_t  count = (size_t) 1 << stride;
+    size_t  half;
+    size_t  i;
+
+    if (ipset_node_get_type(node) == IPSET_NONTERMINAL_NODE) {
+        bdd_node = ipset_node_cache_get_nonterminal(builder->cache, node);
+    }
+
+    if (bdd_node == NULL || ipset_node_variable(bdd_node) >= var + stride) {
+        ipset_node_id  entry = node;
+        if (bdd_node != NULL) {
+            /* This subtree continues into the next level. */
+            entry = ipset_nonterminal_node_id
+                (ipset_stride_builder_get_table(builder, node, level + 1));
+        }
+        for (i = 0; i < count; i++) {
+            builder->table->entries[start + i] = entry;
+        }
+        return;
+    }
+
+    stride -= ipset_node_variable(bdd_node) - var;
+    var = ipset_node_variable(bdd_node);
+    half = (size_t) 1 << (stride - 1);
+    ipset_stride_builder_fill
+        (builder, start, ipset_edge_low(node, bdd_node),
+         var + 1, stride - 1, level);
+    ipset_stride_builder_fill
+        (builder, start + half, ipset_edge_high(node, bdd_node),
+         var + 1, stride - 1, level);
+
+    for (i = half * 2; i < count; i += half * 2) {
+        memcpy(&builder->table->entries[start + i],
+               &builder->table->entries[start],
+               half * 2 * sizeof(ipset_node_id));
+    }
+}
+
+
+static size_t
+ipset_stride_builder_get_table(struct ipset_stride_builder *builder,
+                               ipset_node_id node, unsigned int level)
+{
+    struct ipset_stride_table  *table = builder->table;
+    void  *key = (void *) (uintptr_t) node;
+    uintptr_t  existing;
+    size_t  start;
+    size_t  count;
+
+    if (builder->tables[level] == NULL) {
+        builder->tables[level] = cork_pointer_hash_table_new(0, 0);
+    }
+
+    existing = (uintptr_t) cork_hash_table_get(builder->tables[level], key);
+    if (existing != 0) {
+        return existing - 1;
+    }
+
+    /* Reserve space for the new table before filling it in, since
+     * filling it might create more tables. */
+    start = table->entry_count;
+    count = (size_t) 1 << ipset_stride_bits(level);
+    if (start + count > builder->allocated) {
+        size_t  new_allocated = builder->allocated * 2;
+        if (new_allocated < start + count) {
+            new_allocated = start + count;
+        }
+        table->entries = cork_realloc
+            (table->entries, builder->allocated * sizeof(ipset_node_id),
+             new_allocated * sizeof(ipset_node_id));
+        builder->allocated = new_allocated;
+    }
+    if (CORK_UNLIKELY(start + count > (UINT_MAX >> 2))) {
+        fprintf(stderr, "Stride table has too many entries\n");
+        abort();
+    }
+    table->entry_count += count;
+
+    cork_hash_table_put
+        (builder->tables[level], key, (void *) (uintptr_t) (start + 1),
+         NULL, NULL, NULL);
+    ipset_stride_builder_fill
+        (builder, start, node, ipset_stride_first_var(level),
+         ipset_stride_bits(level), level);
+    return start;
+}
+
+
+struct ipset_stride_table *
+ipset_node_compile_strides(const struct ipset_node_cache *cache,
+                           ipset_node_id node)
+{
+    struct ipset_stride_builder  builder;
+    struct ipset_stride_table  *table =
+        cork_new(struct ipset_stride_table);
+    unsigned int  i;
+
+    table->entries = NULL;
+    table->entry_count = 0;
+    if (ipset_node_get_type(node) == IPSET_TERMINAL_NODE) {
+        table->root = node;
+        return table;
+    }
+
+    builder.cache = cache;
+    builder.table = table;
+    builder.allocated = 0;
+    for (i = 0; i < IPSET_STRIDE_MAX_LEVELS; i++) {
+        builder.tables[i] = NULL;
+    }
+
+    table->root = ipset_nonterminal_node_id
+        (ipset_stride_builder_get_table(&builder, node, 0));
+    DEBUG("Compiled stride table with %zu entries", table->entry_count);
+    table->entries = cork_realloc
+        (table->entries, builder.allocated * sizeof(ipset_node_id),
+         table->entry_count * sizeof(ipset_node_id));
+
+    for (i = 0; i < IPSET_STRIDE_MAX_LEVELS; i++) {
+        if (builder.tables[i] != NULL) {
+            cork_hash_table_free(builder.tables[i]);
+        }
+    }
+    return table;
+}
+
+
+void
+ipset_stride_table_free(struct ipset_stride_table *table)
+{
+    if (table->entries != NULL) {
+        free(table->entries);
+    }
+    free(table);
+}
+
+
+size_t
+ipset_stride_table_memory_size(const struct ipset_stride_table *table)
+{
+    return sizeof(struct ipset_stride_table) +
+        table->entry_count * sizeof(ipset_node_id);
+}
@@ -7,13 +7,166 @@
  * ----------------------------------------------------------------------
  */
 
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
 #include <libcork/core.h>
+#include <libcork/ds.h>
 #include <libcork/helpers/errors.h>
 
 #include "ipset/bdd/nodes.h"
+#include "ipset/errors.h"
 #include "ipset/logging.h"
 
 
+/*-----------------------------------------------------------------------
+ * Buffered output
+ */
+
+/**
+ * We collect the many small writes that make up a saved BDD into a
+ * buffer of this size, and pass them on to the output in large chunks.
+ */
+#define IPSET_WRITE_BUFFER_SIZE  65536
+
+/**
+ * Where we save a BDD to.  If stream is non-NULL, we pass each chunk
+ * of data on to it; otherwise we write the chunks straight to fd.
+ */
+struct save_output {
+    struct cork_stream_consumer  *stream;
+    int  fd;
+    bool  is_first;
+    uint8_t  *buf;
+    size_t  used;
+};
+
+static void
+save_output_init_stream(struct save_output *out,
+                        struct cork_stream_consumer *stream)
+{
+    out->stream = stream;
+    out->fd = -1;
+    out->is_first = true;
+    out->buf = cork_malloc(IPSET_WRITE_BUFFER_SIZE);
+    out->used = 0;
+}
+
+static void
+save_output_init_fd(struct save_output *out, int fd)
+{
+    out->stream = NULL;
+    out->fd = fd;
+    out->is_first = true;
+    out->buf = cork_malloc(IPSET_WRITE_BUFFER_SIZE);
+    out->used = 0;
+}
+
+static void
+save_output_done(struct save_output *out)
+{
+    free(out->buf);
+}
+
+/**
+ * Write every byte in a list of chunks to a file descriptor, retrying
+ * if the kernel only accepts part of them.  The list is modified.
+ */
+static int
+write_fd_fully(int fd, struct iovec *iov, int iov_count)
+{
+    while (iov_count > 0) {
+        ssize_t  written = writev(fd, iov, iov_count);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cork_error_set
+                (IPSET_ERROR, IPSET_IO_ERROR, "%s", strerror(errno));
+            return -1;
+        }
+
+        while (iov_count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            iov_count--;
+        }
+        if (iov_count > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Pass any buffered data on to the output, followed by size bytes from
+ * data.  When writing to a file descriptor, that's a single system
+ * call, even though the two pieces aren't next to each other.
+ */
+static int
+save_output_send(struct save_output *out, const void *data, size_t size)
+{
+    size_t  used = out->used;
+    out->used = 0;
+
+    if (out->stream == NULL) {
+        struct iovec  iov[2];
+        iov[0].iov_base = out->buf;
+        iov[0].iov_len = used;
+        iov[1].iov_base = (void *) data;
+        iov[1].iov_len = size;
+        return write_fd_fully(out->fd, iov, 2);
+    }
+
+    if (used > 0) {
+        rii_check(cork_stream_consumer_data
+                  (out->stream, out->buf, used, out->is_first));
+        out->is_first = false;
+    }
+    if (size > 0) {
+        rii_check(cork_stream_consumer_data
+                  (out->stream, data, size, out->is_first));
+        out->is_first = false;
+    }
+    return 0;
+}
+
+/**
+ * Write any data that's still in the buffer to the output.
+ */
+static int
+save_output_flush(struct save_output *out)
+{
+    if (out->used == 0) {
+        return 0;
+    }
+    return save_output_send(out, NULL, 0);
+}
+
+/**
+ * Write size bytes from data to the output.  Small writes are copied
+ * into the buffer; anything too large to fit goes straight to the
+ * output, without being copied.
+ */
+static int
+write_data(struct save_output *out, const void *data, size_t size)
+{
+    if (size > IPSET_WRITE_BUFFER_SIZE - out->used) {
+        if (size >= IPSET_WRITE_BUFFER_SIZE) {
+            return save_output_send(out, data, size);
+        }
+        rii_check(save_output_send(out, NULL, 0));
+    }
+
+    memcpy(out->buf + out->used, data, size);
+    out->used += size;
+    return 0;
+}
+
+
 /*-----------------------------------------------------------------------
  * Generic saving logic
  */
@@ -88,12 +241,19 @@ struct save_data {
     /* The node cache that we're saving nodes from. */
     struct ipset_node_cache  *cache;
 
-    /* The output stream to save the data to. */
-    struct cork_stream_consumer  *stream;
+    /* The output to save the data to. */
+    struct save_output  out;
+
+    /* The serialized ID of each nonterminal that we've written so
+     * far, indexed by save_slot, or 0 if we haven't written it yet. */
+    serialized_id  *serialized_ids;
 
-    /* The cache of serialized IDs for any nonterminals that we've
-     * encountered so far. */
-    struct cork_hash_table  *serialized_ids;
+    /* The terminals that we've written so far. */
+    struct cork_hash_table  *terminals;
+
+    /* The nodes that we're in the middle of visiting.  Each node's
+     * parent is below it in the stack. */
+    cork_array(ipset_node_id)  stack;
 
     /* The serialized ID to use for the next nonterminal that we
      * encounter. */
@@ -117,68 +277,183 @@ struct save_data {
 
 
 /**
- * A helper function for ipset_node_save().  Outputs a nonterminal
- * node in a BDD tree, if we haven't done so already.  Ensures that
- * the children of the nonterminal are output before the nonterminal
- * is.  Returns the serialized ID of this node.
+ * The file format doesn't have complement edges, so a complemented
+ * edge is saved as a separate copy of the negated node.  Each of those
+ * copies gets its own slot in the arrays that we index by nonterminal,
+ * which therefore need room for two slots per cache index.
  */
 
-static int
-save_visit_node(struct save_data *save_data,
-                ipset_node_id node_id, serialized_id *dest)
+#define save_slot(node_id)  ((node_id) >> 1)
+
+static size_t
+save_slot_count(const struct ipset_node_cache *cache)
 {
-    /* Check whether we've already serialized this node. */
+    return (size_t) cache->largest_index * 2;
+}
+
+
+/**
+ * Return how many nonterminals we'll write, which can be more than the
+ * number of nonterminals in the cache.
+ */
+
+static size_t
+save_count_nonterminals(struct ipset_node_cache *cache, ipset_node_id root)
+{
+    cork_array(ipset_node_id)  stack;
+    bool  *visited;
+    size_t  count = 0;
+
+    if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE) {
+        return 0;
+    }
+
+    visited = cork_calloc(save_slot_count(cache), sizeof(bool));
+    cork_array_init(&stack);
+    cork_array_append(&stack, root);
+    visited[save_slot(root)] = true;
+
+    while (!cork_array_is_empty(&stack)) {
+        ipset_node_id  node_id =
+            cork_array_at(&stack, cork_array_size(&stack) - 1);
+        struct ipset_node  *node =
+            ipset_node_cache_get_nonterminal(cache, node_id);
+        ipset_node_id  children[2];
+        unsigned int  i;
+
+        stack.size--;
+        count++;
+
+        children[0] = ipset_edge_low(node_id, node);
+        children[1] = ipset_edge_high(node_id, node);
+        for (i = 0; i < 2; i++) {
+            if (ipset_node_get_type(children[i]) == IPSET_NONTERMINAL_NODE &&
+                !visited[save_slot(children[i])]) {
+                visited[save_slot(children[i])] = true;
+                cork_array_append(&stack, children[i]);
+            }
+        }
+    }
+
+    free(visited);
+    cork_array_done(&stack);
+    return count;
+}
+
+
+/**
+ * A helper function for ipset_node_save().  Outputs a terminal node,
+ * if we haven't done so already.
+ */
 
-    struct cork_hash_table_entry  *entry;
+static int
+save_visit_terminal(struct save_data *save_data, ipset_node_id node_id)
+{
     bool  is_new;
-    entry = cork_hash_table_get_or_create
-        (save_data->serialized_ids, (void *) (uintptr_t) node_id, &is_new);
+    cork_hash_table_get_or_create
+        (save_data->terminals, (void *) (uintptr_t) node_id, &is_new);
+
+    if (is_new) {
+        /* For terminals, there isn't really anything to do — we just
+         * output the terminal node and use its value as the serialized
+         * ID. */
+        ipset_value  value = ipset_terminal_value(node_id);
+        DEBUG("Writing terminal(%d)", value);
+        rii_check(save_data->write_terminal(save_data, value));
+    }
+    return 0;
+}
+
 
-    if (!is_new) {
-        *dest = (intptr_t) entry->value;
+/**
+ * Make sure that one of a nonterminal's children has been output.  If
+ * it's a nonterminal that we haven't output yet, we push it onto the
+ * stack and set done to false; otherwise we fill in its serialized ID
+ * and set done to true.
+ */
+
+static int
+save_visit_child(struct save_data *save_data, ipset_node_id node_id,
+                 serialized_id *dest, bool *done)
+{
+    if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
+        rii_check(save_visit_terminal(save_data, node_id));
+        *dest = ipset_terminal_value(node_id);
+        *done = true;
         return 0;
-    } else {
-        if (ipset_node_get_type(node_id) == IPSET_TERMINAL_NODE) {
-            /* For terminals, there isn't really anything to do — we
-             * just output the terminal node and use its value as the
-             * serialized ID. */
-
-            ipset_value  value = ipset_terminal_value(node_id);
-
-            DEBUG("Writing terminal(%d)", value);
-            rii_check(save_data->write_terminal(save_data, value));
-            entry->value = (void *) (intptr_t) value;
-            *dest = value;
-            return 0;
-        } else {
-            /* For nonterminals, we drill down into the node's children
-             * first, then output the nonterminal node. */
-
-            struct ipset_node  *node =
-                ipset_node_cache_get_nonterminal(save_data->cache, node_id);
-            DEBUG("Visiting node %u nonterminal(x%u? %u: %u)",
-                  node_id, node->variable, node->high, node->low);
-
-            /* Output the node's nonterminal children before we output
-             * the node itself. */
-            serialized_id  serialized_low;
-            serialized_id  serialized_high;
-            rii_check(save_visit_node(save_data, node->low, &serialized_low));
-            rii_check(save_visit_node(save_data, node->high, &serialized_high));
-
-            /* Output the nonterminal */
-            serialized_id  result = save_data->next_serialized_id--;
-            DEBUG("Writing node %u as serialized node %d = (x%u? %d: %d)",
-                  node_id, result,
-                  node->variable, serialized_low, serialized_high);
-
-            entry->value = (void *) (intptr_t) result;
-            *dest = result;
-            return save_data->write_nonterminal
-                (save_data, result, node->variable,
-                 serialized_low, serialized_high);
+    }
+
+    *dest = save_data->serialized_ids[save_slot(node_id)];
+    *done = (*dest != 0);
+    if (!*done) {
+        cork_array_append(&save_data->stack, node_id);
+    }
+    return 0;
+}
+
+
+/**
+ * A helper function for ipset_node_save().  Outputs each node in a BDD
+ * tree, making sure that the children of each nonterminal are output
+ * before the nonterminal is.  We keep our own stack of the nodes that
+ * we're visiting, instead of recursing, and look at each nonterminal
+ * on the stack until both of its children have been output.
+ */
+
+static int
+save_visit_nodes(struct save_data *save_data, ipset_node_id root)
+{
+    if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE) {
+        return save_visit_terminal(save_data, root);
+    }
+
+    cork_array_append(&save_data->stack, root);
+    while (!cork_array_is_empty(&save_data->stack)) {
+        ipset_node_id  node_id = cork_array_at
+            (&save_data->stack, cork_array_size(&save_data->stack) - 1);
+        struct ipset_node  *node;
+        serialized_id  serialized_low;
+        serialized_id  serialized_high;
+        serialized_id  result;
+        bool  done;
+
+        /* The same node might have been pushed onto the stack more
+         * than once, from different parents. */
+        if (save_data->serialized_ids[save_slot(node_id)] != 0) {
+            save_data->stack.size--;
+            continue;
+        }
+
+        /* Output the node's children before we output the node
+         * itself. */
+        node = ipset_node_cache_get_nonterminal(save_data->cache, node_id);
+        rii_check(save_visit_child
+                  (save_data, ipset_edge_low(node_id, node),
+                   &serialized_low, &done));
+        if (!done) {
+            continue;
+        }
+        rii_check(save_visit_child
+                  (save_data, ipset_edge_high(node_id, node),
+                   &serialized_high, &done));
+        if (!done) {
+            continue;
         }
+
+        /* Output the nonterminal */
+        result = save_data->next_serialized_id--;
+        DEBUG("Writing node %u as serialized node %d = (x%u? %d: %d)",
+              node_id, result,
+              ipset_node_variable(node), serialized_low, serialized_high);
+
+        save_data->serialized_ids[save_slot(node_id)] = result;
+        save_data->stack.size--;
+        rii_check(save_data->write_nonterminal
+                  (save_data, result, ipset_node_variable(node),
+                   serialized_low, serialized_high));
     }
+
+    return 0;
 }
 
 
@@ -196,30 +471,36 @@ save_bdd(struct save_data *save_data,
      * mapping from internal node ID to serialized node ID. */
 
     DEBUG("Creating file caches");
-    save_data->serialized_ids = cork_pointer_hash_table_new(0, 0);
+    save_data->serialized_ids =
+        cork_calloc(save_slot_count(cache), sizeof(serialized_id));
+    save_data->terminals = cork_pointer_hash_table_new(0, 0);
+    cork_array_init(&save_data->stack);
     save_data->next_serialized_id = -1;
 
     /* Trace down through the BDD tree, outputting each terminal and
      * nonterminal node as they're encountered. */
 
     DEBUG("Writing nodes");
-
-    serialized_id  last_serialized_id;
-    ei_check(save_visit_node(save_data, root, &last_serialized_id));
+    ei_check(save_visit_nodes(save_data, root));
 
     /* Finally, output the file footer and cleanup. */
 
     DEBUG("Writing file footer");
     ei_check(save_data->write_footer(save_data, cache, root));
+    ei_check(save_output_flush(&save_data->out));
 
     DEBUG("Freeing file caches");
-    cork_hash_table_free(save_data->serialized_ids);
+    free(save_data->serialized_ids);
+    cork_hash_table_free(save_data->terminals);
+    cork_array_done(&save_data->stack);
     return 0;
 
   error:
     /* If there's an error, clean up the objects that we've created
      * before returning. */
-    cork_hash_table_free(save_data->serialized_ids);
+    free(save_data->serialized_ids);
+    cork_hash_table_free(save_data->terminals);
+    cork_array_done(&save_data->stack);
     return -1;
 }
 
@@ -229,64 +510,64 @@ save_bdd(struct save_data *save_data,
  */
 
 /**
- * Write a NUL-terminated string to a stream.  If we can't write the
+ * Write a NUL-terminated string to the output.  If we can't write the
  * string for some reason, return an error.
  */
 static int
-write_string(struct cork_stream_consumer *stream, const char *str)
+write_string(struct save_output *out, const char *str)
 {
     size_t  len = strlen(str);
-    return cork_stream_consumer_data(stream, str, len, false);
+    return write_data(out, str, len);
 }
 
 
 /**
- * Write a big-endian uint8 to a stream.  If we can't write the
+ * Write a big-endian uint8 to the output.  If we can't write the
  * integer for some reason, return an error.
  */
 static int
-write_uint8(struct cork_stream_consumer *stream, uint8_t val)
+write_uint8(struct save_output *out, uint8_t val)
 {
     /* for a byte, we don't need to endian-swap */
-    return cork_stream_consumer_data(stream, &val, sizeof(uint8_t), false);
+    return write_data(out, &val, sizeof(uint8_t));
 }
 
 
 /**
- * Write a big-endian uint16 to a stream.  If we can't write the
+ * Write a big-endian uint16 to the output.  If we can't write the
  * integer for some reason, return an error.
  */
 static int
-write_uint16(struct cork_stream_consumer *stream, uint16_t val)
+write_uint16(struct save_output *out, uint16_t val)
 {
     CORK_UINT16_HOST_TO_BIG_IN_PLACE(val);
-    return cork_stream_consumer_data(stream, &val, sizeof(uint16_t), false);
+    return write_data(out, &val, sizeof(uint16_t));
 }
 
 
 /**
- * Write a big-endian uint32 to a stream.  If we can't write the
+ * Write a big-endian uint32 to the output.  If we can't write the
  * integer for some reason, return an error.
  */
 
 static int
-write_uint32(struct cork_stream_consumer *stream, uint32_t val)
+write_uint32(struct save_output *out, uint32_t val)
 {
     CORK_UINT32_HOST_TO_BIG_IN_PLACE(val);
-    return cork_stream_consumer_data(stream, &val, sizeof(uint32_t), false);
+    return write_data(out, &val, sizeof(uint32_t));
 }
 
 
 /**
- * Write a big-endian uint64 to a stream.  If we can't write the
+ * Write a big-endian uint64 to the output.  If we can't write the
  * integer for some reason, return an error.
  */
 
 static int
-write_uint64(struct cork_stream_consumer *stream, uint64_t val)
+write_uint64(struct save_output *out, uint64_t val)
 {
     CORK_UINT64_HOST_TO_BIG_IN_PLACE(val);
-    return cork_stream_consumer_data(stream, &val, sizeof(uint64_t), false);
+    return write_data(out, &val, sizeof(uint64_t));
 }
 
 
@@ -304,13 +585,12 @@ write_header_v1(struct save_data *save_data,
 {
     /* Output the magic number for an IP set, and the file format
      * version that we're going to write. */
-    rii_check(cork_stream_consumer_data(save_data->stream, NULL, 0, true));
-    rii_check(write_string(save_data->stream, MAGIC_NUMBER));
-    rii_check(write_uint16(save_data->stream, 0x0001));
+    rii_check(write_string(&save_data->out, MAGIC_NUMBER));
+    rii_check(write_uint16(&save_data->out, 0x0001));
 
-    /* Determine how many reachable nodes there are, to calculate the
+    /* Determine how many nonterminals we'll write, to calculate the
      * size of the set. */
-    size_t  nonterminal_count = ipset_node_reachable_count(cache, root);
+    size_t  nonterminal_count = save_count_nonterminals(cache, root);
     size_t  set_size =
         MAGIC_NUMBER_LENGTH +    /* magic number */
         sizeof(uint16_t) +        /* version number  */
@@ -328,8 +608,8 @@ write_header_v1(struct save_data *save_data,
         set_size += sizeof(uint32_t);
     }
 
-    rii_check(write_uint64(save_data->stream, set_size));
-    rii_check(write_uint32(save_data->stream, nonterminal_count));
+    rii_check(write_uint64(&save_data->out, set_size));
+    rii_check(write_uint32(&save_data->out, nonterminal_count));
     return 0;
 }
 
@@ -343,7 +623,7 @@ write_footer_v1(struct save_data *save_data,
 
     if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE) {
         ipset_value  value = ipset_terminal_value(root);
-        return write_uint32(save_data->stream, value);
+        return write_uint32(&save_data->out, value);
     }
 
     return 0;
@@ -367,25 +647,278 @@ write_nonterminal_v1(struct save_data *save_data,
                      serialized_id serialized_low,
                      serialized_id serialized_high)
 {
-    rii_check(write_uint8(save_data->stream, variable));
-    rii_check(write_uint32(save_data->stream, serialized_low));
-    rii_check(write_uint32(save_data->stream, serialized_high));
+    rii_check(write_uint8(&save_data->out, variable));
+    rii_check(write_uint32(&save_data->out, serialized_low));
+    rii_check(write_uint32(&save_data->out, serialized_high));
     return 0;
 }
 
 
+/*-----------------------------------------------------------------------
+ * V3 BDD file
+ */
+
+/**
+ * A v3 file has the same structure as a v1 file, but encodes each
+ * integer as a LEB128 varint, so that small values take up fewer
+ * bytes.  We encode each node's variable relative to the previous
+ * node's, and each nonterminal reference relative to the node that
+ * contains it, since both differences tend to be small.  We don't know
+ * how long the file is until we've encoded all of the nodes, so we
+ * collect them in a buffer, and write everything out in the footer.
+ */
+
+struct v3_data {
+    /* The encoded nonterminals */
+    struct cork_buffer  body;
+
+    /* The variable of the last nonterminal that we encoded */
+    ipset_variable  last_variable;
+};
+
+#define V3_MAX_VARINT_SIZE  10
+
+static size_t
+encode_varint(uint8_t *dest, uint64_t val)
+{
+    size_t  size = 0;
+    while (val >= 0x80) {
+        dest[size++] = (uint8_t) (val | 0x80);
+        val >>= 7;
+    }
+    dest[size++] = (uint8_t) val;
+    return size;
+}
+
+/* Encode a child pointer.  The low bit tells whether it's a terminal
+ * value or how many nodes back the nonterminal is. */
+static uint64_t
+encode_v3_pointer(serialized_id serialized_node, serialized_id pointer)
+{
+    if (pointer >= 0) {
+        return ((uint64_t) pointer << 1) | 1;
+    } else {
+        return (uint64_t) (pointer - serialized_node) << 1;
+    }
+}
+
+
+static int
+write_header_v3(struct save_data *save_data,
+                struct ipset_node_cache *cache, ipset_node_id root)
+{
+    /* We write the header in the footer, once we know how long the
+     * set is. */
+    return 0;
+}
+
+
+static int
+write_footer_v3(struct save_data *save_data,
+                struct ipset_node_cache *cache, ipset_node_id root)
+{
+    struct v3_data  *v3_data = save_data->user_data;
+    uint8_t  prefix[2 * V3_MAX_VARINT_SIZE];
+    size_t  prefix_size;
+
+    /* The nonterminal count comes first, followed by either the
+     * nonterminals, or the value of the terminal if there aren't any. */
+    prefix_size = encode_varint
+        (prefix, -(int64_t) save_data->next_serialized_id - 1);
+    if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE) {
+        prefix_size += encode_varint
+            (prefix + prefix_size, (uint32_t) ipset_terminal_value(root));
+    }
+
+    rii_check(write_string(&save_data->out, MAGIC_NUMBER));
+    rii_check(write_uint16(&save_data->out, 0x0003));
+    rii_check(write_uint64
+              (&save_data->out,
+               MAGIC_NUMBER_LENGTH + sizeof(uint16_t) + sizeof(uint64_t) +
+               prefix_size + v3_data->body.size));
+    rii_check(write_data(&save_data->out, prefix, prefix_size));
+    if (ipset_node_get_type(root) == IPSET_TERMINAL_NODE) {
+        return 0;
+    }
+    return write_data
+        (&save_data->out, v3_data->body.buf, v3_data->body.size);
+}
+
+
+static int
+write_nonterminal_v3(struct save_data *save_data,
+                     serialized_id serialized_node,
+                     ipset_variable variable,
+                     serialized_id serialized_low,
+                     serialized_id serialized_high)
+{
+    struct v3_data  *v3_data = save_data->user_data;
+    uint8_t  node[3 * V3_MAX_VARINT_SIZE];
+    int64_t  delta = (int64_t) variable - v3_data->last_variable;
+    size_t  size;
+
+    /* Zigzag-encode the variable delta, so that small negative deltas
+     * are small, too. */
+    size = encode_varint(node, delta < 0? ((-delta) << 1) - 1: delta << 1);
+    size += encode_varint
+        (node + size, encode_v3_pointer(serialized_node, serialized_low));
+    size += encode_varint
+        (node + size, encode_v3_pointer(serialized_node, serialized_high));
+    cork_buffer_append(&v3_data->body, node, size);
+    v3_data->last_variable = variable;
+    return 0;
+}
+
+
+static int
+save_nodes(struct save_data *save_data, struct ipset_node_cache *cache,
+           ipset_node_id node, unsigned int flags)
+{
+    struct v3_data  v3_data;
+    int  rc;
+
+    save_data->cache = cache;
+    if (flags & IPSET_SAVE_COMPACT) {
+        cork_buffer_init(&v3_data.body);
+        v3_data.last_variable = 0;
+        save_data->write_header = write_header_v3;
+        save_data->write_footer = write_footer_v3;
+        save_data->write_terminal = write_terminal_v1;
+        save_data->write_nonterminal = write_nonterminal_v3;
+        save_data->user_data = &v3_data;
+    } else {
+        save_data->write_header = write_header_v1;
+        save_data->write_footer = write_footer_v1;
+        save_data->write_terminal = write_terminal_v1;
+        save_data->write_nonterminal = write_nonterminal_v1;
+    }
+
+    rc = save_bdd(save_data, cache, node);
+    if (flags & IPSET_SAVE_COMPACT) {
+        cork_buffer_done(&v3_data.body);
+    }
+    save_output_done(&save_data->out);
+    return rc;
+}
+
+int
+ipset_node_cache_save(struct cork_stream_consumer *stream,
+                      struct ipset_node_cache *cache, ipset_node_id node)
+{
+    return ipset_node_cache_save_with_flags(stream, cache, node, 0);
+}
+
 int
-ipset_node_cache_save(struct cork_stream_consumer *stream, struct ipset_node_cache *cache,
-                      ipset_node_id node)
+ipset_node_cache_save_fd(int fd, struct ipset_node_cache *cache,
+                         ipset_node_id node)
+{
+    return ipset_node_cache_save_fd_with_flags(fd, cache, node, 0);
+}
+
+int
+ipset_node_cache_save_with_flags(struct cork_stream_consumer *stream,
+                                 struct ipset_node_cache *cache,
+                                 ipset_node_id node, unsigned int flags)
 {
     struct save_data  save_data;
-    save_data.cache = cache;
-    save_data.stream = stream;
-    save_data.write_header = write_header_v1;
-    save_data.write_footer = write_footer_v1;
-    save_data.write_terminal = write_terminal_v1;
-    save_data.write_nonterminal = write_nonterminal_v1;
-    return save_bdd(&save_data, cache, node);
+    save_output_init_stream(&save_data.out, stream);
+    return save_nodes(&save_data, cache, node, flags);
+}
+
+int
+ipset_node_cache_save_fd_with_flags(int fd, struct ipset_node_cache *cache,
+                                    ipset_node_id node, unsigned int flags)
+{
+    struct save_data  save_data;
+    save_output_init_fd(&save_data.out, fd);
+    return save_nodes(&save_data, cache, node, flags);
+}
+
+
+/*-----------------------------------------------------------------------
+ * V2 BDD file
+ */
+
+/**
+ * Write a little-endian uint32 to the output.  If we can't write the
+ * integer for some reason, return an error.
+ */
+
+static int
+write_le_uint32(struct save_output *out, uint32_t val)
+{
+    CORK_UINT32_HOST_TO_LITTLE_IN_PLACE(val);
+    return write_data(out, &val, sizeof(uint32_t));
+}
+
+
+/**
+ * Write a little-endian uint64 to the output.  If we can't write the
+ * integer for some reason, return an error.
+ */
+
+static int
+write_le_uint64(struct save_output *out, uint64_t val)
+{
+    CORK_UINT64_HOST_TO_LITTLE_IN_PLACE(val);
+    return write_data(out, &val, sizeof(uint64_t));
+}
+
+
+static int
+save_frozen(struct save_output *out, const struct ipset_frozen *frozen)
+{
+    size_t  nodes_size = frozen->node_count * sizeof(struct ipset_node);
+
+    /* The header has the same magic number and version field as a v1
+     * file, so that readers can tell them apart.  The rest of the file
+     * is little-endian, and padded so that the nodes are aligned. */
+    rii_check(write_string(out, MAGIC_NUMBER));
+    rii_check(write_uint16(out, 0x0002));
+    rii_check(write_le_uint32(out, sizeof(struct ipset_node)));
+    rii_check(write_le_uint32(out, frozen->root));
+    rii_check(write_le_uint64(out, frozen->node_count));
+    rii_check(write_le_uint64(out, IPSET_V2_HEADER_SIZE + nodes_size));
+
+    /* The nodes are already in the layout that the file uses, as long
+     * as this is a little-endian machine, so we can write them out
+     * (along with the buffered header) without copying them. */
+    if (CORK_UINT32_HOST_TO_LITTLE(1) == 1) {
+        rii_check(save_output_send(out, frozen->nodes, nodes_size));
+    } else {
+        const uint32_t  *words = (const uint32_t *) frozen->nodes;
+        size_t  i;
+        for (i = 0; i < nodes_size / sizeof(uint32_t); i++) {
+            rii_check(write_le_uint32(out, words[i]));
+        }
+    }
+
+    return save_output_flush(out);
+}
+
+
+int
+ipset_frozen_save(struct cork_stream_consumer *stream,
+                  const struct ipset_frozen *frozen)
+{
+    struct save_output  out;
+    int  rc;
+    save_output_init_stream(&out, stream);
+    rc = save_frozen(&out, frozen);
+    save_output_done(&out);
+    return rc;
+}
+
+
+int
+ipset_frozen_save_fd(int fd, const struct ipset_frozen *frozen)
+{
+    struct save_output  out;
+    int  rc;
+    save_output_init_fd(&out, fd);
+    rc = save_frozen(&out, frozen);
+    save_output_done(&out);
+    return rc;
 }
 
 
@@ -415,8 +948,7 @@ write_header_dot(struct save_data *save_data,
                  struct ipset_node_cache *cache, ipset_node_id root)
 {
     /* Output the opening clause of the GraphViz script. */
-    rii_check(cork_stream_consumer_data(save_data->stream, NULL, 0, true));
-    return write_string(save_data->stream, GRAPHVIZ_HEADER);
+    return write_string(&save_data->out, GRAPHVIZ_HEADER);
 }
 
 
@@ -425,7 +957,7 @@ write_footer_dot(struct save_data *save_data,
                  struct ipset_node_cache *cache, ipset_node_id root)
 {
     /* Output the closing clause of the GraphViz script. */
-    return write_string(save_data->stream, GRAPHVIZ_FOOTER);
+    return write_string(&save_data->out, GRAPHVIZ_FOOTER);
 }
 
 
@@ -444,7 +976,7 @@ write_terminal_dot(struct save_data *save_data, ipset_value terminal_value)
         (&dot_data->scratch,
          "    t%d [shape=box, label=%d];\n",
          terminal_value, terminal_value);
-    return write_string(save_data->stream, dot_data->scratch.buf);
+    return write_string(&save_data->out, dot_data->scratch.buf);
 }
 
 
@@ -531,7 +1063,7 @@ write_nonterminal_dot(struct save_data *save_data,
         (&dot_data->scratch, " [style=solid,color=black]\n");
 
     /* Output the clauses to the stream. */
-    return write_string(save_data->stream, dot_data->scratch.buf);
+    return write_string(&save_data->out, dot_data->scratch.buf);
 }
 
 
@@ -544,12 +1076,15 @@ ipset_node_cache_save_dot(struct cork_stream_consumer *stream,
     };
 
     struct save_data  save_data;
+    int  rc;
     save_data.cache = cache;
-    save_data.stream = stream;
+    save_output_init_stream(&save_data.out, stream);
     save_data.write_header = write_header_dot;
     save_data.write_footer = write_footer_dot;
     save_data.write_terminal = write_terminal_dot;
     save_data.write_nonterminal = write_nonterminal_dot;
     save_data.user_data = &dot_data;
-    return save_bdd(&save_data, cache, node);
+    rc = save_bdd(&save_data, cache, node);
+    save_output_done(&save_data.out);
+    return rc;
 }
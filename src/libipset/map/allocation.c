@@ -8,36 +8,98 @@
  */
 
 #include <libcork/core.h>
+#include <libcork/helpers/errors.h>
 
 #include "ipset/bdd/nodes.h"
+#include "ipset/errors.h"
 #include "ipset/ipset.h"
 
 
-void
-ipmap_init(struct ip_map *map, int default_value)
+/* A map's terminals aren't just true and false, so the map evaluators
+ * don't know how to follow complemented edges. */
+static int
+ipmap_check_cache(struct ipset_node_cache *cache)
+{
+    if (cache->flags & IPSET_NODE_CACHE_COMPLEMENT_EDGES) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_CACHE_ERROR,
+             "Maps can't use a node cache with complement edges");
+        return -1;
+    }
+    return 0;
+}
+
+static int
+ipmap_check_value(int value)
+{
+    if (!ipset_terminal_value_fits(value)) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_PARSE_ERROR,
+             "Map value %d out of range [0..%u]",
+             value, IPSET_MAX_TERMINAL_VALUE);
+        return -1;
+    }
+    return 0;
+}
+
+
+int
+ipmap_init_in_cache(struct ip_map *map, struct ipset_node_cache *cache,
+                    int default_value)
 {
+    rii_check(ipmap_check_cache(cache));
+    rii_check(ipmap_check_value(default_value));
+
     /* The map starts empty, so every value assignment should yield the
      * default. */
-    map->cache = ipset_node_cache_new();
+    map->cache = cache;
     map->default_bdd = ipset_terminal_node_id(default_value);
     map->map_bdd = map->default_bdd;
+    map->owns_cache = false;
+    return 0;
+}
+
+
+int
+ipmap_init(struct ip_map *map, int default_value)
+{
+    rii_check(ipmap_check_value(default_value));
+    ipmap_init_in_cache(map, ipset_node_cache_new(), default_value);
+    map->owns_cache = true;
+    return 0;
 }
 
 
 struct ip_map *
 ipmap_new(int default_value)
 {
-    struct ip_map  *result = cork_new(struct ip_map);
+    struct ip_map  *result;
+    rpi_check(ipmap_check_value(default_value));
+    result = cork_new(struct ip_map);
     ipmap_init(result, default_value);
     return result;
 }
 
 
+struct ip_map *
+ipmap_new_in_cache(struct ipset_node_cache *cache, int default_value)
+{
+    struct ip_map  *result;
+    rpi_check(ipmap_check_cache(cache));
+    rpi_check(ipmap_check_value(default_value));
+    result = cork_new(struct ip_map);
+    ipmap_init_in_cache(result, cache, default_value);
+    return result;
+}
+
+
 void
 ipmap_done(struct ip_map *map)
 {
     ipset_node_decref(map->cache, map->map_bdd);
-    ipset_node_cache_free(map->cache);
+    if (map->owns_cache) {
+        ipset_node_cache_free(map->cache);
+    }
 }
 
 
@@ -47,3 +109,22 @@ ipmap_free(struct ip_map *map)
     ipmap_done(map);
     free(map);
 }
+
+
+int
+ipmap_compact(struct ip_map *map)
+{
+    ipset_node_id  *roots[] = { &map->map_bdd };
+
+    /* Compacting renumbers every node in the cache, and we only know
+     * about this map's root. */
+    if (!map->owns_cache) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_CACHE_ERROR,
+             "Can't compact a map in a shared node cache");
+        return -1;
+    }
+
+    ipset_node_cache_compact(map->cache, roots, 1);
+    return 0;
+}
@@ -33,6 +33,34 @@ ipmap_memory_size(const struct ip_map *map)
     return ipset_node_memory_size(map->cache, map->map_bdd);
 }
 
+void
+ipmap_count_value(const struct ip_map *map, int value,
+                  uint64_t *ipv4_count, struct ipset_uint128 *ipv6_count)
+{
+    *ipv4_count = ipset_node_count_value
+        (map->cache, map->map_bdd, value, true, 32).low;
+    *ipv6_count = ipset_node_count_value
+        (map->cache, map->map_bdd, value, false, 128);
+}
+
+struct ipset_frozen *
+ipmap_freeze(const struct ip_map *map)
+{
+    return ipset_node_freeze(map->cache, map->map_bdd);
+}
+
+struct ipset_stride_table *
+ipmap_compile_strides(const struct ip_map *map)
+{
+    return ipset_node_compile_strides(map->cache, map->map_bdd);
+}
+
+void
+ipmap_publish(struct ipset_publisher *publisher, const struct ip_map *map)
+{
+    ipset_publisher_publish(publisher, ipmap_freeze(map));
+}
+
 
 void
 ipmap_ip_set(struct ip_map *map, struct cork_ip *addr, int value)
@@ -66,3 +94,26 @@ ipmap_ip_get(struct ip_map *map, struct cork_ip *addr)
         return ipmap_ipv6_get(map, &addr->ip.v6);
     }
 }
+
+
+int
+ipmap_frozen_get_ip(const struct ipset_frozen *frozen, struct cork_ip *addr)
+{
+    if (addr->version == 4) {
+        return ipmap_frozen_get_ipv4(frozen, &addr->ip.v4);
+    } else {
+        return ipmap_frozen_get_ipv6(frozen, &addr->ip.v6);
+    }
+}
+
+
+int
+ipmap_stride_get_ip(const struct ipset_stride_table *table,
+                    struct cork_ip *addr)
+{
+    if (addr->version == 4) {
+        return ipmap_stride_get_ipv4(table, &addr->ip.v4);
+    } else {
+        return ipmap_stride_get_ipv6(table, &addr->ip.v6);
+    }
+}
@@ -19,6 +19,9 @@
 /* The name of the cork_ipvX type. */
 #define CORK_IP  struct cork_ipv6
 
+/* The name of the ipset_ipvX_network type. */
+#define IPSET_NETWORK  struct ipset_ipv6_network
+
 /* The number of bits in an IPvX address. */
 #define IP_BIT_SIZE  128
 
@@ -31,6 +34,9 @@
 /* Creates a identifier of the form “ipmap_ipv6_<basename>”. */
 #define IPMAP_NAME(basename) ipmap_ipv6_##basename
 
+/* Creates a identifier of the form “ipmap_<basename>_ipv6”. */
+#define IPMAP_PRENAME(basename) ipmap_##basename##_ipv6
+
 
 /* Now include all of the templates. */
 #include "inspection-template.c.in"
@@ -0,0 +1,105 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <libcork/core.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/ipset.h"
+
+
+/*-----------------------------------------------------------------------
+ * Map operators
+ */
+
+/* A map "contains" an address if it maps that address to something
+ * other than its default value.  Each operator needs to know both
+ * maps' default values to decide that. */
+struct ipmap_defaults {
+    ipset_value  lhs;
+    ipset_value  rhs;
+};
+
+static ipset_value
+ipmap_union_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    const struct ipmap_defaults  *defaults = user_data;
+    return (rhs != defaults->rhs)? rhs: lhs;
+}
+
+static ipset_value
+ipmap_intersection_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    const struct ipmap_defaults  *defaults = user_data;
+    return (rhs != defaults->rhs)? lhs: defaults->lhs;
+}
+
+static ipset_value
+ipmap_difference_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    const struct ipmap_defaults  *defaults = user_data;
+    return (rhs != defaults->rhs)? defaults->lhs: lhs;
+}
+
+static ipset_value
+ipmap_symmetric_difference_op(const void *user_data,
+                              ipset_value lhs, ipset_value rhs)
+{
+    const struct ipmap_defaults  *defaults = user_data;
+    if (lhs == defaults->lhs) {
+        return (rhs != defaults->rhs)? rhs: defaults->lhs;
+    } else {
+        return (rhs != defaults->rhs)? defaults->lhs: lhs;
+    }
+}
+
+
+/**
+ * Replace the contents of map with the result of combining it with
+ * other.
+ */
+static void
+ipmap_apply_in_place(struct ip_map *map, const struct ip_map *other,
+                     ipset_binary_operator op)
+{
+    struct ipmap_defaults  defaults = {
+        ipset_terminal_value(map->default_bdd),
+        ipset_terminal_value(other->default_bdd)
+    };
+    ipset_node_id  new_bdd =
+        ipset_node_apply
+        (map->cache, map->map_bdd, other->cache, other->map_bdd,
+         op, &defaults);
+    ipset_node_decref(map->cache, map->map_bdd);
+    map->map_bdd = new_bdd;
+}
+
+
+void
+ipmap_union(struct ip_map *map, const struct ip_map *other)
+{
+    ipmap_apply_in_place(map, other, ipmap_union_op);
+}
+
+void
+ipmap_intersection(struct ip_map *map, const struct ip_map *other)
+{
+    ipmap_apply_in_place(map, other, ipmap_intersection_op);
+}
+
+void
+ipmap_difference(struct ip_map *map, const struct ip_map *other)
+{
+    ipmap_apply_in_place(map, other, ipmap_difference_op);
+}
+
+void
+ipmap_symmetric_difference(struct ip_map *map, const struct ip_map *other)
+{
+    ipmap_apply_in_place(map, other, ipmap_symmetric_difference_op);
+}
@@ -78,18 +78,71 @@ ipmap_save(FILE *fp, const struct ip_map *map)
     return ipmap_save_to_stream(&stream.parent, map);
 }
 
+int
+ipmap_save_fd(int fd, const struct ip_map *map)
+{
+    return ipset_node_cache_save_fd(fd, map->cache, map->map_bdd);
+}
 
-struct ip_map *
-ipmap_load(FILE *stream)
+int
+ipmap_save_to_stream_with_flags(struct cork_stream_consumer *stream,
+                                const struct ip_map *map,
+                                unsigned int flags)
+{
+    return ipset_node_cache_save_with_flags
+        (stream, map->cache, map->map_bdd, flags);
+}
+
+int
+ipmap_save_with_flags(FILE *fp, const struct ip_map *map,
+                      unsigned int flags)
+{
+    struct file_consumer  stream = {
+        { file_consumer_data, file_consumer_eof, NULL }, fp
+    };
+    return ipmap_save_to_stream_with_flags(&stream.parent, map, flags);
+}
+
+int
+ipmap_save_fd_with_flags(int fd, const struct ip_map *map,
+                         unsigned int flags)
 {
-    struct ip_map  *map;
-    ipset_node_id  new_bdd;
+    return ipset_node_cache_save_fd_with_flags
+        (fd, map->cache, map->map_bdd, flags);
+}
 
-    /* It doesn't matter what default value we use here, because we're
-     * going to replace it with the default BDD we load in from the
-     * file. */
-    map = ipmap_new(0);
-    new_bdd = ipset_node_cache_load(stream, map->cache);
+int
+ipmap_save_v2_to_stream(struct cork_stream_consumer *stream,
+                        const struct ip_map *map)
+{
+    struct ipset_frozen  *frozen = ipmap_freeze(map);
+    int  rc = ipset_frozen_save(stream, frozen);
+    ipset_frozen_free(frozen);
+    return rc;
+}
+
+int
+ipmap_save_v2(FILE *fp, const struct ip_map *map)
+{
+    struct file_consumer  stream = {
+        { file_consumer_data, file_consumer_eof, NULL }, fp
+    };
+    return ipmap_save_v2_to_stream(&stream.parent, map);
+}
+
+int
+ipmap_save_v2_fd(int fd, const struct ip_map *map)
+{
+    struct ipset_frozen  *frozen = ipmap_freeze(map);
+    int  rc = ipset_frozen_save_fd(fd, frozen);
+    ipset_frozen_free(frozen);
+    return rc;
+}
+
+
+static struct ip_map *
+ipmap_load_map(struct ip_map *map, ipset_node_id new_bdd)
+{
     if (cork_error_occurred()) {
         ipmap_free(map);
         return NULL;
@@ -98,3 +151,32 @@ ipmap_load(FILE *stream)
     map->map_bdd = new_bdd;
     return map;
 }
+
+/* For all of these, it doesn't matter what default value we use,
+ * because we're going to replace it with the default BDD we load in
+ * from the file. */
+
+struct ip_map *
+ipmap_load(FILE *stream)
+{
+    struct ip_map  *map = ipmap_new(0);
+    return ipmap_load_map(map, ipset_node_cache_load(stream, map->cache));
+}
+
+struct ip_map *
+ipmap_load_into(struct ipset_node_cache *cache, FILE *stream)
+{
+    struct ip_map  *map = ipmap_new_in_cache(cache, 0);
+    if (map == NULL) {
+        return NULL;
+    }
+    return ipmap_load_map(map, ipset_node_cache_load(stream, cache));
+}
+
+struct ip_map *
+ipmap_load_from_buffer(const void *buf, size_t size)
+{
+    struct ip_map  *map = ipmap_new(0);
+    return ipmap_load_map
+        (map, ipset_node_cache_load_from_buffer(buf, size, map->cache));
+}
@@ -10,16 +10,30 @@
 #include <libcork/core.h>
 
 #include "ipset/bdd/nodes.h"
+#include "ipset/errors.h"
 #include "ipset/ipset.h"
 
 
 void
-ipset_init(struct ip_set *set)
+ipset_init_in_cache(struct ip_set *set, struct ipset_node_cache *cache)
 {
     /* The set starts empty, so every value assignment should yield
      * false. */
-    set->cache = ipset_node_cache_new();
+    set->cache = cache;
     set->set_bdd = ipset_terminal_node_id(false);
+    set->owns_cache = false;
+}
+
+
+void
+ipset_init(struct ip_set *set)
+{
+    /* A set's BDD only ever has 0 and 1 terminals, so its private
+     * cache can use complement edges. */
+    ipset_init_in_cache
+        (set, ipset_node_cache_new_sized
+         (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_COMPLEMENT_EDGES));
+    set->owns_cache = true;
 }
 
 
@@ -32,11 +46,22 @@ ipset_new(void)
 }
 
 
+struct ip_set *
+ipset_new_in_cache(struct ipset_node_cache *cache)
+{
+    struct ip_set  *result = cork_new(struct ip_set);
+    ipset_init_in_cache(result, cache);
+    return result;
+}
+
+
 void
 ipset_done(struct ip_set *set)
 {
     ipset_node_decref(set->cache, set->set_bdd);
-    ipset_node_cache_free(set->cache);
+    if (set->owns_cache) {
+        ipset_node_cache_free(set->cache);
+    }
 }
 
 
@@ -46,3 +71,22 @@ ipset_free(struct ip_set *set)
     ipset_done(set);
     free(set);
 }
+
+
+int
+ipset_compact(struct ip_set *set)
+{
+    ipset_node_id  *roots[] = { &set->set_bdd };
+
+    /* Compacting renumbers every node in the cache, and we only know
+     * about this set's root. */
+    if (!set->owns_cache) {
+        cork_error_set
+            (IPSET_ERROR, IPSET_CACHE_ERROR,
+             "Can't compact a set in a shared node cache");
+        return -1;
+    }
+
+    ipset_node_cache_compact(set->cache, roots, 1);
+    return 0;
+}
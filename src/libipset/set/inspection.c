@@ -32,6 +32,40 @@ ipset_memory_size(const struct ip_set *set)
     return ipset_node_memory_size(set->cache, set->set_bdd);
 }
 
+uint64_t
+ipset_ipv4_count(const struct ip_set *set)
+{
+    /* There are only 2^32 IPv4 addresses, so the count always fits into
+     * the low half. */
+    return ipset_node_count_value
+        (set->cache, set->set_bdd, true, true, 32).low;
+}
+
+struct ipset_uint128
+ipset_ipv6_count(const struct ip_set *set)
+{
+    return ipset_node_count_value
+        (set->cache, set->set_bdd, true, false, 128);
+}
+
+struct ipset_frozen *
+ipset_freeze(const struct ip_set *set)
+{
+    return ipset_node_freeze(set->cache, set->set_bdd);
+}
+
+struct ipset_stride_table *
+ipset_compile_strides(const struct ip_set *set)
+{
+    return ipset_node_compile_strides(set->cache, set->set_bdd);
+}
+
+void
+ipset_publish(struct ipset_publisher *publisher, const struct ip_set *set)
+{
+    ipset_publisher_publish(publisher, ipset_freeze(set));
+}
+
 
 bool
 ipset_ip_add(struct ip_set *set, struct cork_ip *addr)
@@ -88,3 +122,43 @@ ipset_contains_ip(const struct ip_set *set, struct cork_ip *addr)
         return ipset_contains_ipv6(set, &addr->ip.v6);
     }
 }
+
+
+struct ipset_uint128
+ipset_count_in_network(const struct ip_set *set, struct cork_ip *addr,
+                       unsigned int cidr_prefix)
+{
+    if (addr->version == 4) {
+        struct ipset_uint128  count;
+        count.high = 0;
+        count.low = ipset_ipv4_count_in_network
+            (set, &addr->ip.v4, cidr_prefix);
+        return count;
+    } else {
+        return ipset_ipv6_count_in_network(set, &addr->ip.v6, cidr_prefix);
+    }
+}
+
+
+bool
+ipset_frozen_contains_ip(const struct ipset_frozen *frozen,
+                         struct cork_ip *addr)
+{
+    if (addr->version == 4) {
+        return ipset_frozen_contains_ipv4(frozen, &addr->ip.v4);
+    } else {
+        return ipset_frozen_contains_ipv6(frozen, &addr->ip.v6);
+    }
+}
+
+
+bool
+ipset_stride_contains_ip(const struct ipset_stride_table *table,
+                         struct cork_ip *addr)
+{
+    if (addr->version == 4) {
+        return ipset_stride_contains_ipv4(table, &addr->ip.v4);
+    } else {
+        return ipset_stride_contains_ipv6(table, &addr->ip.v6);
+    }
+}
@@ -19,9 +19,20 @@
 /* The name of the cork_ipvX type. */
 #define CORK_IP  struct cork_ipv4
 
+/* The name of the ipset_ipvX_network type. */
+#define IPSET_NETWORK  struct ipset_ipv4_network
+
+/* The type of each address in a batch lookup. */
+#define IP_BATCH_ELEMENT  uint32_t
+
 /* The number of bits in an IPvX address. */
 #define IP_BIT_SIZE  32
 
+/* The type used to count IPvX addresses, and how to get one from a
+ * 128-bit count. */
+#define IP_COUNT  uint64_t
+#define IP_COUNT_FROM_UINT128(count)  ((count).low)
+
 /* The value of the discriminator variable for an IPvX address. */
 #define IP_DISCRIMINATOR_VALUE  true
 
@@ -31,6 +42,141 @@
 /* Creates a identifier of the form “ipset_<basename>_ipv4”. */
 #define IPSET_PRENAME(basename) ipset_##basename##_ipv4
 
+/* On x86, frozen batch lookups can use AVX2 gathers to step eight
+ * addresses down the BDD at once, if the CPU supports them. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPSET_FROZEN_BATCH_ACCEL  ipset_ipv4_frozen_contains_avx2
+#endif
+
 
 /* Now include all of the templates. */
 #include "inspection-template.c.in"
+
+
+#if defined(IPSET_FROZEN_BATCH_ACCEL)
+#include <immintrin.h>
+
+/**
+ * Look up eight IPv4 addresses at once.  Each lane holds one lookup's
+ * current node; on each step, we gather the nodes of the lanes that
+ * haven't reached a terminal yet, and pick each one's low or high
+ * child.
+ */
+
+__attribute__((target("avx2")))
+static void
+ipset_ipv4_frozen_contains_avx2_group(const struct ipset_frozen *frozen,
+                                      const uint32_t *addrs, uint8_t *out)
+{
+    const int  *base = (const int *) frozen->nodes;
+    const __m256i  zero = _mm256_setzero_si256();
+    const __m256i  one = _mm256_set1_epi32(1);
+    const __m256i  complement = _mm256_set1_epi32(IPSET_COMPLEMENT_BIT);
+    /* Converts each address from network to host byte order, so that
+     * variable v (for v in 1..32) is bit 32-v. */
+    const __m256i  bswap = _mm256_setr_epi8
+        (3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+         3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    __m256i  addr = _mm256_shuffle_epi8
+        (_mm256_loadu_si256((const __m256i *) addrs), bswap);
+    __m256i  curr = _mm256_set1_epi32(frozen->root);
+    uint32_t  result[8];
+    unsigned int  i;
+
+    for (;;) {
+        __m256i  active =
+            _mm256_cmpeq_epi32(_mm256_and_si256(curr, one), zero);
+        __m256i  index;
+        __m256i  variable;
+        __m256i  low;
+        __m256i  high;
+        __m256i  bit;
+        __m256i  next;
+
+        if (_mm256_movemask_epi8(active) == 0) {
+            break;
+        }
+
+        index = _mm256_srli_epi32(curr, 2);
+#if IPSET_COMPACT_NODES
+        index = _mm256_slli_epi32(index, 1);
+        low = _mm256_mask_i32gather_epi32(zero, base, index, active, 4);
+        high = _mm256_mask_i32gather_epi32
+            (zero, base, _mm256_add_epi32(index, one), active, 4);
+        variable = _mm256_or_si256
+            (_mm256_slli_epi32(_mm256_srli_epi32(low, IPSET_NODE_ID_BITS), 4),
+             _mm256_srli_epi32(high, IPSET_NODE_ID_BITS));
+        low = _mm256_and_si256(low, _mm256_set1_epi32(IPSET_NODE_ID_MASK));
+        high = _mm256_and_si256(high, _mm256_set1_epi32(IPSET_NODE_ID_MASK));
+#else
+        index = _mm256_add_epi32(index, _mm256_slli_epi32(index, 1));
+        variable = _mm256_mask_i32gather_epi32
+            (zero, base, index, active, 4);
+        index = _mm256_add_epi32(index, one);
+        low = _mm256_mask_i32gather_epi32(zero, base, index, active, 4);
+        index = _mm256_add_epi32(index, one);
+        high = _mm256_mask_i32gather_epi32(zero, base, index, active, 4);
+#endif
+
+        /* Variable 0 is the discriminator, which is always true for
+         * IPv4.  (A shift by 32 gives 0, so we OR it in separately.) */
+        bit = _mm256_and_si256
+            (_mm256_srlv_epi32
+             (addr, _mm256_sub_epi32(_mm256_set1_epi32(32), variable)),
+             one);
+        bit = _mm256_or_si256
+            (bit, _mm256_and_si256(_mm256_cmpeq_epi32(variable, zero), one));
+        bit = _mm256_cmpeq_epi32(bit, one);
+
+        /* A complemented edge negates the child that we follow. */
+        next = _mm256_xor_si256
+            (_mm256_blendv_epi8(low, high, bit),
+             _mm256_and_si256(curr, complement));
+        curr = _mm256_blendv_epi8(curr, next, active);
+    }
+
+    _mm256_storeu_si256((__m256i *) result, curr);
+    for (i = 0; i < 8; i++) {
+        out[i] = ipset_terminal_value(result[i]);
+    }
+}
+
+
+static bool
+ipset_ipv4_frozen_contains_avx2(const struct ipset_frozen *frozen,
+                                const uint32_t *addrs, size_t count,
+                                uint8_t *out)
+{
+    /* Many reader threads can get here at once.  They'll all compute
+     * the same answer, so it doesn't matter which store wins, but the
+     * accesses have to be atomic. */
+    static int  supported = -1;
+    int  avx2;
+    uint32_t  tail_addrs[8];
+    uint8_t  tail_out[8];
+    size_t  i;
+
+    avx2 = __atomic_load_n(&supported, __ATOMIC_RELAXED);
+    if (CORK_UNLIKELY(avx2 < 0)) {
+        __builtin_cpu_init();
+        avx2 = __builtin_cpu_supports("avx2");
+        __atomic_store_n(&supported, avx2, __ATOMIC_RELAXED);
+    }
+    if (!avx2) {
+        return false;
+    }
+
+    for (i = 0; i + 8 <= count; i += 8) {
+        ipset_ipv4_frozen_contains_avx2_group(frozen, addrs + i, out + i);
+    }
+
+    if (i < count) {
+        memset(tail_addrs, 0, sizeof(tail_addrs));
+        memcpy(tail_addrs, addrs + i, (count - i) * sizeof(uint32_t));
+        ipset_ipv4_frozen_contains_avx2_group(frozen, tail_addrs, tail_out);
+        memcpy(out + i, tail_out, count - i);
+    }
+    return true;
+}
+
+#endif
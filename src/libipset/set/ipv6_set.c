@@ -20,9 +20,20 @@
 /* The name of the cork_ipvX type. */
 #define CORK_IP  struct cork_ipv6
 
+/* The name of the ipset_ipvX_network type. */
+#define IPSET_NETWORK  struct ipset_ipv6_network
+
+/* The type of each address in a batch lookup. */
+#define IP_BATCH_ELEMENT  struct cork_ipv6
+
 /* The number of bits in an IPvX address. */
 #define IP_BIT_SIZE  128
 
+/* The type used to count IPvX addresses, and how to get one from a
+ * 128-bit count. */
+#define IP_COUNT  struct ipset_uint128
+#define IP_COUNT_FROM_UINT128(count)  (count)
+
 /* The value of the discriminator variable for an IPvX address. */
 #define IP_DISCRIMINATOR_VALUE  false
 
@@ -0,0 +1,99 @@
+/* -*- coding: utf-8 -*-
+ * ----------------------------------------------------------------------
+ * Copyright © 2026, libcorkipset authors
+ * All rights reserved.
+ *
+ * Please see the COPYING file in this distribution for license details.
+ * ----------------------------------------------------------------------
+ */
+
+#include <libcork/core.h>
+
+#include "ipset/bdd/nodes.h"
+#include "ipset/ipset.h"
+
+
+/*-----------------------------------------------------------------------
+ * Set operators
+ */
+
+static ipset_value
+ipset_union_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    return lhs || rhs;
+}
+
+static ipset_value
+ipset_intersection_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    return lhs && rhs;
+}
+
+static ipset_value
+ipset_difference_op(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    return lhs && !rhs;
+}
+
+static ipset_value
+ipset_symmetric_difference_op(const void *user_data,
+                              ipset_value lhs, ipset_value rhs)
+{
+    return (lhs != 0) != (rhs != 0);
+}
+
+
+/**
+ * Replace the contents of set with the result of combining it with
+ * other.
+ */
+static void
+ipset_apply_in_place(struct ip_set *set, const struct ip_set *other,
+                     ipset_binary_operator op)
+{
+    ipset_node_id  new_bdd =
+        ipset_node_apply
+        (set->cache, set->set_bdd, other->cache, other->set_bdd, op, NULL);
+    ipset_node_decref(set->cache, set->set_bdd);
+    set->set_bdd = new_bdd;
+}
+
+
+void
+ipset_union(struct ip_set *set, const struct ip_set *other)
+{
+    ipset_apply_in_place(set, other, ipset_union_op);
+}
+
+void
+ipset_intersection(struct ip_set *set, const struct ip_set *other)
+{
+    ipset_apply_in_place(set, other, ipset_intersection_op);
+}
+
+void
+ipset_difference(struct ip_set *set, const struct ip_set *other)
+{
+    ipset_apply_in_place(set, other, ipset_difference_op);
+}
+
+void
+ipset_symmetric_difference(struct ip_set *set, const struct ip_set *other)
+{
+    ipset_apply_in_place(set, other, ipset_symmetric_difference_op);
+}
+
+void
+ipset_invert(struct ip_set *set)
+{
+    /* With complement edges, negating a BDD just flips the complement
+     * bit of its root. */
+    if (set->cache->flags & IPSET_NODE_CACHE_COMPLEMENT_EDGES) {
+        set->set_bdd = ipset_node_complement(set->set_bdd);
+    } else {
+        struct ip_set  all;
+        ipset_init_in_cache(&all, set->cache);
+        all.set_bdd = ipset_terminal_node_id(true);
+        ipset_apply_in_place(set, &all, ipset_symmetric_difference_op);
+    }
+}
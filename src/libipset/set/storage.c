@@ -77,6 +77,68 @@ ipset_save(FILE *fp, const struct ip_set *set)
     return ipset_save_to_stream(&stream.parent, set);
 }
 
+int
+ipset_save_fd(int fd, const struct ip_set *set)
+{
+    return ipset_node_cache_save_fd(fd, set->cache, set->set_bdd);
+}
+
+int
+ipset_save_to_stream_with_flags(struct cork_stream_consumer *stream,
+                                const struct ip_set *set,
+                                unsigned int flags)
+{
+    return ipset_node_cache_save_with_flags
+        (stream, set->cache, set->set_bdd, flags);
+}
+
+int
+ipset_save_with_flags(FILE *fp, const struct ip_set *set,
+                      unsigned int flags)
+{
+    struct file_consumer  stream = {
+        { file_consumer_data, file_consumer_eof, NULL }, fp
+    };
+    return ipset_save_to_stream_with_flags(&stream.parent, set, flags);
+}
+
+int
+ipset_save_fd_with_flags(int fd, const struct ip_set *set,
+                         unsigned int flags)
+{
+    return ipset_node_cache_save_fd_with_flags
+        (fd, set->cache, set->set_bdd, flags);
+}
+
+
+int
+ipset_save_v2_to_stream(struct cork_stream_consumer *stream,
+                        const struct ip_set *set)
+{
+    struct ipset_frozen  *frozen = ipset_freeze(set);
+    int  rc = ipset_frozen_save(stream, frozen);
+    ipset_frozen_free(frozen);
+    return rc;
+}
+
+int
+ipset_save_v2(FILE *fp, const struct ip_set *set)
+{
+    struct file_consumer  stream = {
+        { file_consumer_data, file_consumer_eof, NULL }, fp
+    };
+    return ipset_save_v2_to_stream(&stream.parent, set);
+}
+
+int
+ipset_save_v2_fd(int fd, const struct ip_set *set)
+{
+    struct ipset_frozen  *frozen = ipset_freeze(set);
+    int  rc = ipset_frozen_save_fd(fd, frozen);
+    ipset_frozen_free(frozen);
+    return rc;
+}
+
 
 int
 ipset_save_dot(FILE *fp, const struct ip_set *set)
@@ -88,14 +150,9 @@ ipset_save_dot(FILE *fp, const struct ip_set *set)
 }
 
 
-struct ip_set *
-ipset_load(FILE *stream)
+static struct ip_set *
+ipset_load_set(struct ip_set *set, ipset_node_id new_bdd)
 {
-    struct ip_set  *set;
-    ipset_node_id  new_bdd;
-
-    set = ipset_new();
-    new_bdd = ipset_node_cache_load(stream, set->cache);
     if (cork_error_occurred()) {
         ipset_free(set);
         return NULL;
@@ -104,3 +161,25 @@ ipset_load(FILE *stream)
     set->set_bdd = new_bdd;
     return set;
 }
+
+struct ip_set *
+ipset_load(FILE *stream)
+{
+    struct ip_set  *set = ipset_new();
+    return ipset_load_set(set, ipset_node_cache_load(stream, set->cache));
+}
+
+struct ip_set *
+ipset_load_into(struct ipset_node_cache *cache, FILE *stream)
+{
+    struct ip_set  *set = ipset_new_in_cache(cache);
+    return ipset_load_set(set, ipset_node_cache_load(stream, cache));
+}
+
+struct ip_set *
+ipset_load_from_buffer(const void *buf, size_t size)
+{
+    struct ip_set  *set = ipset_new();
+    return ipset_load_set
+        (set, ipset_node_cache_load_from_buffer(buf, size, set->cache));
+}
@@ -203,11 +203,11 @@ START_TEST(test_bdd_nonterminal_1)
 
     struct ipset_node  *n = ipset_node_cache_get_nonterminal(cache, node);
 
-    fail_unless(n->variable == 0,
+    fail_unless(ipset_node_variable(n) == 0,
                 "Nonterminal has wrong variable");
-    fail_unless(n->low == n_false,
+    fail_unless(ipset_node_low(n) == n_false,
                 "Nonterminal has wrong low pointer");
-    fail_unless(n->high == n_true,
+    fail_unless(ipset_node_high(n) == n_true,
                 "Nonterminal has wrong high pointer");
 
     ipset_node_decref(cache, node);
@@ -363,6 +363,12 @@ END_TEST
  * Operators
  */
 
+static ipset_value
+apply_or(const void *user_data, ipset_value lhs, ipset_value rhs)
+{
+    return lhs || rhs;
+}
+
 START_TEST(test_bdd_insert_reduced_1)
 {
     DESCRIBE_TEST;
@@ -447,6 +453,54 @@ START_TEST(test_bdd_insert_evaluate_1)
 END_TEST
 
 
+START_TEST(test_bdd_apply_cache_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* Create a BDD representing
+     *   f(x) = (¬x[0] ∧ x[1] ∧ x[2]) ∨ (x[0] ∧ ¬x[1] ∧ x[2])
+     * in which the node for x[2] has two parents.
+     */
+    ipset_node_id  n_false = ipset_terminal_node_id(false);
+    ipset_node_id  n_true = ipset_terminal_node_id(true);
+    ipset_node_id  n2 =
+        ipset_node_cache_nonterminal(cache, 2, n_false, n_true);
+    ipset_node_id  n1a =
+        ipset_node_cache_nonterminal
+        (cache, 1, n_false, ipset_node_incref(cache, n2));
+    ipset_node_id  n1b =
+        ipset_node_cache_nonterminal(cache, 1, n2, n_false);
+    ipset_node_id  node =
+        ipset_node_cache_nonterminal(cache, 0, n1a, n1b);
+
+    /* f ∨ f == f, and the second visit to the shared node should come
+     * out of the operation cache. */
+    ipset_node_id  result =
+        ipset_node_apply(cache, node, cache, node, apply_or, NULL);
+    fail_unless(result == node,
+                "APPLY result isn't reduced");
+    fail_unless(cache->op_cache_hits == 1,
+                "Expected 1 operation cache hit, got %zu",
+                cache->op_cache_hits);
+    fail_unless(cache->op_cache_misses == 4,
+                "Expected 4 operation cache misses, got %zu",
+                cache->op_cache_misses);
+
+    /* A new APPLY shouldn't see any of the previous results. */
+    ipset_node_decref(cache, result);
+    result = ipset_node_apply(cache, node, cache, node, apply_or, NULL);
+    fail_unless(cache->op_cache_misses == 8,
+                "Expected 8 operation cache misses, got %zu",
+                cache->op_cache_misses);
+
+    ipset_node_decref(cache, result);
+    ipset_node_decref(cache, node);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Memory size
  */
@@ -480,7 +534,7 @@ START_TEST(test_bdd_size_1)
                 "BDD has wrong number of nodes");
 
     fail_unless(ipset_node_memory_size(cache, node) ==
-                3u * sizeof(struct ipset_node),
+                3u * (sizeof(struct ipset_node) + sizeof(unsigned int)),
                 "BDD takes up wrong amount of space");
 
     ipset_node_decref(cache, n_false);
@@ -609,6 +663,86 @@ START_TEST(test_bdd_save_2)
 END_TEST
 
 
+START_TEST(test_bdd_save_3)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* Create a BDD representing
+     *   f(x) = (x[0] ∧ x[1]) ∨ (¬x[0] ∧ x[2])
+     */
+    bool  elem1[] = { true, true };
+    bool  elem2[] = { false, true, true };
+    bool  elem3[] = { false, false, true };
+
+    ipset_node_id  n_false = ipset_terminal_node_id(false);
+    ipset_node_id  n1 =
+        ipset_node_insert
+        (cache, n_false, ipset_bool_array_assignment, elem1, 2, true);
+    ipset_node_id  n2 =
+        ipset_node_insert
+        (cache, n1, ipset_bool_array_assignment, elem2, 3, true);
+    ipset_node_id  node =
+        ipset_node_insert
+        (cache, n2, ipset_bool_array_assignment, elem3, 3, true);
+
+    /* Serialize the BDD into a string, using the compact format. */
+    struct cork_buffer  buf = CORK_BUFFER_INIT();
+    struct cork_stream_consumer  *stream =
+        cork_buffer_to_stream_consumer(&buf);
+
+    fail_unless(ipset_node_cache_save_with_flags
+                (stream, cache, node, IPSET_SAVE_COMPACT) == 0,
+                "Cannot serialize BDD");
+
+    const char  *raw_expected =
+        "IP set"                             // magic number
+        "\x00\x03"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x1a"   // length
+        "\x03"                               // node count
+        // node -1
+        "\x04"                               // variable (+2)
+        "\x01"                               // low (terminal 0)
+        "\x03"                               // high (terminal 1)
+        // node -2
+        "\x01"                               // variable (-1)
+        "\x01"                               // low (terminal 0)
+        "\x03"                               // high (terminal 1)
+        // node -3
+        "\x01"                               // variable (-1)
+        "\x04"                               // low (2 nodes back)
+        "\x02"                               // high (1 node back)
+        ;
+    const size_t  expected_length = 26;
+
+    fail_unless(expected_length == buf.size,
+                "Serialized BDD has wrong length "
+                "(expected %zu, got %zu)",
+                expected_length, buf.size);
+
+    fail_unless(memcmp(raw_expected, buf.buf, expected_length) == 0,
+                "Serialized BDD has incorrect data");
+
+    /* And we should be able to read it back in. */
+    ipset_node_id  read =
+        ipset_node_cache_load_from_buffer(buf.buf, buf.size, cache);
+    fail_if(cork_error_occurred(),
+            "Error reading compact BDD");
+    fail_unless(read == node,
+                "Compact BDD doesn't match expected");
+
+    cork_stream_consumer_free(stream);
+    cork_buffer_done(&buf);
+    ipset_node_decref(cache, n_false);
+    ipset_node_decref(cache, n1);
+    ipset_node_decref(cache, n2);
+    ipset_node_decref(cache, node);
+    ipset_node_decref(cache, read);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 START_TEST(test_bdd_load_1)
 {
     DESCRIBE_TEST;
@@ -721,6 +855,253 @@ START_TEST(test_bdd_load_2)
 END_TEST
 
 
+START_TEST(test_bdd_load_buffer_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* Create a BDD representing
+     *   f(x) = x[0]
+     */
+    ipset_node_id  n_false = ipset_terminal_node_id(false);
+    ipset_node_id  n_true = ipset_terminal_node_id(true);
+    ipset_node_id  node =
+        ipset_node_cache_nonterminal(cache, 0, n_false, n_true);
+
+    /* Read a BDD from a buffer. */
+    const char  *raw =
+        "IP set"                             // magic number
+        "\x00\x01"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x1d"   // length
+        "\x00\x00\x00\x01"                   // node count
+        // node -1
+        "\x00"                               // variable
+        "\x00\x00\x00\x00"                   // low
+        "\x00\x00\x00\x01"                   // high
+        "\x00"                               // extra byte
+        ;
+    const size_t  raw_length = 29;
+
+    ipset_node_id  read =
+        ipset_node_cache_load_from_buffer(raw, raw_length, cache);
+    fail_if(cork_error_occurred(),
+            "Error reading BDD from buffer");
+
+    fail_unless(read == node,
+                "BDD from buffer doesn't match expected");
+
+    /* The buffer has to hold exactly one BDD. */
+    ipset_node_cache_load_from_buffer(raw, raw_length - 1, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read truncated BDD");
+    cork_error_clear();
+
+    ipset_node_cache_load_from_buffer(raw, raw_length + 1, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with extra data");
+    cork_error_clear();
+
+    ipset_node_decref(cache, node);
+    ipset_node_decref(cache, read);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_load_buffer_2)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* A node can't refer to itself, or to a node after it. */
+    const char  *raw =
+        "IP set"                             // magic number
+        "\x00\x01"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x1d"   // length
+        "\x00\x00\x00\x01"                   // node count
+        // node -1
+        "\x00"                               // variable
+        "\x00\x00\x00\x00"                   // low
+        "\xff\xff\xff\xff"                   // high
+        ;
+    const size_t  raw_length = 29;
+
+    ipset_node_cache_load_from_buffer(raw, raw_length, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad reference");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_load_buffer_3)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* A compact BDD can't have a reference to a later node, a variable
+     * that goes out of range, or a truncated varint. */
+    const char  *bad_reference =
+        "IP set"                             // magic number
+        "\x00\x03"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x14"   // length
+        "\x01"                               // node count
+        // node -1
+        "\x00"                               // variable
+        "\x01"                               // low (terminal 0)
+        "\x02"                               // high (1 node back)
+        ;
+    const char  *bad_variable =
+        "IP set"                             // magic number
+        "\x00\x03"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x14"   // length
+        "\x01"                               // node count
+        // node -1
+        "\x01"                               // variable (-1)
+        "\x01"                               // low (terminal 0)
+        "\x03"                               // high (terminal 1)
+        ;
+    const char  *bad_varint =
+        "IP set"                             // magic number
+        "\x00\x03"                           // version
+        "\x00\x00\x00\x00\x00\x00\x00\x14"   // length
+        "\x01"                               // node count
+        // node -1
+        "\x00"                               // variable
+        "\x01"                               // low (terminal 0)
+        "\x83"                               // high (truncated)
+        ;
+    const size_t  raw_length = 20;
+
+    ipset_node_cache_load_from_buffer(bad_reference, raw_length, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad reference");
+    cork_error_clear();
+
+    ipset_node_cache_load_from_buffer(bad_variable, raw_length, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad variable");
+    cork_error_clear();
+
+    ipset_node_cache_load_from_buffer(bad_varint, raw_length, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with truncated varint");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_bdd_load_buffer_4)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* A v2 variable has to fit into 8 bits, even though the file has
+     * room for 32. */
+    const char  *raw =
+        "IP set"                             // magic number
+        "\x00\x02"                           // version
+        "\x0c\x00\x00\x00"                   // node size
+        "\x00\x00\x00\x00"                   // root
+        "\x01\x00\x00\x00\x00\x00\x00\x00"   // node count
+        "\x2c\x00\x00\x00\x00\x00\x00\x00"   // length
+        // node 0
+        "\x2c\x01\x00\x00"                   // variable
+        "\x01\x00\x00\x00"                   // low
+        "\x03\x00\x00\x00"                   // high
+        ;
+    const size_t  raw_length = 44;
+    ipset_node_id  read;
+
+    read = ipset_node_cache_load_from_buffer(raw, raw_length, cache);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad variable");
+    fail_unless(read == 0,
+                "Bad BDD should load as node 0");
+    cork_error_clear();
+
+    /* A truncated header is an error, too. */
+    FILE  *stream = fmemopen((void *) raw, 12, "rb");
+    read = ipset_node_cache_load(stream, cache);
+    fclose(stream);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with truncated header");
+    fail_unless(read == 0,
+                "Truncated BDD should load as node 0");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_bdd_load_stream_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* A v1 header whose node count and length agree with each other,
+     * but not with how much data the stream actually has. */
+    const char  *raw =
+        "IP set"                             // magic number
+        "\x00\x01"                           // version
+        "\x00\x00\x00\x09\x00\x00\x00\x0b"   // length
+        "\xff\xff\xff\xff"                   // nonterminal count
+        // node -1
+        "\x01"                               // variable
+        "\x00\x00\x00\x00"                   // low
+        "\xff\xff\xff\xff"                   // high
+        ;
+    const size_t  raw_length = 29;
+    ipset_node_id  read;
+
+    FILE  *stream = fmemopen((void *) raw, raw_length, "rb");
+    read = ipset_node_cache_load(stream, cache);
+    fclose(stream);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad node count");
+    fail_unless(read == 0,
+                "Bad BDD should load as node 0");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_bdd_load_stream_2)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+
+    /* The same for a v2 header, with nothing after it. */
+    const char  *raw =
+        "IP set"                             // magic number
+        "\x00\x02"                           // version
+        "\x0c\x00\x00\x00"                   // node size
+        "\x00\x00\x00\x00"                   // root
+        "\xff\xff\xff\x3f\x00\x00\x00\x00"   // node count
+        "\x14\x00\x00\x00\x03\x00\x00\x00"   // length
+        ;
+    const size_t  raw_length = 32;
+    ipset_node_id  read;
+
+    FILE  *stream = fmemopen((void *) raw, raw_length, "rb");
+    read = ipset_node_cache_load(stream, cache);
+    fclose(stream);
+    fail_unless(cork_error_occurred(),
+                "Shouldn't be able to read BDD with bad node count");
+    fail_unless(read == 0,
+                "Bad BDD should load as node 0");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Iteration
  */
@@ -871,6 +1252,7 @@ test_suite()
     TCase  *tc_operators = tcase_create("operators");
     tcase_add_test(tc_operators, test_bdd_insert_reduced_1);
     tcase_add_test(tc_operators, test_bdd_insert_evaluate_1);
+    tcase_add_test(tc_operators, test_bdd_apply_cache_1);
     suite_add_tcase(s, tc_operators);
 
     TCase  *tc_size = tcase_create("size");
@@ -880,8 +1262,15 @@ test_suite()
     TCase  *tc_serialization = tcase_create("serialization");
     tcase_add_test(tc_serialization, test_bdd_save_1);
     tcase_add_test(tc_serialization, test_bdd_save_2);
+    tcase_add_test(tc_serialization, test_bdd_save_3);
     tcase_add_test(tc_serialization, test_bdd_load_1);
     tcase_add_test(tc_serialization, test_bdd_load_2);
+    tcase_add_test(tc_serialization, test_bdd_load_buffer_1);
+    tcase_add_test(tc_serialization, test_bdd_load_buffer_2);
+    tcase_add_test(tc_serialization, test_bdd_load_buffer_3);
+    tcase_add_test(tc_serialization, test_bdd_load_buffer_4);
+    tcase_add_test(tc_serialization, test_bdd_load_stream_1);
+    tcase_add_test(tc_serialization, test_bdd_load_stream_2);
     suite_add_tcase(s, tc_serialization);
 
     TCase  *tc_iteration = tcase_create("iteration");
@@ -7,7 +7,9 @@
  * ----------------------------------------------------------------------
  */
 
+#include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <check.h>
@@ -63,10 +65,149 @@ temp_file_open_stream(struct temp_file *temp_file)
  * Helper functions
  */
 
+typedef int
+(*save_fd_func)(int fd, const struct ip_map *map);
+
+static void
+check_fd_save(const char *expected, long expected_size,
+              save_fd_func save_fd, const struct ip_map *map)
+{
+    long  size;
+    char  *buf;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(save_fd(fileno(temp_file->stream), map) == 0,
+                "Could not save map to file descriptor");
+
+    size = lseek(fileno(temp_file->stream), 0, SEEK_CUR);
+    fail_unless(size == expected_size,
+                "Map saved to file descriptor has wrong size "
+                "(%ld, expected %ld)", size, expected_size);
+
+    buf = cork_malloc(size);
+    fail_unless(pread(fileno(temp_file->stream), buf, size, 0) == size,
+                "Could not read saved map");
+    fail_unless(memcmp(buf, expected, size) == 0,
+                "Map saved to file descriptor is different");
+
+    free(buf);
+    temp_file_free(temp_file);
+}
+
+static void
+test_round_trip_v2(struct ip_map *map)
+{
+    struct ip_map  *read_map;
+    long  size;
+    char  *buf;
+    struct ipset_frozen  *frozen;
+    struct ipset_mmap  *mapped;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(ipmap_save_v2(temp_file->stream, map) == 0,
+                "Could not save map");
+
+    fflush(temp_file->stream);
+    size = ftell(temp_file->stream);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved map");
+    check_fd_save(buf, size, ipmap_save_v2_fd, map);
+    free(buf);
+    fseek(temp_file->stream, 0, SEEK_SET);
+
+    read_map = ipmap_load(temp_file->stream);
+    fail_if(read_map == NULL,
+            "Could not read map");
+
+    fail_unless(ipmap_is_equal(map, read_map),
+                "Map not same after saving/loading");
+
+    /* The mapped file should hold exactly what we'd get by freezing
+     * the map. */
+    mapped = ipset_mmap_open(temp_file->filename, 0);
+    fail_if(mapped == NULL,
+            "Could not map map");
+
+    frozen = ipmap_freeze(map);
+    fail_unless(mapped->frozen.root == frozen->root,
+                "Mapped map has wrong root");
+    fail_unless(mapped->frozen.node_count == frozen->node_count,
+                "Mapped map has wrong number of nodes");
+    if (frozen->node_count > 0) {
+        fail_unless(memcmp(mapped->frozen.nodes, frozen->nodes,
+                           frozen->node_count * sizeof(struct ipset_node))
+                    == 0,
+                    "Mapped map has wrong nodes");
+    }
+
+    ipset_frozen_free(frozen);
+    ipset_mmap_close(mapped);
+    temp_file_free(temp_file);
+    ipmap_free(read_map);
+}
+
+static int
+save_compact_fd(int fd, const struct ip_map *map)
+{
+    return ipmap_save_fd_with_flags(fd, map, IPSET_SAVE_COMPACT);
+}
+
+static void
+test_round_trip_v3(struct ip_map *map, long v1_size)
+{
+    struct ip_map  *read_map;
+    long  size;
+    char  *buf;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(ipmap_save_with_flags
+                (temp_file->stream, map, IPSET_SAVE_COMPACT) == 0,
+                "Could not save map");
+
+    fflush(temp_file->stream);
+    size = ftell(temp_file->stream);
+    fail_unless(size <= v1_size,
+                "Compact map is bigger than v1 map (%ld, v1 is %ld)",
+                size, v1_size);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved map");
+    check_fd_save(buf, size, save_compact_fd, map);
+    fseek(temp_file->stream, 0, SEEK_SET);
+
+    read_map = ipmap_load(temp_file->stream);
+    fail_if(read_map == NULL,
+            "Could not read compact map");
+    fail_unless(ipmap_is_equal(map, read_map),
+                "Map not same after saving/loading compact map");
+    ipmap_free(read_map);
+
+    read_map = ipmap_load_from_buffer(buf, size);
+    fail_if(read_map == NULL,
+            "Could not read compact map from buffer");
+    fail_unless(ipmap_is_equal(map, read_map),
+                "Map not same after loading compact map from buffer");
+
+    free(buf);
+    temp_file_free(temp_file);
+    ipmap_free(read_map);
+}
+
 static void
 test_round_trip(struct ip_map *map)
 {
     struct ip_map  *read_map;
+    long  size;
+    char  *buf;
 
     struct temp_file  *temp_file = temp_file_new();
     temp_file_open_stream(temp_file);
@@ -83,9 +224,31 @@ test_round_trip(struct ip_map *map)
 
     fail_unless(ipmap_is_equal(map, read_map),
                 "Map not same after saving/loading");
+    ipmap_free(read_map);
+
+    /* We should get the same thing if we load it from memory. */
+    size = ftell(temp_file->stream);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved map");
 
+    read_map = ipmap_load_from_buffer(buf, size);
+    fail_if(read_map == NULL,
+            "Could not read map from buffer");
+
+    fail_unless(ipmap_is_equal(map, read_map),
+                "Map not same after saving/loading from buffer");
+
+    /* Saving straight to a file descriptor should give the same file. */
+    check_fd_save(buf, size, ipmap_save_fd, map);
+
+    free(buf);
     temp_file_free(temp_file);
     ipmap_free(read_map);
+
+    test_round_trip_v2(map);
+    test_round_trip_v3(map, size);
 }
 
 
@@ -305,6 +468,50 @@ START_TEST(test_ipv4_bad_cidr_prefix_01)
 }
 END_TEST
 
+START_TEST(test_ipv4_bad_value_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map;
+    struct cork_ipv4  addr;
+    struct ipset_ipv4_network  network;
+
+    /* A value that can't be stored in a terminal node is an error, and
+     * doesn't change the map. */
+    ipmap_init(&map, 0);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipmap_ipv4_set(&map, &addr, -1);
+    fail_unless(cork_error_occurred(),
+                "Negative value should be an error");
+    cork_error_clear();
+    ipmap_ipv4_set_network(&map, &addr, 24, -1);
+    fail_unless(cork_error_occurred(),
+                "Negative value should be an error");
+    cork_error_clear();
+    network.address = addr;
+    network.cidr_prefix = 24;
+    fail_unless(ipmap_ipv4_set_many(&map, &network, 1, -1) == -1,
+                "Negative value should be an error");
+    cork_error_clear();
+#if IPSET_COMPACT_NODES
+    ipmap_ipv4_set(&map, &addr, 1 << 27);
+    fail_unless(cork_error_occurred(),
+                "Value too large for compact nodes should be an error");
+    cork_error_clear();
+#endif
+    fail_unless(ipmap_is_empty(&map),
+                "Bad value shouldn't change map");
+    ipmap_done(&map);
+
+    /* So is a bad default value. */
+    fail_unless(ipmap_init(&map, -1) == -1,
+                "Negative default value should be an error");
+    cork_error_clear();
+    fail_unless(ipmap_new(-1) == NULL,
+                "Negative default value should be an error");
+    cork_error_clear();
+}
+END_TEST
+
 START_TEST(test_ipv4_equality_1)
 {
     DESCRIBE_TEST;
@@ -429,7 +636,7 @@ START_TEST(test_ipv4_memory_size_1)
     cork_ipv4_init(&addr, "192.168.1.100");
     ipmap_ipv4_set(&map, &addr, 1);
 
-    expected = 33 * sizeof(struct ipset_node);
+    expected = 33 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -451,7 +658,7 @@ START_TEST(test_ipv4_memory_size_2)
     cork_ipv4_init(&addr, "192.168.1.100");
     ipmap_ipv4_set_network(&map, &addr, 24, 1);
 
-    expected = 25 * sizeof(struct ipset_node);
+    expected = 25 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -462,6 +669,50 @@ START_TEST(test_ipv4_memory_size_2)
 }
 END_TEST
 
+START_TEST(test_count_value_1)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map;
+    struct cork_ipv4  addr;
+    struct cork_ipv6  addr6;
+    uint64_t  count4;
+    struct ipset_uint128  count6;
+
+    ipmap_init(&map, 0);
+    cork_ipv4_init(&addr, "192.168.0.0");
+    ipmap_ipv4_set_network(&map, &addr, 16, 1);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipmap_ipv4_set_network(&map, &addr, 24, 2);
+    cork_ipv6_init(&addr6, "2001:db8::");
+    ipmap_ipv6_set_network(&map, &addr6, 64, 2);
+
+    ipmap_count_value(&map, 1, &count4, &count6);
+    fail_unless(count4 == 65536 - 256,
+                "Got wrong IPv4 count %" PRIu64, count4);
+    fail_unless(count6.high == 0 && count6.low == 0,
+                "Expected no IPv6 addresses");
+
+    ipmap_count_value(&map, 2, &count4, &count6);
+    fail_unless(count4 == 256,
+                "Got wrong IPv4 count %" PRIu64, count4);
+    fail_unless(count6.high == 1 && count6.low == 0,
+                "Got wrong IPv6 count");
+
+    /* The default value covers everything else. */
+    ipmap_count_value(&map, 0, &count4, &count6);
+    fail_unless(count4 == ((uint64_t) 1 << 32) - 65536,
+                "Got wrong IPv4 count %" PRIu64, count4);
+    fail_unless(count6.high == UINT64_MAX && count6.low == 0,
+                "Got wrong IPv6 count");
+
+    ipmap_count_value(&map, 3, &count4, &count6);
+    fail_unless(count4 == 0 && count6.high == 0 && count6.low == 0,
+                "Expected no addresses with an unused value");
+
+    ipmap_done(&map);
+}
+END_TEST
+
 START_TEST(test_ipv4_store_01)
 {
     DESCRIBE_TEST;
@@ -481,6 +732,148 @@ START_TEST(test_ipv4_store_01)
 END_TEST
 
 
+START_TEST(test_ipv4_set_many_01)
+{
+    DESCRIBE_TEST;
+    struct ipset_ipv4_network  networks[3];
+    struct ip_map  map, expected;
+    struct cork_ipv4  addr;
+
+    ipmap_init(&map, 0);
+    ipmap_init(&expected, 0);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipmap_ipv4_set(&map, &addr, 1);
+    ipmap_ipv4_set(&expected, &addr, 1);
+
+    cork_ipv4_init(&networks[0].address, "192.168.1.0");
+    networks[0].cidr_prefix = 24;
+    cork_ipv4_init(&networks[1].address, "10.0.0.1");
+    networks[1].cidr_prefix = 32;
+    cork_ipv4_init(&networks[2].address, "10.0.0.0");
+    networks[2].cidr_prefix = 30;
+    ipmap_ipv4_set_network(&expected, &networks[0].address, 24, 2);
+    ipmap_ipv4_set(&expected, &networks[1].address, 2);
+    ipmap_ipv4_set_network(&expected, &networks[2].address, 30, 2);
+
+    fail_unless(ipmap_ipv4_set_many(&map, networks, 3, 2) == 0,
+                "Could not set networks");
+    fail_unless(ipmap_ipv4_get(&map, &addr) == 2,
+                "Element should be overwritten");
+    fail_unless(ipmap_is_equal(&map, &expected),
+                "Batch-built map doesn't match incremental map");
+
+    ipmap_done(&map);
+    ipmap_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_frozen_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map;
+    struct ipset_frozen  *frozen;
+    struct cork_ip  addr;
+
+    ipmap_init(&map, 0);
+    cork_ip_init(&addr, "192.168.1.0");
+    ipmap_ip_set_network(&map, &addr, 24, 1);
+    cork_ip_init(&addr, "192.168.1.100");
+    ipmap_ip_set(&map, &addr, 2);
+    cork_ip_init(&addr, "fe80::1");
+    ipmap_ip_set(&map, &addr, 3);
+    frozen = ipmap_freeze(&map);
+    ipmap_done(&map);
+
+    cork_ip_init(&addr, "192.168.1.100");
+    fail_unless(ipmap_frozen_get_ip(frozen, &addr) == 2,
+                "Frozen map has wrong value for element");
+    cork_ip_init(&addr, "192.168.1.101");
+    fail_unless(ipmap_frozen_get_ip(frozen, &addr) == 1,
+                "Frozen map has wrong value for network");
+    cork_ip_init(&addr, "192.168.2.1");
+    fail_unless(ipmap_frozen_get_ip(frozen, &addr) == 0,
+                "Frozen map should have default value");
+    cork_ip_init(&addr, "fe80::1");
+    fail_unless(ipmap_frozen_get_ip(frozen, &addr) == 3,
+                "Frozen map has wrong value for IPv6 element");
+
+    ipset_frozen_free(frozen);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_stride_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map;
+    struct ipset_stride_table  *table;
+    struct cork_ip  addr;
+
+    ipmap_init(&map, 0);
+    cork_ip_init(&addr, "192.168.1.0");
+    ipmap_ip_set_network(&map, &addr, 24, 1);
+    cork_ip_init(&addr, "192.168.1.100");
+    ipmap_ip_set(&map, &addr, 2);
+    cork_ip_init(&addr, "fe80::1");
+    ipmap_ip_set(&map, &addr, 3);
+    table = ipmap_compile_strides(&map);
+    ipmap_done(&map);
+
+    cork_ip_init(&addr, "192.168.1.100");
+    fail_unless(ipmap_stride_get_ip(table, &addr) == 2,
+                "Stride table has wrong value for element");
+    cork_ip_init(&addr, "192.168.1.101");
+    fail_unless(ipmap_stride_get_ip(table, &addr) == 1,
+                "Stride table has wrong value for network");
+    cork_ip_init(&addr, "192.168.2.1");
+    fail_unless(ipmap_stride_get_ip(table, &addr) == 0,
+                "Stride table should have default value");
+    cork_ip_init(&addr, "fe80::1");
+    fail_unless(ipmap_stride_get_ip(table, &addr) == 3,
+                "Stride table has wrong value for IPv6 element");
+    cork_ip_init(&addr, "fe80::2");
+    fail_unless(ipmap_stride_get_ip(table, &addr) == 0,
+                "Stride table should have default value");
+
+    ipset_stride_table_free(table);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_publish_01)
+{
+    DESCRIBE_TEST;
+    struct ipset_publisher  *publisher = ipset_publisher_new(1);
+    struct ipset_reader  *reader = ipset_publisher_add_reader(publisher);
+    const struct ipset_frozen  *version;
+    struct ip_map  map;
+    struct cork_ip  addr;
+
+    ipmap_init(&map, 0);
+    cork_ip_init(&addr, "192.168.1.100");
+    ipmap_ip_set(&map, &addr, 2);
+    ipmap_publish(publisher, &map);
+    ipmap_ip_set(&map, &addr, 3);
+
+    version = ipset_reader_enter(reader);
+    fail_unless(ipmap_frozen_get_ip(version, &addr) == 2,
+                "Published map has wrong value for element");
+    ipset_reader_leave(reader);
+
+    ipmap_publish(publisher, &map);
+    version = ipset_reader_enter(reader);
+    fail_unless(ipmap_frozen_get_ip(version, &addr) == 3,
+                "Published map has wrong value for element");
+    ipset_reader_leave(reader);
+
+    ipset_reader_free(reader);
+    ipset_publisher_free(publisher);
+    ipmap_done(&map);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * IPv6 tests
  */
@@ -718,7 +1111,7 @@ START_TEST(test_ipv6_memory_size_1)
     cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
     ipmap_ipv6_set(&map, &addr, 1);
 
-    expected = 129 * sizeof(struct ipset_node);
+    expected = 129 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -740,7 +1133,7 @@ START_TEST(test_ipv6_memory_size_2)
     cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
     ipmap_ipv6_set_network(&map, &addr, 32, 1);
 
-    expected = 33 * sizeof(struct ipset_node);
+    expected = 33 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipmap_memory_size(&map);
 
     fail_unless(expected == actual,
@@ -770,6 +1163,257 @@ START_TEST(test_ipv6_store_01)
 END_TEST
 
 
+START_TEST(test_ipv6_set_many_01)
+{
+    DESCRIBE_TEST;
+    struct ipset_ipv6_network  networks[2];
+    struct ip_map  map, expected;
+
+    ipmap_init(&map, 0);
+    ipmap_init(&expected, 0);
+    cork_ipv6_init(&networks[0].address, "fe80::21e:c2ff:fe9f:e8e1");
+    networks[0].cidr_prefix = 128;
+    cork_ipv6_init(&networks[1].address, "fe80::");
+    networks[1].cidr_prefix = 64;
+    ipmap_ipv6_set(&expected, &networks[0].address, 3);
+    ipmap_ipv6_set_network(&expected, &networks[1].address, 64, 3);
+
+    fail_unless(ipmap_ipv6_set_many(&map, networks, 2, 3) == 0,
+                "Could not set networks");
+    fail_unless(ipmap_is_equal(&map, &expected),
+                "Batch-built map doesn't match incremental map");
+
+    /* A bad CIDR prefix leaves the map unchanged. */
+    networks[1].cidr_prefix = 129;
+    fail_unless(ipmap_ipv6_set_many(&map, networks, 2, 4) == -1,
+                "Expected an error for a bad CIDR prefix");
+    cork_error_clear();
+    fail_unless(ipmap_is_equal(&map, &expected),
+                "Bad CIDR prefix shouldn't change map");
+
+    ipmap_done(&map);
+    ipmap_done(&expected);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Operator tests
+ */
+
+START_TEST(test_union_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map1, map2;
+    struct cork_ipv4  addr1, addr2, addr3;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.1.101");
+    cork_ipv4_init(&addr3, "192.168.1.102");
+
+    ipmap_init(&map1, 0);
+    ipmap_ipv4_set(&map1, &addr1, 1);
+    ipmap_ipv4_set(&map1, &addr2, 1);
+
+    ipmap_init(&map2, 0);
+    ipmap_ipv4_set(&map2, &addr2, 2);
+    ipmap_ipv4_set(&map2, &addr3, 2);
+
+    ipmap_union(&map1, &map2);
+    fail_unless(ipmap_ipv4_get(&map1, &addr1) == 1,
+                "Left-only element should keep its value");
+    fail_unless(ipmap_ipv4_get(&map1, &addr2) == 2,
+                "Shared element should take the right value");
+    fail_unless(ipmap_ipv4_get(&map1, &addr3) == 2,
+                "Right-only element should be added");
+
+    ipmap_done(&map1);
+    ipmap_done(&map2);
+}
+END_TEST
+
+START_TEST(test_intersection_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map1, map2;
+    struct cork_ipv4  addr1, addr2;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.1.101");
+
+    ipmap_init(&map1, 0);
+    ipmap_ipv4_set(&map1, &addr1, 1);
+    ipmap_ipv4_set(&map1, &addr2, 1);
+
+    /* The right-hand map has a different default value; only the
+     * addresses it maps to something else should be kept. */
+    ipmap_init(&map2, 5);
+    ipmap_ipv4_set(&map2, &addr2, 2);
+
+    ipmap_intersection(&map1, &map2);
+    fail_unless(ipmap_ipv4_get(&map1, &addr1) == 0,
+                "Left-only element should be removed");
+    fail_unless(ipmap_ipv4_get(&map1, &addr2) == 1,
+                "Shared element should keep the left value");
+
+    ipmap_done(&map1);
+    ipmap_done(&map2);
+}
+END_TEST
+
+START_TEST(test_difference_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map1, map2;
+    struct cork_ipv6  addr1, addr2;
+
+    cork_ipv6_init(&addr1, "fe80::21e:c2ff:fe9f:e8e1");
+    cork_ipv6_init(&addr2, "fe80::21e:c2ff:fe9f:e8e2");
+
+    ipmap_init(&map1, 0);
+    ipmap_ipv6_set(&map1, &addr1, 1);
+    ipmap_ipv6_set(&map1, &addr2, 1);
+
+    ipmap_init(&map2, 0);
+    ipmap_ipv6_set(&map2, &addr2, 2);
+
+    ipmap_difference(&map1, &map2);
+    fail_unless(ipmap_ipv6_get(&map1, &addr1) == 1,
+                "Left-only element should keep its value");
+    fail_unless(ipmap_ipv6_get(&map1, &addr2) == 0,
+                "Shared element should be removed");
+
+    ipmap_done(&map1);
+    ipmap_done(&map2);
+}
+END_TEST
+
+START_TEST(test_symmetric_difference_01)
+{
+    DESCRIBE_TEST;
+    struct ip_map  map1, map2;
+    struct cork_ipv4  addr1, addr2, addr3;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.1.101");
+    cork_ipv4_init(&addr3, "192.168.1.102");
+
+    ipmap_init(&map1, 0);
+    ipmap_ipv4_set(&map1, &addr1, 1);
+    ipmap_ipv4_set(&map1, &addr2, 1);
+
+    ipmap_init(&map2, 0);
+    ipmap_ipv4_set(&map2, &addr2, 2);
+    ipmap_ipv4_set(&map2, &addr3, 2);
+
+    ipmap_symmetric_difference(&map1, &map2);
+    fail_unless(ipmap_ipv4_get(&map1, &addr1) == 1,
+                "Left-only element should keep its value");
+    fail_unless(ipmap_ipv4_get(&map1, &addr2) == 0,
+                "Shared element should be removed");
+    fail_unless(ipmap_ipv4_get(&map1, &addr3) == 2,
+                "Right-only element should be added");
+
+    ipmap_done(&map1);
+    ipmap_done(&map2);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Shared cache tests
+ */
+
+START_TEST(test_shared_cache_equality_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_map  map1, map2;
+    struct cork_ipv4  addr;
+
+    ipmap_init_in_cache(&map1, cache, 0);
+    ipmap_init_in_cache(&map2, cache, 0);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipmap_ipv4_set_network(&map1, &addr, 24, 1);
+    ipmap_ipv4_set_network(&map2, &addr, 24, 1);
+
+    fail_unless(map1.map_bdd == map2.map_bdd,
+                "Equal maps in the same cache should share a root");
+    fail_unless(ipmap_is_equal(&map1, &map2),
+                "Expected {x=1} == {x=1}");
+
+    ipmap_done(&map1);
+    fail_unless(ipmap_ipv4_get(&map2, &addr) == 1,
+                "Element should still be present");
+    ipmap_done(&map2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_shared_cache_compact_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_map  map1, map2;
+    struct cork_ipv4  addr;
+    struct cork_ipv6  addr6;
+
+    ipmap_init_in_cache(&map1, cache, 0);
+    ipmap_init_in_cache(&map2, cache, 0);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipmap_ipv4_set_network(&map1, &addr, 24, 1);
+    cork_ipv6_init(&addr6, "fe80::");
+    ipmap_ipv6_set_network(&map2, &addr6, 16, 2);
+    ipmap_ipv6_set_network(&map1, &addr6, 16, 2);
+    ipmap_ipv6_set_network(&map2, &addr6, 16, 0);
+
+    /* Compacting through one map would leave the other one with stale
+     * node IDs. */
+    fail_unless(ipmap_compact(&map1) == -1,
+                "Shouldn't compact a shared cache through one map");
+    cork_error_clear();
+
+    /* Both maps' roots need to be updated. */
+    ipset_node_id  *roots[] = { &map1.map_bdd, &map2.map_bdd };
+    ipset_node_cache_compact(cache, roots, 2);
+
+    fail_unless(ipmap_ipv4_get(&map1, &addr) == 1,
+                "Element should be present after compacting");
+    fail_unless(ipmap_ipv6_get(&map1, &addr6) == 2,
+                "Element should be present after compacting");
+    fail_unless(ipmap_is_empty(&map2),
+                "Map should be empty after compacting");
+
+    ipmap_done(&map1);
+    ipmap_done(&map2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_shared_cache_complement_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache =
+        ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_COMPLEMENT_EDGES);
+    struct ip_map  map;
+
+    /* Maps can't use a cache with complement edges. */
+    fail_unless(ipmap_new_in_cache(cache, 0) == NULL,
+                "Map shouldn't use a cache with complement edges");
+    cork_error_clear();
+
+    fail_unless(ipmap_init_in_cache(&map, cache, 0) == -1,
+                "Map shouldn't use a cache with complement edges");
+    cork_error_clear();
+
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
 /*-----------------------------------------------------------------------
  * Testing harness
  */
@@ -797,6 +1441,7 @@ ipmap_suite()
     tcase_add_test(tc_ipv4, test_ipv4_overwrite_01);
     tcase_add_test(tc_ipv4, test_ipv4_overwrite_02);
     tcase_add_test(tc_ipv4, test_ipv4_bad_cidr_prefix_01);
+    tcase_add_test(tc_ipv4, test_ipv4_bad_value_01);
     tcase_add_test(tc_ipv4, test_ipv4_equality_1);
     tcase_add_test(tc_ipv4, test_ipv4_equality_2);
     tcase_add_test(tc_ipv4, test_ipv4_equality_3);
@@ -804,7 +1449,12 @@ ipmap_suite()
     tcase_add_test(tc_ipv4, test_ipv4_inequality_2);
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_1);
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_2);
+    tcase_add_test(tc_ipv4, test_count_value_1);
     tcase_add_test(tc_ipv4, test_ipv4_store_01);
+    tcase_add_test(tc_ipv4, test_ipv4_set_many_01);
+    tcase_add_test(tc_ipv4, test_ipv4_frozen_01);
+    tcase_add_test(tc_ipv4, test_ipv4_stride_01);
+    tcase_add_test(tc_ipv4, test_ipv4_publish_01);
     suite_add_tcase(s, tc_ipv4);
 
     TCase  *tc_ipv6 = tcase_create("ipv6");
@@ -823,8 +1473,22 @@ ipmap_suite()
     tcase_add_test(tc_ipv6, test_ipv6_memory_size_1);
     tcase_add_test(tc_ipv6, test_ipv6_memory_size_2);
     tcase_add_test(tc_ipv6, test_ipv6_store_01);
+    tcase_add_test(tc_ipv6, test_ipv6_set_many_01);
     suite_add_tcase(s, tc_ipv6);
 
+    TCase  *tc_operators = tcase_create("operators");
+    tcase_add_test(tc_operators, test_union_01);
+    tcase_add_test(tc_operators, test_intersection_01);
+    tcase_add_test(tc_operators, test_difference_01);
+    tcase_add_test(tc_operators, test_symmetric_difference_01);
+    suite_add_tcase(s, tc_operators);
+
+    TCase  *tc_shared = tcase_create("shared-cache");
+    tcase_add_test(tc_shared, test_shared_cache_equality_1);
+    tcase_add_test(tc_shared, test_shared_cache_compact_1);
+    tcase_add_test(tc_shared, test_shared_cache_complement_1);
+    suite_add_tcase(s, tc_shared);
+
     return s;
 }
 
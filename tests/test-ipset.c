@@ -7,7 +7,10 @@
  * ----------------------------------------------------------------------
  */
 
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <check.h>
@@ -63,10 +66,165 @@ temp_file_open_stream(struct temp_file *temp_file)
  * Helper functions
  */
 
+/* Return the i-th word of a fixed sequence that's scattered across the
+ * whole 32-bit range, in network byte order. */
+static uint32_t
+scattered_word(unsigned int i)
+{
+    return CORK_UINT32_HOST_TO_BIG(i * 2654435761u);
+}
+
+/* Fill in the i-th address of the same sequence as an IPv4 address. */
+static void
+scattered_ipv4(unsigned int i, struct cork_ipv4 *addr)
+{
+    uint32_t  ip = scattered_word(i);
+    cork_ipv4_copy(addr, &ip);
+}
+
+typedef int
+(*save_fd_func)(int fd, const struct ip_set *set);
+
+static void
+check_fd_save(const char *expected, long expected_size,
+              save_fd_func save_fd, const struct ip_set *set)
+{
+    long  size;
+    char  *buf;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(save_fd(fileno(temp_file->stream), set) == 0,
+                "Could not save set to file descriptor");
+
+    size = lseek(fileno(temp_file->stream), 0, SEEK_CUR);
+    fail_unless(size == expected_size,
+                "Set saved to file descriptor has wrong size "
+                "(%ld, expected %ld)", size, expected_size);
+
+    buf = cork_malloc(size);
+    fail_unless(pread(fileno(temp_file->stream), buf, size, 0) == size,
+                "Could not read saved set");
+    fail_unless(memcmp(buf, expected, size) == 0,
+                "Set saved to file descriptor is different");
+
+    free(buf);
+    temp_file_free(temp_file);
+}
+
+static void
+test_round_trip_v2(struct ip_set *set)
+{
+    struct ip_set  *read_set;
+    long  size;
+    char  *buf;
+    struct ipset_frozen  *frozen;
+    struct ipset_mmap  *mapped;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(ipset_save_v2(temp_file->stream, set) == 0,
+                "Could not save set");
+
+    fflush(temp_file->stream);
+    size = ftell(temp_file->stream);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved set");
+    check_fd_save(buf, size, ipset_save_v2_fd, set);
+    free(buf);
+    fseek(temp_file->stream, 0, SEEK_SET);
+
+    read_set = ipset_load(temp_file->stream);
+    fail_if(read_set == NULL,
+            "Could not read set");
+
+    fail_unless(ipset_is_equal(set, read_set),
+                "Set not same after saving/loading");
+
+    /* The mapped file should hold exactly what we'd get by freezing
+     * the set. */
+    mapped = ipset_mmap_open(temp_file->filename, IPSET_MMAP_RANDOM);
+    fail_if(mapped == NULL,
+            "Could not map set");
+
+    frozen = ipset_freeze(set);
+    fail_unless(mapped->frozen.root == frozen->root,
+                "Mapped set has wrong root");
+    fail_unless(mapped->frozen.node_count == frozen->node_count,
+                "Mapped set has wrong number of nodes");
+    if (frozen->node_count > 0) {
+        fail_unless(memcmp(mapped->frozen.nodes, frozen->nodes,
+                           frozen->node_count * sizeof(struct ipset_node))
+                    == 0,
+                    "Mapped set has wrong nodes");
+    }
+
+    ipset_frozen_free(frozen);
+    ipset_mmap_close(mapped);
+    temp_file_free(temp_file);
+    ipset_free(read_set);
+}
+
+static int
+save_compact_fd(int fd, const struct ip_set *set)
+{
+    return ipset_save_fd_with_flags(fd, set, IPSET_SAVE_COMPACT);
+}
+
+static void
+test_round_trip_v3(struct ip_set *set, long v1_size)
+{
+    struct ip_set  *read_set;
+    long  size;
+    char  *buf;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    fail_unless(ipset_save_with_flags
+                (temp_file->stream, set, IPSET_SAVE_COMPACT) == 0,
+                "Could not save set");
+
+    fflush(temp_file->stream);
+    size = ftell(temp_file->stream);
+    fail_unless(size <= v1_size,
+                "Compact set is bigger than v1 set (%ld, v1 is %ld)",
+                size, v1_size);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved set");
+    check_fd_save(buf, size, save_compact_fd, set);
+    fseek(temp_file->stream, 0, SEEK_SET);
+
+    read_set = ipset_load(temp_file->stream);
+    fail_if(read_set == NULL,
+            "Could not read compact set");
+    fail_unless(ipset_is_equal(set, read_set),
+                "Set not same after saving/loading compact set");
+    ipset_free(read_set);
+
+    read_set = ipset_load_from_buffer(buf, size);
+    fail_if(read_set == NULL,
+            "Could not read compact set from buffer");
+    fail_unless(ipset_is_equal(set, read_set),
+                "Set not same after loading compact set from buffer");
+
+    free(buf);
+    temp_file_free(temp_file);
+    ipset_free(read_set);
+}
+
 static void
 test_round_trip(struct ip_set *set)
 {
     struct ip_set  *read_set;
+    long  size;
+    char  *buf;
 
     struct temp_file  *temp_file = temp_file_new();
     temp_file_open_stream(temp_file);
@@ -83,9 +241,31 @@ test_round_trip(struct ip_set *set)
 
     fail_unless(ipset_is_equal(set, read_set),
                 "Set not same after saving/loading");
+    ipset_free(read_set);
+
+    /* We should get the same thing if we load it from memory. */
+    size = ftell(temp_file->stream);
+    buf = cork_malloc(size);
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(fread(buf, 1, size, temp_file->stream) == size,
+                "Could not read saved set");
+
+    read_set = ipset_load_from_buffer(buf, size);
+    fail_if(read_set == NULL,
+            "Could not read set from buffer");
+
+    fail_unless(ipset_is_equal(set, read_set),
+                "Set not same after saving/loading from buffer");
+
+    /* Saving straight to a file descriptor should give the same file. */
+    check_fd_save(buf, size, ipset_save_fd, set);
 
+    free(buf);
     temp_file_free(temp_file);
     ipset_free(read_set);
+
+    test_round_trip_v2(set);
+    test_round_trip_v3(set, size);
 }
 
 
@@ -130,6 +310,54 @@ START_TEST(test_store_empty)
 }
 END_TEST
 
+START_TEST(test_store_v2_bad_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ip_set  *read_set;
+    struct cork_ipv4  addr;
+    long  size;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+
+    /* A truncated v2 file can't be loaded or mapped. */
+    ipset_init(&set);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add(&set, &addr);
+    fail_unless(ipset_save_v2(temp_file->stream, &set) == 0,
+                "Could not save set");
+    fflush(temp_file->stream);
+    size = ftell(temp_file->stream);
+    fail_unless(ftruncate(fileno(temp_file->stream), size - 4) == 0,
+                "Could not truncate file");
+
+    fseek(temp_file->stream, 0, SEEK_SET);
+    read_set = ipset_load(temp_file->stream);
+    fail_unless(read_set == NULL,
+                "Shouldn't be able to load truncated set");
+    cork_error_clear();
+
+    fail_unless(ipset_mmap_open(temp_file->filename, 0) == NULL,
+                "Shouldn't be able to map truncated set");
+    cork_error_clear();
+
+    /* Neither can a v1 file be mapped. */
+    fseek(temp_file->stream, 0, SEEK_SET);
+    fail_unless(ftruncate(fileno(temp_file->stream), 0) == 0,
+                "Could not truncate file");
+    fail_unless(ipset_save(temp_file->stream, &set) == 0,
+                "Could not save set");
+    fflush(temp_file->stream);
+    fail_unless(ipset_mmap_open(temp_file->filename, 0) == NULL,
+                "Shouldn't be able to map v1 set");
+    cork_error_clear();
+
+    temp_file_free(temp_file);
+    ipset_done(&set);
+}
+END_TEST
+
 
 /*-----------------------------------------------------------------------
  * IPv4 tests
@@ -269,6 +497,88 @@ START_TEST(test_ipv4_network_contains_01)
 }
 END_TEST
 
+START_TEST(test_ipv4_unique_table_1)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    /* Add and then remove enough addresses to make the unique table
+     * grow, and to exercise deletions from long probe sequences. */
+    ipset_init(&set);
+    for (i = 0; i < 2000; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set, &addr);
+    }
+    for (i = 0; i < 2000; i++) {
+        scattered_ipv4(i, &addr);
+        fail_unless(ipset_contains_ipv4(&set, &addr),
+                    "Element should be present");
+    }
+    for (i = 2000; i-- > 0; ) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_remove(&set, &addr);
+    }
+
+    fail_unless(ipset_is_empty(&set),
+                "Set should be empty");
+    fail_unless(set.cache->unique_table_count == 0,
+                "Unique table should be empty, has %zu nodes",
+                set.cache->unique_table_count);
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv4_compact_1)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set, expected;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+    size_t  chunk_count;
+
+    /* Fill the set up, remove most of it, and then compact. */
+    ipset_init(&set);
+    ipset_init(&expected);
+    for (i = 0; i < 1000; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set, &addr);
+        if (i % 10 == 0) {
+            ipset_ipv4_add(&expected, &addr);
+        }
+    }
+    for (i = 0; i < 1000; i++) {
+        if (i % 10 != 0) {
+            scattered_ipv4(i, &addr);
+            ipset_ipv4_remove(&set, &addr);
+        }
+    }
+
+    chunk_count = cork_array_size(&set.cache->chunks);
+    fail_unless(ipset_compact(&set) == 0,
+                "Couldn't compact set");
+    fail_unless(cork_array_size(&set.cache->chunks) < chunk_count / 5,
+                "Compaction should free most chunks (%zu of %zu left)",
+                cork_array_size(&set.cache->chunks), chunk_count);
+    fail_unless(set.cache->largest_index ==
+                ipset_node_reachable_count(set.cache, set.set_bdd),
+                "Compacted cache should only hold reachable nodes");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Set not same after compacting");
+
+    /* The cache should still be usable afterwards. */
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add(&set, &addr);
+    ipset_ipv4_add(&expected, &addr);
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Set not same after adding to a compacted set");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
 START_TEST(test_ipv4_equality_1)
 {
     DESCRIBE_TEST;
@@ -371,7 +681,7 @@ START_TEST(test_ipv4_memory_size_1)
     cork_ipv4_init(&addr, "192.168.1.100");
     ipset_ipv4_add(&set, &addr);
 
-    expected = 33 * sizeof(struct ipset_node);
+    expected = 33 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -393,7 +703,7 @@ START_TEST(test_ipv4_memory_size_2)
     cork_ipv4_init(&addr, "192.168.1.100");
     ipset_ipv4_add_network(&set, &addr, 24);
 
-    expected = 25 * sizeof(struct ipset_node);
+    expected = 25 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -404,142 +714,704 @@ START_TEST(test_ipv4_memory_size_2)
 }
 END_TEST
 
-START_TEST(test_ipv4_store_01)
+START_TEST(test_ipv4_count_1)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
     struct cork_ipv4  addr;
+    struct ipset_uint128  count6;
 
     ipset_init(&set);
+    fail_unless(ipset_ipv4_count(&set) == 0,
+                "Expected empty set to have no addresses");
+
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    cork_ipv4_init(&addr, "10.1.2.3");
+    ipset_ipv4_add(&set, &addr);
     cork_ipv4_init(&addr, "192.168.1.100");
     ipset_ipv4_add(&set, &addr);
-    test_round_trip(&set);
+    cork_ipv4_init(&addr, "192.168.2.0");
+    ipset_ipv4_add_network(&set, &addr, 23);
+    fail_unless(ipset_ipv4_count(&set) == (1u << 24) + 1 + 512,
+                "Got wrong count %" PRIu64, ipset_ipv4_count(&set));
+    count6 = ipset_ipv6_count(&set);
+    fail_unless(count6.high == 0 && count6.low == 0,
+                "Expected IPv4 set to have no IPv6 addresses");
+
+    /* The full IPv6 space doesn't fit into 128 bits. */
+    ipset_invert(&set);
+    fail_unless(ipset_ipv4_count(&set) ==
+                ((uint64_t) 1 << 32) - (1u << 24) - 1 - 512,
+                "Got wrong count %" PRIu64, ipset_ipv4_count(&set));
+    count6 = ipset_ipv6_count(&set);
+    fail_unless(count6.high == UINT64_MAX && count6.low == UINT64_MAX,
+                "Expected IPv6 count to saturate");
+
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv4_store_02)
+START_TEST(test_ipv4_count_in_network_1)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
     struct cork_ipv4  addr;
+    struct cork_ip  ip;
+    struct ipset_uint128  count;
 
     ipset_init(&set);
-    cork_ipv4_init(&addr, "192.168.1.100");
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    cork_ipv4_init(&addr, "192.168.1.0");
     ipset_ipv4_add_network(&set, &addr, 24);
-    test_round_trip(&set);
+    cork_ipv4_init(&addr, "192.168.3.5");
+    ipset_ipv4_add(&set, &addr);
+
+    cork_ipv4_init(&addr, "192.168.0.0");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 16) == 257,
+                "Got wrong count for 192.168.0.0/16");
+    cork_ipv4_init(&addr, "192.168.3.0");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 24) == 1,
+                "Got wrong count for 192.168.3.0/24");
+    cork_ipv4_init(&addr, "192.168.3.5");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 32) == 1,
+                "Got wrong count for 192.168.3.5/32");
+    cork_ipv4_init(&addr, "192.168.3.6");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 32) == 0,
+                "Got wrong count for 192.168.3.6/32");
+    cork_ipv4_init(&addr, "10.1.0.0");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 16) == 65536,
+                "Got wrong count for 10.1.0.0/16");
+    cork_ipv4_init(&addr, "0.0.0.0");
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 0) ==
+                ipset_ipv4_count(&set),
+                "Count for 0.0.0.0/0 should match the set's count");
+
+    cork_ip_init(&ip, "192.168.0.0");
+    count = ipset_count_in_network(&set, &ip, 16);
+    fail_unless(count.high == 0 && count.low == 257,
+                "Got wrong count for 192.168.0.0/16");
+    cork_ip_init(&ip, "::");
+    count = ipset_count_in_network(&set, &ip, 0);
+    fail_unless(count.high == 0 && count.low == 0,
+                "Expected no IPv6 addresses");
+
+    fail_unless(ipset_ipv4_count_in_network(&set, &addr, 33) == 0,
+                "Bad CIDR prefix should give a count of 0");
+    cork_error_clear();
+
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv4_store_03)
+START_TEST(test_ipv4_count_histogram_1)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
     struct cork_ipv4  addr;
+    uint64_t  *counts;
+    size_t  i;
 
     ipset_init(&set);
-    cork_ipv4_init(&addr, "192.168.1.100");
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipset_ipv4_add_network(&set, &addr, 24);
+    cork_ipv4_init(&addr, "192.168.3.5");
     ipset_ipv4_add(&set, &addr);
-    cork_ipv4_init(&addr, "192.168.1.101");
+    cork_ipv4_init(&addr, "192.168.3.6");
     ipset_ipv4_add(&set, &addr);
-    cork_ipv4_init(&addr, "192.168.2.100");
-    ipset_ipv4_add_network(&set, &addr, 24);
-    test_round_trip(&set);
+
+    /* Per-/24 occupancy across a /16 */
+    counts = cork_calloc(256, sizeof(uint64_t));
+    cork_ipv4_init(&addr, "192.168.0.0");
+    fail_if(ipset_ipv4_count_histogram(&set, &addr, 16, 24, counts),
+            "Could not build histogram");
+    for (i = 0; i < 256; i++) {
+        uint64_t  expected = (i == 1)? 256: (i == 3)? 2: 0;
+        fail_unless(counts[i] == expected,
+                    "Got wrong count %" PRIu64 " for 192.168.%zu.0/24",
+                    counts[i], i);
+    }
+    free(counts);
+
+    /* Per-/24 occupancy across a /8 */
+    counts = cork_calloc(65536, sizeof(uint64_t));
+    cork_ipv4_init(&addr, "10.0.0.0");
+    fail_if(ipset_ipv4_count_histogram(&set, &addr, 8, 24, counts),
+            "Could not build histogram");
+    for (i = 0; i < 65536; i++) {
+        fail_unless(counts[i] == 256,
+                    "Got wrong count %" PRIu64 " for bucket %zu",
+                    counts[i], i);
+    }
+    free(counts);
+
+    /* A histogram with a single bucket is the same as a count. */
+    counts = cork_calloc(1, sizeof(uint64_t));
+    cork_ipv4_init(&addr, "192.168.3.0");
+    fail_if(ipset_ipv4_count_histogram(&set, &addr, 24, 24, counts),
+            "Could not build histogram");
+    fail_unless(counts[0] == 2,
+                "Got wrong count %" PRIu64, counts[0]);
+
+    fail_unless(ipset_ipv4_count_histogram(&set, &addr, 24, 23, counts) == -1,
+                "Bucket prefix shorter than network should fail");
+    cork_error_clear();
+    fail_unless(ipset_ipv4_count_histogram(&set, &addr, 0, 32, counts) == -1,
+                "Too many buckets should fail");
+    cork_error_clear();
+    free(counts);
+
     ipset_done(&set);
 }
 END_TEST
 
-
-/*-----------------------------------------------------------------------
- * IPv6 tests
- */
-
-START_TEST(test_ipv6_insert_01)
+START_TEST(test_ipv4_store_01)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
-    struct cork_ipv6  addr;
+    struct cork_ipv4  addr;
 
     ipset_init(&set);
-    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
-    fail_if(ipset_ipv6_add(&set, &addr),
-            "Element should not be present");
-    fail_unless(ipset_ipv6_add(&set, &addr),
-                "Element should be present");
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add(&set, &addr);
+    test_round_trip(&set);
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv6_remove_01)
+START_TEST(test_ipv4_store_02)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
-    struct cork_ipv6  addr;
+    struct cork_ipv4  addr;
 
     ipset_init(&set);
-    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
-    fail_if(ipset_ipv6_add(&set, &addr),
-            "Element should not be present");
-    fail_if(ipset_ipv6_remove(&set, &addr),
-            "Element should be present");
-    fail_unless(ipset_ipv6_remove(&set, &addr),
-                "Element should not be present");
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add_network(&set, &addr, 24);
+    test_round_trip(&set);
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv6_insert_network_01)
+START_TEST(test_ipv4_store_03)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
-    struct cork_ipv6  addr;
+    struct cork_ipv4  addr;
 
     ipset_init(&set);
-    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
-    fail_if(ipset_ipv6_add_network(&set, &addr, 32),
-            "Element should not be present");
-    fail_unless(ipset_ipv6_add_network(&set, &addr, 32),
-                "Element should be present");
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add(&set, &addr);
+    cork_ipv4_init(&addr, "192.168.1.101");
+    ipset_ipv4_add(&set, &addr);
+    cork_ipv4_init(&addr, "192.168.2.100");
+    ipset_ipv4_add_network(&set, &addr, 24);
+    test_round_trip(&set);
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv6_remove_network_01)
+START_TEST(test_ipv4_store_04)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
-    struct cork_ipv6  addr;
+    struct cork_ipv4  addr;
+    unsigned int  i;
 
+    /* A set whose saved form is much larger than the write buffer. */
     ipset_init(&set);
-    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
-    fail_if(ipset_ipv6_add_network(&set, &addr, 32),
-            "ELement should not be present");
-    fail_if(ipset_ipv6_remove_network(&set, &addr, 32),
-            "Element should be present");
-    fail_unless(ipset_ipv6_remove_network(&set, &addr, 32),
-                "Element should not be present");
+    for (i = 0; i < 10000; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set, &addr);
+    }
+    test_round_trip(&set);
     ipset_done(&set);
 }
 END_TEST
 
-START_TEST(test_ipv6_bad_cidr_prefix_01)
+
+START_TEST(test_ipv4_store_v2_01)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
-    struct cork_ipv6  addr;
+    struct ipset_mmap  *mapped;
+    struct cork_ipv4  addr;
+    bool  expected[512];
+    unsigned int  i;
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
 
     ipset_init(&set);
-    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
-    ipset_ipv6_add_network(&set, &addr, 129);
-    fail_unless(ipset_is_empty(&set),
-                "Bad CIDR prefix shouldn't change set");
-    cork_error_clear();
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        if (i % 3 == 0) {
+            ipset_ipv4_add(&set, &addr);
+        }
+    }
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    ipset_invert(&set);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        expected[i] = ipset_contains_ipv4(&set, &addr);
+    }
+    test_round_trip(&set);
+
+    fail_unless(ipset_save_v2(temp_file->stream, &set) == 0,
+                "Could not save set");
+    fflush(temp_file->stream);
     ipset_done(&set);
+
+    /* The mapped set doesn't depend on the original set. */
+    mapped = ipset_mmap_open
+        (temp_file->filename, IPSET_MMAP_POPULATE | IPSET_MMAP_RANDOM);
+    fail_if(mapped == NULL,
+            "Could not map set");
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        fail_unless(ipset_frozen_contains_ipv4(&mapped->frozen, &addr) ==
+                    expected[i],
+                    "Mapped set gives wrong result for element %u", i);
+    }
+    cork_ipv4_init(&addr, "10.200.0.1");
+    fail_if(ipset_frozen_contains_ipv4(&mapped->frozen, &addr),
+            "Mapped set shouldn't contain network");
+
+    ipset_mmap_close(mapped);
+    temp_file_free(temp_file);
 }
 END_TEST
 
-START_TEST(test_ipv6_contains_01)
+
+START_TEST(test_ipv4_build_sorted_01)
+{
+    DESCRIBE_TEST;
+    static const char  *addrs[] = {
+        "10.0.0.0", "10.0.0.0", "10.0.1.0", "10.0.1.128", "10.2.0.5",
+        "192.168.0.0", "192.168.1.100"
+    };
+    static const unsigned int  prefixes[] = { 8, 24, 24, 25, 32, 23, 32 };
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ipset_ipv4_network  networks[7];
+    struct ip_set  set, expected;
+    size_t  i;
+
+    /* The networks can overlap, and the result should be the same as
+     * if we'd added them one at a time. */
+    ipset_init_in_cache(&set, cache);
+    ipset_init_in_cache(&expected, cache);
+    for (i = 0; i < 7; i++) {
+        cork_ipv4_init(&networks[i].address, addrs[i]);
+        networks[i].cidr_prefix = prefixes[i];
+        ipset_ipv4_add_network(&expected, &networks[i].address, prefixes[i]);
+    }
+
+    fail_unless(ipset_ipv4_build_from_sorted(&set, networks, 7) == 0,
+                "Could not build set");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Bulk-built set doesn't match incremental set");
+    fail_unless(set.set_bdd == expected.set_bdd,
+                "Bulk-built BDD doesn't match incremental BDD");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_ipv4_build_sorted_02)
+{
+    DESCRIBE_TEST;
+    struct ipset_ipv4_network  networks[2];
+    struct ip_set  set, expected;
+    struct cork_ipv4  addr;
+
+    /* Building into a non-empty set merges the new networks in. */
+    ipset_init(&set);
+    ipset_init(&expected);
+    cork_ipv4_init(&addr, "172.16.0.1");
+    ipset_ipv4_add(&set, &addr);
+    ipset_ipv4_add(&expected, &addr);
+    cork_ipv4_init(&networks[0].address, "10.0.0.0");
+    networks[0].cidr_prefix = 8;
+    ipset_ipv4_add_network(&expected, &networks[0].address, 8);
+    cork_ipv4_init(&networks[1].address, "192.168.1.1");
+    networks[1].cidr_prefix = 32;
+    ipset_ipv4_add(&expected, &networks[1].address);
+
+    fail_unless(ipset_ipv4_build_from_sorted(&set, networks, 2) == 0,
+                "Could not build set");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Bulk-built set doesn't match incremental set");
+
+    /* Unsorted input is an error, and doesn't change the set. */
+    networks[0] = networks[1];
+    cork_ipv4_init(&networks[1].address, "10.0.0.1");
+    fail_unless(ipset_ipv4_build_from_sorted(&set, networks, 2) == -1,
+                "Expected an error for unsorted networks");
+    cork_error_clear();
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Unsorted networks shouldn't change set");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_add_many_01)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ipset_ipv4_network  networks[200];
+    struct ip_set  set, expected;
+    size_t  i;
+
+    /* The networks don't need to be sorted, and the result should be
+     * identical to adding them one at a time. */
+    ipset_init_in_cache(&set, cache);
+    ipset_init_in_cache(&expected, cache);
+    for (i = 0; i < 200; i++) {
+        scattered_ipv4(i, &networks[i].address);
+        networks[i].cidr_prefix = (i % 5 == 0)? 20: 32;
+        ipset_ipv4_add_network
+            (&expected, &networks[i].address, networks[i].cidr_prefix);
+    }
+
+    fail_unless(ipset_ipv4_add_many(&set, networks, 200) == 0,
+                "Could not add networks");
+    fail_unless(set.set_bdd == expected.set_bdd,
+                "Batch-built set doesn't match incremental set");
+
+    /* Removing half of them should match as well. */
+    for (i = 0; i < 100; i++) {
+        ipset_ipv4_remove_network
+            (&expected, &networks[i].address, networks[i].cidr_prefix);
+    }
+    fail_unless(ipset_ipv4_remove_many(&set, networks, 100) == 0,
+                "Could not remove networks");
+    fail_unless(set.set_bdd == expected.set_bdd,
+                "Batch-removed set doesn't match incremental set");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_ipv4_add_many_02)
+{
+    DESCRIBE_TEST;
+    struct ipset_ipv4_network  networks[2];
+    struct ip_set  set;
+
+    /* A bad CIDR prefix anywhere in the list leaves the set unchanged. */
+    ipset_init(&set);
+    cork_ipv4_init(&networks[0].address, "192.168.1.100");
+    networks[0].cidr_prefix = 32;
+    cork_ipv4_init(&networks[1].address, "10.0.0.0");
+    networks[1].cidr_prefix = 33;
+    fail_unless(ipset_ipv4_add_many(&set, networks, 2) == -1,
+                "Expected an error for a bad CIDR prefix");
+    cork_error_clear();
+    fail_unless(ipset_is_empty(&set),
+                "Bad CIDR prefix shouldn't change set");
+    ipset_done(&set);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_frozen_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_frozen  *frozen;
+    struct cork_ipv4  addr;
+    struct cork_ipv6  addr6;
+    bool  expected[512];
+    size_t  node_count;
+    unsigned int  i;
+
+    ipset_init(&set);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        if (i % 3 == 0) {
+            ipset_ipv4_add(&set, &addr);
+        }
+    }
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        expected[i] = ipset_contains_ipv4(&set, &addr);
+    }
+
+    /* The frozen copy doesn't depend on the original set. */
+    frozen = ipset_freeze(&set);
+    node_count = ipset_node_reachable_count(set.cache, set.set_bdd);
+    ipset_done(&set);
+
+    fail_unless(frozen->node_count == node_count,
+                "Expected %zu frozen nodes, got %zu",
+                node_count, frozen->node_count);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        fail_unless(ipset_frozen_contains_ipv4(frozen, &addr) == expected[i],
+                    "Frozen set gives wrong result for element %u", i);
+    }
+    cork_ipv4_init(&addr, "10.200.0.1");
+    fail_unless(ipset_frozen_contains_ipv4(frozen, &addr),
+                "Frozen set should contain network");
+    cork_ipv6_init(&addr6, "fe80::1");
+    fail_if(ipset_frozen_contains_ipv6(frozen, &addr6),
+            "Frozen set shouldn't contain IPv6 address");
+
+    ipset_frozen_free(frozen);
+}
+END_TEST
+
+START_TEST(test_ipv4_frozen_02)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_frozen  *frozen;
+    struct cork_ipv4  addr;
+
+    /* Sets that are a single terminal can be frozen too. */
+    ipset_init(&set);
+    frozen = ipset_freeze(&set);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    fail_if(ipset_frozen_contains_ipv4(frozen, &addr),
+            "Empty frozen set shouldn't contain element");
+    fail_unless(frozen->node_count == 0,
+                "Empty frozen set shouldn't have any nodes");
+    ipset_frozen_free(frozen);
+    ipset_done(&set);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_batch_01)
+{
+    DESCRIBE_TEST;
+    static const size_t  counts[] = { 0, 1, 13, 1000 };
+    struct ip_set  set;
+    struct ipset_frozen  *frozen;
+    struct cork_ipv4  addr;
+    uint32_t  addrs[1000];
+    uint8_t  expected[1000];
+    uint8_t  out[1000];
+    uint8_t  frozen_out[1000];
+    unsigned int  i, j;
+
+    ipset_init(&set);
+    for (i = 0; i < 1000; i++) {
+        addrs[i] = scattered_word(i);
+        cork_ipv4_copy(&addr, &addrs[i]);
+        if (i % 3 == 0) {
+            ipset_ipv4_add(&set, &addr);
+        }
+    }
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    addrs[999] = CORK_UINT32_HOST_TO_BIG(0x0a010203);
+    for (i = 0; i < 1000; i++) {
+        cork_ipv4_copy(&addr, &addrs[i]);
+        expected[i] = ipset_contains_ipv4(&set, &addr);
+    }
+
+    frozen = ipset_freeze(&set);
+    for (j = 0; j < 4; j++) {
+        memset(out, 0xff, sizeof(out));
+        memset(frozen_out, 0xff, sizeof(frozen_out));
+        ipset_contains_ipv4_batch(&set, addrs, counts[j], out);
+        ipset_frozen_contains_ipv4_batch
+            (frozen, addrs, counts[j], frozen_out);
+        for (i = 0; i < counts[j]; i++) {
+            fail_unless(out[i] == expected[i],
+                        "Batch lookup gives wrong result for element %u", i);
+            fail_unless(frozen_out[i] == expected[i],
+                        "Frozen batch lookup gives wrong result "
+                        "for element %u", i);
+        }
+        fail_unless(out[counts[j] % 1000] == 0xff || counts[j] == 1000,
+                    "Batch lookup wrote past the end of its output");
+        fail_unless(frozen_out[counts[j] % 1000] == 0xff || counts[j] == 1000,
+                    "Frozen batch lookup wrote past the end of its output");
+    }
+
+    ipset_frozen_free(frozen);
+    ipset_done(&set);
+}
+END_TEST
+
+
+START_TEST(test_ipv4_stride_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_stride_table  *table;
+    struct cork_ipv4  addr;
+    struct cork_ipv6  addr6;
+    bool  expected[512];
+    unsigned int  i;
+
+    ipset_init(&set);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        if (i % 3 == 0) {
+            ipset_ipv4_add(&set, &addr);
+        }
+    }
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    cork_ipv4_init(&addr, "172.16.0.0");
+    ipset_ipv4_add_network(&set, &addr, 20);
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        expected[i] = ipset_contains_ipv4(&set, &addr);
+    }
+
+    /* The stride table doesn't depend on the original set. */
+    table = ipset_compile_strides(&set);
+    ipset_done(&set);
+
+    for (i = 0; i < 512; i++) {
+        scattered_ipv4(i, &addr);
+        fail_unless(ipset_stride_contains_ipv4(table, &addr) == expected[i],
+                    "Stride table gives wrong result for element %u", i);
+    }
+    cork_ipv4_init(&addr, "10.200.0.1");
+    fail_unless(ipset_stride_contains_ipv4(table, &addr),
+                "Stride table should contain network");
+    cork_ipv4_init(&addr, "172.16.15.255");
+    fail_unless(ipset_stride_contains_ipv4(table, &addr),
+                "Stride table should contain network");
+    cork_ipv4_init(&addr, "172.16.16.0");
+    fail_if(ipset_stride_contains_ipv4(table, &addr),
+            "Stride table shouldn't contain element");
+    cork_ipv6_init(&addr6, "fe80::1");
+    fail_if(ipset_stride_contains_ipv6(table, &addr6),
+            "Stride table shouldn't contain IPv6 address");
+
+    ipset_stride_table_free(table);
+}
+END_TEST
+
+START_TEST(test_ipv4_stride_02)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_stride_table  *table;
+    struct cork_ipv4  addr;
+
+    /* Sets that are a single terminal don't need any tables. */
+    ipset_init(&set);
+    table = ipset_compile_strides(&set);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    fail_if(ipset_stride_contains_ipv4(table, &addr),
+            "Empty stride table shouldn't contain element");
+    fail_unless(table->entry_count == 0,
+                "Empty stride table shouldn't have any entries");
+    ipset_stride_table_free(table);
+    ipset_done(&set);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * IPv6 tests
+ */
+
+START_TEST(test_ipv6_insert_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_if(ipset_ipv6_add(&set, &addr),
+            "Element should not be present");
+    fail_unless(ipset_ipv6_add(&set, &addr),
+                "Element should be present");
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_remove_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_if(ipset_ipv6_add(&set, &addr),
+            "Element should not be present");
+    fail_if(ipset_ipv6_remove(&set, &addr),
+            "Element should be present");
+    fail_unless(ipset_ipv6_remove(&set, &addr),
+                "Element should not be present");
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_insert_network_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_if(ipset_ipv6_add_network(&set, &addr, 32),
+            "Element should not be present");
+    fail_unless(ipset_ipv6_add_network(&set, &addr, 32),
+                "Element should be present");
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_remove_network_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_if(ipset_ipv6_add_network(&set, &addr, 32),
+            "ELement should not be present");
+    fail_if(ipset_ipv6_remove_network(&set, &addr, 32),
+            "Element should be present");
+    fail_unless(ipset_ipv6_remove_network(&set, &addr, 32),
+                "Element should not be present");
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_bad_cidr_prefix_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ipv6_add_network(&set, &addr, 129);
+    fail_unless(ipset_is_empty(&set),
+                "Bad CIDR prefix shouldn't change set");
+    cork_error_clear();
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_contains_01)
 {
     DESCRIBE_TEST;
     struct ip_set  set;
@@ -691,7 +1563,7 @@ START_TEST(test_ipv6_memory_size_1)
     cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
     ipset_ipv6_add(&set, &addr);
 
-    expected = 129 * sizeof(struct ipset_node);
+    expected = 129 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -713,7 +1585,7 @@ START_TEST(test_ipv6_memory_size_2)
     cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
     ipset_ipv6_add_network(&set, &addr, 24);
 
-    expected = 25 * sizeof(struct ipset_node);
+    expected = 25 * (sizeof(struct ipset_node) + sizeof(unsigned int));
     actual = ipset_memory_size(&set);
 
     fail_unless(expected == actual,
@@ -724,6 +1596,68 @@ START_TEST(test_ipv6_memory_size_2)
 }
 END_TEST
 
+START_TEST(test_ipv6_count_1)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+    struct ipset_uint128  count;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "2001:db8::");
+    ipset_ipv6_add_network(&set, &addr, 32);
+    cork_ipv6_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ipv6_add(&set, &addr);
+    cork_ipv6_init(&addr, "fe80::1:0");
+    ipset_ipv6_add_network(&set, &addr, 112);
+
+    count = ipset_ipv6_count(&set);
+    fail_unless(count.high == ((uint64_t) 1 << 32) &&
+                count.low == 1 + 65536,
+                "Got wrong count %" PRIu64 ":%" PRIu64,
+                count.high, count.low);
+    fail_unless(ipset_ipv4_count(&set) == 0,
+                "Expected IPv6 set to have no IPv4 addresses");
+
+    ipset_done(&set);
+}
+END_TEST
+
+START_TEST(test_ipv6_count_histogram_1)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct cork_ipv6  addr;
+    struct ipset_uint128  count;
+    struct ipset_uint128  *counts;
+    size_t  i;
+
+    ipset_init(&set);
+    cork_ipv6_init(&addr, "2001:db8:1::");
+    ipset_ipv6_add_network(&set, &addr, 48);
+    cork_ipv6_init(&addr, "2001:db8:2:3::1");
+    ipset_ipv6_add(&set, &addr);
+
+    cork_ipv6_init(&addr, "2001:db8::");
+    count = ipset_ipv6_count_in_network(&set, &addr, 32);
+    fail_unless(count.high == (1 << 16) && count.low == 1,
+                "Got wrong count for 2001:db8::/32");
+
+    counts = cork_calloc(65536, sizeof(struct ipset_uint128));
+    fail_if(ipset_ipv6_count_histogram(&set, &addr, 32, 48, counts),
+            "Could not build histogram");
+    for (i = 0; i < 65536; i++) {
+        uint64_t  high = (i == 1)? (1 << 16): 0;
+        uint64_t  low = (i == 2)? 1: 0;
+        fail_unless(counts[i].high == high && counts[i].low == low,
+                    "Got wrong count for bucket %zu", i);
+    }
+    free(counts);
+
+    ipset_done(&set);
+}
+END_TEST
+
 START_TEST(test_ipv6_store_01)
 {
     DESCRIBE_TEST;
@@ -771,38 +1705,1048 @@ START_TEST(test_ipv6_store_03)
 END_TEST
 
 
-/*-----------------------------------------------------------------------
- * Testing harness
- */
-
-Suite *
-ipset_suite()
+START_TEST(test_ipv6_build_sorted_01)
 {
-    Suite  *s = suite_create("ipset");
-    TCase  *tc_general = tcase_create("general");
-    tcase_add_test(tc_general, test_set_starts_empty);
-    tcase_add_test(tc_general, test_empty_sets_equal);
-    tcase_add_test(tc_general, test_store_empty);
-    suite_add_tcase(s, tc_general);
+    DESCRIBE_TEST;
+    static const char  *addrs[] = {
+        "fe80::", "fe80::1:0", "fe80::21e:c2ff:fe9f:e8e1", "ff02::"
+    };
+    static const unsigned int  prefixes[] = { 112, 112, 128, 16 };
+    struct ipset_ipv6_network  networks[4];
+    struct ip_set  set, expected;
+    size_t  i;
 
-    TCase  *tc_ipv4 = tcase_create("ipv4");
-    tcase_add_test(tc_ipv4, test_ipv4_insert_01);
-    tcase_add_test(tc_ipv4, test_ipv4_remove_01);
-    tcase_add_test(tc_ipv4, test_ipv4_insert_network_01);
-    tcase_add_test(tc_ipv4, test_ipv4_remove_network_01);
-    tcase_add_test(tc_ipv4, test_ipv4_bad_cidr_prefix_01);
-    tcase_add_test(tc_ipv4, test_ipv4_contains_01);
-    tcase_add_test(tc_ipv4, test_ipv4_contains_02);
-    tcase_add_test(tc_ipv4, test_ipv4_network_contains_01);
-    tcase_add_test(tc_ipv4, test_ipv4_equality_1);
+    ipset_init(&set);
+    ipset_init(&expected);
+    for (i = 0; i < 4; i++) {
+        cork_ipv6_init(&networks[i].address, addrs[i]);
+        networks[i].cidr_prefix = prefixes[i];
+        ipset_ipv6_add_network(&expected, &networks[i].address, prefixes[i]);
+    }
+
+    fail_unless(ipset_ipv6_build_from_sorted(&set, networks, 4) == 0,
+                "Could not build set");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Bulk-built set doesn't match incremental set");
+
+    /* Prefixes that are too long are an error. */
+    networks[0].cidr_prefix = 129;
+    fail_unless(ipset_ipv6_build_from_sorted(&set, networks, 4) == -1,
+                "Expected an error for a bad CIDR prefix");
+    cork_error_clear();
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_ipv6_add_many_01)
+{
+    DESCRIBE_TEST;
+    static const char  *addrs[] = {
+        "ff02::", "fe80::21e:c2ff:fe9f:e8e1", "fe80::1:0", "fe80::"
+    };
+    static const unsigned int  prefixes[] = { 16, 128, 112, 112 };
+    struct ipset_ipv6_network  networks[4];
+    struct ip_set  set, expected;
+    size_t  i;
+
+    ipset_init(&set);
+    ipset_init(&expected);
+    for (i = 0; i < 4; i++) {
+        cork_ipv6_init(&networks[i].address, addrs[i]);
+        networks[i].cidr_prefix = prefixes[i];
+        ipset_ipv6_add_network(&expected, &networks[i].address, prefixes[i]);
+    }
+
+    fail_unless(ipset_ipv6_add_many(&set, networks, 4) == 0,
+                "Could not add networks");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Batch-built set doesn't match incremental set");
+
+    ipset_ipv6_remove_network(&expected, &networks[2].address, 112);
+    fail_unless(ipset_ipv6_remove_many(&set, networks + 2, 1) == 0,
+                "Could not remove networks");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Batch-removed set doesn't match incremental set");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_ipv6_frozen_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_frozen  *frozen;
+    struct cork_ip  addr;
+
+    ipset_init(&set);
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ip_add(&set, &addr);
+    cork_ip_init(&addr, "2001:db8::");
+    ipset_ip_add_network(&set, &addr, 32);
+    frozen = ipset_freeze(&set);
+    ipset_done(&set);
+
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_unless(ipset_frozen_contains_ip(frozen, &addr),
+                "Frozen set should contain element");
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e2");
+    fail_if(ipset_frozen_contains_ip(frozen, &addr),
+            "Frozen set shouldn't contain element");
+    cork_ip_init(&addr, "2001:db8:1234::1");
+    fail_unless(ipset_frozen_contains_ip(frozen, &addr),
+                "Frozen set should contain network");
+    cork_ip_init(&addr, "192.168.1.100");
+    fail_if(ipset_frozen_contains_ip(frozen, &addr),
+            "Frozen set shouldn't contain IPv4 address");
+
+    ipset_frozen_free(frozen);
+}
+END_TEST
+
+
+START_TEST(test_ipv6_stride_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_stride_table  *table;
+    struct cork_ip  addr;
+
+    ipset_init(&set);
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ip_add(&set, &addr);
+    cork_ip_init(&addr, "2001:db8::");
+    ipset_ip_add_network(&set, &addr, 36);
+    cork_ip_init(&addr, "192.168.1.100");
+    ipset_ip_add(&set, &addr);
+    table = ipset_compile_strides(&set);
+    ipset_done(&set);
+
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_unless(ipset_stride_contains_ip(table, &addr),
+                "Stride table should contain element");
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e0");
+    fail_if(ipset_stride_contains_ip(table, &addr),
+            "Stride table shouldn't contain element");
+    cork_ip_init(&addr, "2001:db8:fff::1");
+    fail_unless(ipset_stride_contains_ip(table, &addr),
+                "Stride table should contain network");
+    cork_ip_init(&addr, "2001:db8:1000::1");
+    fail_if(ipset_stride_contains_ip(table, &addr),
+            "Stride table shouldn't contain element");
+    cork_ip_init(&addr, "192.168.1.100");
+    fail_unless(ipset_stride_contains_ip(table, &addr),
+                "Stride table should contain IPv4 address");
+
+    ipset_stride_table_free(table);
+}
+END_TEST
+
+
+START_TEST(test_ipv6_batch_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set;
+    struct ipset_frozen  *frozen;
+    struct cork_ipv6  addrs[100];
+    uint8_t  expected[100];
+    uint8_t  out[100];
+    unsigned int  i;
+
+    ipset_init(&set);
+    for (i = 0; i < 100; i++) {
+        uint32_t  words[4];
+        words[0] = CORK_UINT32_HOST_TO_BIG(0x20010db8);
+        words[1] = 0;
+        words[2] = scattered_word(i);
+        words[3] = CORK_UINT32_HOST_TO_BIG(i);
+        cork_ipv6_copy(&addrs[i], words);
+        if (i % 3 == 0) {
+            ipset_ipv6_add(&set, &addrs[i]);
+        }
+    }
+    for (i = 0; i < 100; i++) {
+        expected[i] = ipset_contains_ipv6(&set, &addrs[i]);
+    }
+
+    frozen = ipset_freeze(&set);
+    ipset_contains_ipv6_batch(&set, addrs, 100, out);
+    for (i = 0; i < 100; i++) {
+        fail_unless(out[i] == expected[i],
+                    "Batch lookup gives wrong result for element %u", i);
+    }
+    ipset_frozen_contains_ipv6_batch(frozen, addrs, 100, out);
+    for (i = 0; i < 100; i++) {
+        fail_unless(out[i] == expected[i],
+                    "Frozen batch lookup gives wrong result for element %u",
+                    i);
+    }
+
+    ipset_frozen_free(frozen);
+    ipset_done(&set);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Operator tests
+ */
+
+START_TEST(test_union_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set1, set2, expected;
+    struct cork_ipv4  addr1, addr2;
+    struct cork_ipv6  addr3;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "10.0.0.0");
+    cork_ipv6_init(&addr3, "fe80::21e:c2ff:fe9f:e8e1");
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &addr1);
+    ipset_ipv6_add(&set1, &addr3);
+
+    ipset_init(&set2);
+    ipset_ipv4_add_network(&set2, &addr2, 8);
+
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &addr1);
+    ipset_ipv6_add(&expected, &addr3);
+    ipset_ipv4_add_network(&expected, &addr2, 8);
+
+    ipset_union(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected {x,y} | {z} == {x,y,z}");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_intersection_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set1, set2, expected;
+    struct cork_ipv4  addr1, addr2;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.0.0");
+
+    ipset_init(&set1);
+    ipset_ipv4_add_network(&set1, &addr2, 16);
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &addr1);
+    cork_ipv4_init(&addr2, "10.0.0.1");
+    ipset_ipv4_add(&set2, &addr2);
+
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &addr1);
+
+    ipset_intersection(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected 192.168/16 & {x,y} == {x}");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_difference_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set1, set2, expected;
+    struct cork_ipv4  addr1, addr2;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.0.0");
+
+    ipset_init(&set1);
+    ipset_ipv4_add_network(&set1, &addr2, 16);
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &addr1);
+
+    ipset_init(&expected);
+    ipset_ipv4_add_network(&expected, &addr2, 16);
+    ipset_ipv4_remove(&expected, &addr1);
+
+    ipset_difference(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected 192.168/16 - {x} to remove x");
+    fail_if(ipset_contains_ipv4(&set1, &addr1),
+            "Removed element should not be present");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_symmetric_difference_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set1, set2, expected;
+    struct cork_ipv4  addr1, addr2, addr3;
+
+    cork_ipv4_init(&addr1, "192.168.1.100");
+    cork_ipv4_init(&addr2, "192.168.1.101");
+    cork_ipv4_init(&addr3, "192.168.1.102");
+
+    ipset_init(&set1);
+    ipset_ipv4_add(&set1, &addr1);
+    ipset_ipv4_add(&set1, &addr2);
+
+    ipset_init(&set2);
+    ipset_ipv4_add(&set2, &addr2);
+    ipset_ipv4_add(&set2, &addr3);
+
+    ipset_init(&expected);
+    ipset_ipv4_add(&expected, &addr1);
+    ipset_ipv4_add(&expected, &addr3);
+
+    ipset_symmetric_difference(&set1, &set2);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Expected {x,y} ^ {y,z} == {x,z}");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_union_self_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set, expected;
+    struct cork_ipv6  addr;
+
+    cork_ipv6_init(&addr, "fe80::");
+
+    ipset_init(&set);
+    ipset_ipv6_add_network(&set, &addr, 10);
+    ipset_init(&expected);
+    ipset_ipv6_add_network(&expected, &addr, 10);
+
+    ipset_union(&set, &set);
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Expected x | x == x");
+    ipset_symmetric_difference(&set, &set);
+    fail_unless(ipset_is_empty(&set),
+                "Expected x ^ x to be empty");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+
+START_TEST(test_invert_01)
+{
+    DESCRIBE_TEST;
+    struct ip_set  set, expected;
+    struct ipset_frozen  *frozen;
+    struct ipset_stride_table  *table;
+    struct cork_ip  addr;
+    uint32_t  addrs[20];
+    uint8_t  out[20];
+    ipset_node_id  root;
+    size_t  node_count;
+    unsigned int  i;
+
+    ipset_init(&set);
+    cork_ip_init(&addr, "192.168.0.0");
+    ipset_ip_add_network(&set, &addr, 16);
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ip_add(&set, &addr);
+    ipset_init(&expected);
+    ipset_union(&expected, &set);
+    root = set.set_bdd;
+    node_count = ipset_node_reachable_count(set.cache, set.set_bdd);
+
+    /* Inverting a set with complement edges doesn't create any nodes. */
+    ipset_invert(&set);
+    fail_if(ipset_is_equal(&set, &expected),
+            "Inverted set shouldn't equal the original");
+    fail_unless(ipset_node_reachable_count(set.cache, set.set_bdd) ==
+                node_count,
+                "Inverted set should share the original's nodes");
+
+    cork_ip_init(&addr, "192.168.1.100");
+    fail_if(ipset_contains_ip(&set, &addr),
+            "Inverted set shouldn't contain element");
+    cork_ip_init(&addr, "192.169.1.100");
+    fail_unless(ipset_contains_ip(&set, &addr),
+                "Inverted set should contain element");
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e1");
+    fail_if(ipset_contains_ip(&set, &addr),
+            "Inverted set shouldn't contain element");
+    cork_ip_init(&addr, "fe80::21e:c2ff:fe9f:e8e2");
+    fail_unless(ipset_contains_ip(&set, &addr),
+                "Inverted set should contain element");
+
+    /* The other lookup paths have to follow complement edges too. */
+    for (i = 0; i < 20; i++) {
+        addrs[i] = CORK_UINT32_HOST_TO_BIG(0xc0a70000 + i * 0x8000);
+    }
+    frozen = ipset_freeze(&set);
+    table = ipset_compile_strides(&set);
+    ipset_frozen_contains_ipv4_batch(frozen, addrs, 20, out);
+    for (i = 0; i < 20; i++) {
+        struct cork_ipv4  ip;
+        bool  in_set;
+        cork_ipv4_copy(&ip, &addrs[i]);
+        in_set = ipset_contains_ipv4(&set, &ip);
+        fail_unless(in_set == (i < 2 || i >= 4),
+                    "Inverted set gives wrong result for element %u", i);
+        fail_unless(out[i] == in_set,
+                    "Frozen batch lookup gives wrong result for element %u",
+                    i);
+        fail_unless(ipset_frozen_contains_ipv4(frozen, &ip) == in_set,
+                    "Frozen lookup gives wrong result for element %u", i);
+        fail_unless(ipset_stride_contains_ipv4(table, &ip) == in_set,
+                    "Stride lookup gives wrong result for element %u", i);
+    }
+    ipset_frozen_free(frozen);
+    ipset_stride_table_free(table);
+
+    test_round_trip(&set);
+
+    ipset_invert(&set);
+    fail_unless(set.set_bdd == root,
+                "Expected ~~x to have the same root as x");
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Expected ~~x == x");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+}
+END_TEST
+
+START_TEST(test_invert_02)
+{
+    DESCRIBE_TEST;
+    /* Saving a set with complement edges gives the same file as saving
+     * the same set from a cache without them. */
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_set  set1, set2;
+    struct cork_ip  addr;
+    struct temp_file  *temp_file1 = temp_file_new();
+    struct temp_file  *temp_file2 = temp_file_new();
+    long  size1, size2;
+    char  *buf1, *buf2;
+
+    ipset_init(&set1);
+    ipset_init_in_cache(&set2, cache);
+    cork_ip_init(&addr, "10.0.0.0");
+    ipset_ip_add_network(&set1, &addr, 8);
+    ipset_ip_add_network(&set2, &addr, 8);
+    cork_ip_init(&addr, "12.0.0.1");
+    ipset_ip_add(&set1, &addr);
+    ipset_ip_add(&set2, &addr);
+    cork_ip_init(&addr, "2001:db8::");
+    ipset_ip_add_network(&set1, &addr, 32);
+    ipset_ip_add_network(&set2, &addr, 32);
+    ipset_invert(&set1);
+    ipset_invert(&set2);
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Inverted sets should be equal");
+
+    temp_file_open_stream(temp_file1);
+    temp_file_open_stream(temp_file2);
+    fail_unless(ipset_save(temp_file1->stream, &set1) == 0,
+                "Could not save set");
+    fail_unless(ipset_save(temp_file2->stream, &set2) == 0,
+                "Could not save set");
+    size1 = ftell(temp_file1->stream);
+    size2 = ftell(temp_file2->stream);
+    fail_unless(size1 == size2,
+                "Saved sets have different sizes (%ld, %ld)", size1, size2);
+
+    buf1 = cork_malloc(size1);
+    buf2 = cork_malloc(size2);
+    fseek(temp_file1->stream, 0, SEEK_SET);
+    fseek(temp_file2->stream, 0, SEEK_SET);
+    fail_unless(fread(buf1, 1, size1, temp_file1->stream) == size1,
+                "Could not read saved set");
+    fail_unless(fread(buf2, 1, size2, temp_file2->stream) == size2,
+                "Could not read saved set");
+    fail_unless(memcmp(buf1, buf2, size1) == 0,
+                "Saved sets should be identical");
+
+    free(buf1);
+    free(buf2);
+    temp_file_free(temp_file1);
+    temp_file_free(temp_file2);
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Shared cache tests
+ */
+
+START_TEST(test_shared_cache_equality_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_set  set1, set2;
+    struct cork_ipv4  addr;
+
+    ipset_init_in_cache(&set1, cache);
+    ipset_init_in_cache(&set2, cache);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipset_ipv4_add_network(&set1, &addr, 24);
+    ipset_ipv4_add_network(&set2, &addr, 24);
+
+    fail_unless(set1.set_bdd == set2.set_bdd,
+                "Equal sets in the same cache should share a root");
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Expected {x} == {x}");
+
+    cork_ipv4_init(&addr, "10.0.0.1");
+    ipset_ipv4_add(&set2, &addr);
+    fail_if(ipset_is_equal(&set1, &set2),
+            "Expected {x} != {x,y}");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_shared_cache_done_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_set  set1, set2;
+    struct cork_ipv4  addr;
+
+    ipset_init_in_cache(&set1, cache);
+    ipset_init_in_cache(&set2, cache);
+    cork_ipv4_init(&addr, "192.168.1.0");
+    ipset_ipv4_add_network(&set1, &addr, 24);
+    ipset_ipv4_add_network(&set2, &addr, 24);
+
+    /* Freeing one set must leave the shared nodes intact. */
+    ipset_done(&set1);
+    fail_unless(ipset_contains_ipv4(&set2, &addr),
+                "Element should still be present");
+
+    ipset_done(&set2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_shared_cache_load_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new();
+    struct ip_set  set;
+    struct ip_set  *read_set;
+    struct cork_ipv4  addr;
+    struct cork_ipv6  addr6;
+
+    /* These two addresses have the same suffix after the first octet,
+     * so the set's BDD contains nodes with more than one parent. */
+    ipset_init_in_cache(&set, cache);
+    cork_ipv4_init(&addr, "12.0.0.1");
+    ipset_ipv4_add(&set, &addr);
+    cork_ipv4_init(&addr, "10.0.0.1");
+    ipset_ipv4_add(&set, &addr);
+    cork_ipv6_init(&addr6, "fe80::21e:c2ff:fe9f:e8e1");
+    ipset_ipv6_add_network(&set, &addr6, 64);
+
+    /* A copy in its own private cache */
+    struct ip_set  copy;
+    ipset_init(&copy);
+    ipset_union(&copy, &set);
+
+    struct temp_file  *temp_file = temp_file_new();
+    temp_file_open_stream(temp_file);
+    fail_unless(ipset_save(temp_file->stream, &set) == 0,
+                "Could not save set");
+    fflush(temp_file->stream);
+    fseek(temp_file->stream, 0, SEEK_SET);
+
+    read_set = ipset_load_into(cache, temp_file->stream);
+    fail_if(read_set == NULL,
+            "Could not read set");
+    fail_unless(read_set->set_bdd == set.set_bdd,
+                "Loaded set should share the original's root");
+
+    temp_file_free(temp_file);
+    ipset_done(&set);
+
+    /* Removing one of the addresses frees one of the shared node's
+     * parents, which must not free the shared node itself.  Then
+     * allocate some new nodes in the cache, which would overwrite any
+     * nodes that were freed by mistake. */
+    cork_ipv4_init(&addr, "12.0.0.1");
+    ipset_ipv4_remove(read_set, &addr);
+    ipset_ipv4_remove(&copy, &addr);
+
+    struct ip_set  other;
+    ipset_init_in_cache(&other, cache);
+    cork_ipv4_init(&addr, "172.16.0.0");
+    ipset_ipv4_add_network(&other, &addr, 12);
+    cork_ipv6_init(&addr6, "2001:db8::");
+    ipset_ipv6_add_network(&other, &addr6, 32);
+
+    fail_unless(ipset_is_equal(read_set, &copy),
+                "Loaded set not same after removing an element");
+    ipset_done(&other);
+    ipset_done(&copy);
+    ipset_free(read_set);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_sized_cache_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache =
+        ipset_node_cache_new_sized(3, IPSET_NODE_CACHE_HUGE_PAGES);
+    struct ip_set  set1, set2;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    ipset_node_cache_reserve(cache, 1000);
+    fail_unless(cork_array_size(&cache->chunks) == 125,
+                "Expected 125 chunks, got %zu",
+                cork_array_size(&cache->chunks));
+
+    ipset_init_in_cache(&set1, cache);
+    ipset_init(&set2);
+    for (i = 0; i < 200; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set1, &addr);
+        ipset_ipv4_add(&set2, &addr);
+    }
+
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Set should be the same in any cache");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_sized_cache_2)
+{
+    DESCRIBE_TEST;
+    /* Chunks this large fill a huge page, so they're mapped. */
+    struct ipset_node_cache  *cache =
+        ipset_node_cache_new_sized(18, IPSET_NODE_CACHE_HUGE_PAGES);
+    struct ip_set  set1, set2;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    ipset_init_in_cache(&set1, cache);
+    ipset_init(&set2);
+    for (i = 0; i < 200; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set1, &addr);
+        ipset_ipv4_add(&set2, &addr);
+    }
+
+    fail_unless(ipset_is_equal(&set1, &set2),
+                "Set should be the same in any cache");
+
+    ipset_done(&set1);
+    ipset_done(&set2);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_deferred_gc_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_DEFERRED_GC);
+    struct ip_set  set, expected;
+    struct cork_ipv4  addr;
+    size_t  node_count;
+
+    ipset_init_in_cache(&set, cache);
+    ipset_init(&expected);
+    cork_ipv4_init(&addr, "192.168.1.100");
+
+    /* Removing an element leaves its nodes dead, but not collected; and
+     * adding it back resurrects them. */
+    ipset_ipv4_add(&set, &addr);
+    node_count = cache->unique_table_count;
+    ipset_ipv4_remove(&set, &addr);
+    fail_unless(cache->dead_count > 0,
+                "Expected some dead nodes");
+    fail_unless(cache->unique_table_count == node_count,
+                "Expected dead nodes to stay in the cache");
+    ipset_ipv4_add(&set, &addr);
+    fail_unless(cache->dead_count == 0,
+                "Expected dead nodes to be revived, got %zu",
+                cache->dead_count);
+    fail_unless(cache->unique_table_count == node_count,
+                "Expected %zu nodes, got %zu",
+                node_count, cache->unique_table_count);
+
+    /* An explicit collection frees everything that's dead. */
+    ipset_ipv4_add(&expected, &addr);
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set, &addr, 8);
+    ipset_ipv4_remove_network(&set, &addr, 8);
+    fail_unless(ipset_node_cache_gc(cache) > 0,
+                "Expected garbage collection to reclaim some nodes");
+    fail_unless(cache->dead_count == 0,
+                "Expected no dead nodes after collection");
+    fail_unless(cache->unique_table_count == node_count,
+                "Expected %zu nodes, got %zu",
+                node_count, cache->unique_table_count);
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Set not same after garbage collection");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+    fail_unless(ipset_node_cache_gc(cache) == node_count,
+                "Expected final collection to reclaim %zu nodes",
+                node_count);
+    fail_unless(cache->unique_table_count == 0,
+                "Expected empty cache after final collection");
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+START_TEST(test_deferred_gc_2)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_DEFERRED_GC);
+    struct ip_set  set, expected;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    /* With a small threshold, inserts trigger collections on their
+     * own. */
+    ipset_node_cache_set_gc_threshold(cache, 64);
+    ipset_init_in_cache(&set, cache);
+    ipset_init(&expected);
+    for (i = 0; i < 500; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set, &addr);
+        if (i % 2 == 0) {
+            ipset_ipv4_add(&expected, &addr);
+        } else {
+            ipset_ipv4_remove(&set, &addr);
+        }
+    }
+
+    fail_unless(cache->gc_runs > 0,
+                "Expected at least one garbage collection");
+    fail_unless(cache->dead_count < 64 + 33,
+                "Too many dead nodes (%zu)", cache->dead_count);
+    fail_unless(ipset_is_equal(&set, &expected),
+                "Set not same after garbage collections");
+
+    ipset_done(&set);
+    ipset_done(&expected);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+START_TEST(test_concurrent_cache_1)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_CONCURRENT);
+    struct ip_set  set1, set2, expected;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    /* A concurrent cache behaves just like any other when only one
+     * thread uses it. */
+    fail_unless(cache->chunk_bit_size == IPSET_CONCURRENT_MIN_CHUNK_BIT_SIZE,
+                "Concurrent cache should use larger chunks");
+    ipset_init_in_cache(&set1, cache);
+    ipset_init_in_cache(&set2, cache);
+    ipset_init(&expected);
+    for (i = 0; i < 1000; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&set1, &addr);
+        ipset_ipv4_add(&expected, &addr);
+        if (i % 2 == 0) {
+            ipset_ipv4_add(&set2, &addr);
+        }
+    }
+    ipset_union(&set2, &set1);
+    fail_unless(set1.set_bdd == set2.set_bdd,
+                "Equal sets in the same cache should share their root");
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Set in concurrent cache has wrong contents");
+
+    /* Nodes are only reclaimed when we ask. */
+    ipset_done(&set2);
+    ipset_node_cache_set_gc_threshold(cache, 1);
+    cork_ipv4_init(&addr, "10.0.0.0");
+    ipset_ipv4_add_network(&set1, &addr, 8);
+    ipset_ipv4_add_network(&expected, &addr, 8);
+    fail_unless(cache->gc_runs == 0,
+                "Concurrent cache shouldn't collect garbage on its own");
+    fail_unless(ipset_node_cache_gc(cache) > 0,
+                "Expected garbage collection to reclaim nodes");
+
+    /* The set uses a shared cache, so we have to compact the cache
+     * directly. */
+    fail_unless(ipset_compact(&set1) == -1,
+                "Shouldn't compact a shared cache through one set");
+    cork_error_clear();
+    ipset_node_id  *roots[] = { &set1.set_bdd };
+    ipset_node_cache_compact(cache, roots, 1);
+    fail_unless(cache->unique_table_count ==
+                ipset_node_reachable_count(cache, set1.set_bdd),
+                "Compacted cache should only contain live nodes");
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Set not same after compaction");
+    cork_ipv4_init(&addr, "192.168.0.1");
+    ipset_ipv4_add(&set1, &addr);
+    ipset_ipv4_add(&expected, &addr);
+    fail_unless(ipset_is_equal(&set1, &expected),
+                "Set not same after adding to compacted cache");
+
+    ipset_done(&set1);
+    ipset_done(&expected);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+#define CONCURRENT_THREAD_COUNT  4
+#define CONCURRENT_ELEMENT_COUNT  2000
+
+struct concurrent_worker {
+    pthread_t  thread;
+    struct ip_set  set;
+    unsigned int  seed;
+};
+
+static void *
+concurrent_worker(void *user_data)
+{
+    struct concurrent_worker  *worker = user_data;
+    struct ip_set  other;
+    struct cork_ipv4  addr;
+    unsigned int  i;
+
+    /* Every worker adds the same elements, in a different order, so
+     * that they're all racing to create the same nodes. */
+    ipset_init_in_cache(&other, worker->set.cache);
+    for (i = 0; i < CONCURRENT_ELEMENT_COUNT; i++) {
+        unsigned int  j = (i * 7 + worker->seed * 613) %
+            CONCURRENT_ELEMENT_COUNT;
+        scattered_ipv4(j, &addr);
+        if (j % 2 == 0) {
+            ipset_ipv4_add(&worker->set, &addr);
+        } else {
+            ipset_ipv4_add(&other, &addr);
+        }
+    }
+    ipset_union(&worker->set, &other);
+    ipset_done(&other);
+    return NULL;
+}
+
+START_TEST(test_concurrent_cache_2)
+{
+    DESCRIBE_TEST;
+    struct ipset_node_cache  *cache = ipset_node_cache_new_sized
+        (IPSET_BDD_NODE_CACHE_BIT_SIZE, IPSET_NODE_CACHE_CONCURRENT);
+    struct concurrent_worker  workers[CONCURRENT_THREAD_COUNT];
+    struct ip_set  expected;
+    struct cork_ipv4  addr;
+    size_t  node_count;
+    unsigned int  i;
+
+    ipset_init(&expected);
+    for (i = 0; i < CONCURRENT_ELEMENT_COUNT; i++) {
+        scattered_ipv4(i, &addr);
+        ipset_ipv4_add(&expected, &addr);
+    }
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++) {
+        ipset_init_in_cache(&workers[i].set, cache);
+        workers[i].seed = i;
+        fail_unless(pthread_create
+                    (&workers[i].thread, NULL, concurrent_worker,
+                     &workers[i]) == 0,
+                    "Could not start thread");
+    }
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    /* Since the BDDs are still reduced, all of the workers should end
+     * up with the same root node. */
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++) {
+        fail_unless(workers[i].set.set_bdd == workers[0].set.set_bdd,
+                    "Worker %u has a different root node", i);
+        fail_unless(ipset_is_equal(&workers[i].set, &expected),
+                    "Worker %u built the wrong set", i);
+    }
+
+    /* And once we've collected the garbage, the only nodes left are
+     * the ones in that one BDD. */
+    ipset_node_cache_gc(cache);
+    node_count = ipset_node_reachable_count(cache, workers[0].set.set_bdd);
+    fail_unless(cache->unique_table_count == node_count,
+                "Expected %zu nodes in cache, got %zu",
+                node_count, cache->unique_table_count);
+
+    for (i = 0; i < CONCURRENT_THREAD_COUNT; i++) {
+        ipset_done(&workers[i].set);
+    }
+    ipset_done(&expected);
+    ipset_node_cache_free(cache);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Publishing tests
+ */
+
+START_TEST(test_publish_01)
+{
+    DESCRIBE_TEST;
+    struct ipset_publisher  *publisher = ipset_publisher_new(2);
+    struct ipset_reader  *reader1;
+    struct ipset_reader  *reader2;
+    const struct ipset_frozen  *old_version;
+    const struct ipset_frozen  *new_version;
+    struct ip_set  set;
+    struct cork_ipv4  addr;
+
+    reader1 = ipset_publisher_add_reader(publisher);
+    reader2 = ipset_publisher_add_reader(publisher);
+    fail_if(reader1 == NULL || reader2 == NULL, "Could not add readers");
+    fail_unless((uintptr_t) reader1 % IPSET_CACHE_LINE_SIZE == 0 &&
+                (uintptr_t) reader2 % IPSET_CACHE_LINE_SIZE == 0,
+                "Readers should each start a cache line");
+    fail_unless(ipset_publisher_add_reader(publisher) == NULL,
+                "Shouldn't be able to add too many readers");
+    cork_error_clear();
+
+    ipset_init(&set);
+    cork_ipv4_init(&addr, "192.168.1.100");
+    ipset_ipv4_add(&set, &addr);
+
+    /* A reader that starts a lookup before a publish keeps seeing the
+     * old version, which isn't reclaimed until it's done. */
+    old_version = ipset_reader_enter(reader1);
+    fail_if(ipset_frozen_contains_ipv4(old_version, &addr),
+            "Initial version shouldn't contain element");
+    ipset_publish(publisher, &set);
+    fail_unless(ipset_publisher_reclaim(publisher) == 1,
+                "Old version shouldn't be reclaimed yet");
+    fail_if(ipset_frozen_contains_ipv4(old_version, &addr),
+            "Old version shouldn't contain element");
+
+    new_version = ipset_reader_enter(reader2);
+    fail_unless(ipset_frozen_contains_ipv4(new_version, &addr),
+                "New version should contain element");
+    ipset_reader_leave(reader1);
+    fail_unless(ipset_publisher_reclaim(publisher) == 0,
+                "Old version should be reclaimed");
+
+    /* A reader that's still using the version that's replaced doesn't
+     * hold up any earlier versions. */
+    ipset_ipv4_remove(&set, &addr);
+    ipset_publish(publisher, &set);
+    fail_unless(ipset_publisher_reclaim(publisher) == 1,
+                "Replaced version shouldn't be reclaimed yet");
+    ipset_reader_leave(reader2);
+    ipset_publisher_synchronize(publisher);
+    fail_unless(cork_array_size(&publisher->retired) == 0,
+                "All versions should be reclaimed");
+
+    new_version = ipset_reader_enter(reader1);
+    fail_if(ipset_frozen_contains_ipv4(new_version, &addr),
+            "Latest version shouldn't contain element");
+    ipset_reader_leave(reader1);
+
+    /* Freed reader slots can be claimed again. */
+    ipset_reader_free(reader2);
+    reader2 = ipset_publisher_add_reader(publisher);
+    fail_if(reader2 == NULL, "Could not reuse reader slot");
+
+    ipset_reader_free(reader1);
+    ipset_reader_free(reader2);
+    ipset_done(&set);
+    ipset_publisher_free(publisher);
+}
+END_TEST
+
+
+/*-----------------------------------------------------------------------
+ * Testing harness
+ */
+
+Suite *
+ipset_suite()
+{
+    Suite  *s = suite_create("ipset");
+    TCase  *tc_general = tcase_create("general");
+    tcase_add_test(tc_general, test_set_starts_empty);
+    tcase_add_test(tc_general, test_empty_sets_equal);
+    tcase_add_test(tc_general, test_store_empty);
+    tcase_add_test(tc_general, test_store_v2_bad_01);
+    suite_add_tcase(s, tc_general);
+
+    TCase  *tc_ipv4 = tcase_create("ipv4");
+    tcase_add_test(tc_ipv4, test_ipv4_insert_01);
+    tcase_add_test(tc_ipv4, test_ipv4_remove_01);
+    tcase_add_test(tc_ipv4, test_ipv4_insert_network_01);
+    tcase_add_test(tc_ipv4, test_ipv4_remove_network_01);
+    tcase_add_test(tc_ipv4, test_ipv4_bad_cidr_prefix_01);
+    tcase_add_test(tc_ipv4, test_ipv4_contains_01);
+    tcase_add_test(tc_ipv4, test_ipv4_contains_02);
+    tcase_add_test(tc_ipv4, test_ipv4_network_contains_01);
+    tcase_add_test(tc_ipv4, test_ipv4_unique_table_1);
+    tcase_add_test(tc_ipv4, test_ipv4_compact_1);
+    tcase_add_test(tc_ipv4, test_ipv4_equality_1);
     tcase_add_test(tc_ipv4, test_ipv4_equality_2);
     tcase_add_test(tc_ipv4, test_ipv4_equality_3);
     tcase_add_test(tc_ipv4, test_ipv4_inequality_1);
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_1);
     tcase_add_test(tc_ipv4, test_ipv4_memory_size_2);
+    tcase_add_test(tc_ipv4, test_ipv4_count_1);
+    tcase_add_test(tc_ipv4, test_ipv4_count_in_network_1);
+    tcase_add_test(tc_ipv4, test_ipv4_count_histogram_1);
     tcase_add_test(tc_ipv4, test_ipv4_store_01);
     tcase_add_test(tc_ipv4, test_ipv4_store_02);
     tcase_add_test(tc_ipv4, test_ipv4_store_03);
+    tcase_add_test(tc_ipv4, test_ipv4_store_04);
+    tcase_add_test(tc_ipv4, test_ipv4_store_v2_01);
+    tcase_add_test(tc_ipv4, test_ipv4_build_sorted_01);
+    tcase_add_test(tc_ipv4, test_ipv4_build_sorted_02);
+    tcase_add_test(tc_ipv4, test_ipv4_add_many_01);
+    tcase_add_test(tc_ipv4, test_ipv4_add_many_02);
+    tcase_add_test(tc_ipv4, test_ipv4_frozen_01);
+    tcase_add_test(tc_ipv4, test_ipv4_frozen_02);
+    tcase_add_test(tc_ipv4, test_ipv4_batch_01);
+    tcase_add_test(tc_ipv4, test_ipv4_stride_01);
+    tcase_add_test(tc_ipv4, test_ipv4_stride_02);
     suite_add_tcase(s, tc_ipv4);
 
     TCase  *tc_ipv6 = tcase_create("ipv6");
@@ -820,11 +2764,44 @@ ipset_suite()
     tcase_add_test(tc_ipv6, test_ipv6_inequality_1);
     tcase_add_test(tc_ipv6, test_ipv6_memory_size_1);
     tcase_add_test(tc_ipv6, test_ipv6_memory_size_2);
+    tcase_add_test(tc_ipv6, test_ipv6_count_1);
+    tcase_add_test(tc_ipv6, test_ipv6_count_histogram_1);
     tcase_add_test(tc_ipv6, test_ipv6_store_01);
     tcase_add_test(tc_ipv6, test_ipv6_store_02);
     tcase_add_test(tc_ipv6, test_ipv6_store_03);
+    tcase_add_test(tc_ipv6, test_ipv6_build_sorted_01);
+    tcase_add_test(tc_ipv6, test_ipv6_add_many_01);
+    tcase_add_test(tc_ipv6, test_ipv6_frozen_01);
+    tcase_add_test(tc_ipv6, test_ipv6_batch_01);
+    tcase_add_test(tc_ipv6, test_ipv6_stride_01);
     suite_add_tcase(s, tc_ipv6);
 
+    TCase  *tc_operators = tcase_create("operators");
+    tcase_add_test(tc_operators, test_union_01);
+    tcase_add_test(tc_operators, test_intersection_01);
+    tcase_add_test(tc_operators, test_difference_01);
+    tcase_add_test(tc_operators, test_symmetric_difference_01);
+    tcase_add_test(tc_operators, test_union_self_01);
+    tcase_add_test(tc_operators, test_invert_01);
+    tcase_add_test(tc_operators, test_invert_02);
+    suite_add_tcase(s, tc_operators);
+
+    TCase  *tc_shared = tcase_create("shared-cache");
+    tcase_add_test(tc_shared, test_shared_cache_equality_1);
+    tcase_add_test(tc_shared, test_shared_cache_done_1);
+    tcase_add_test(tc_shared, test_shared_cache_load_1);
+    tcase_add_test(tc_shared, test_sized_cache_1);
+    tcase_add_test(tc_shared, test_sized_cache_2);
+    tcase_add_test(tc_shared, test_deferred_gc_1);
+    tcase_add_test(tc_shared, test_deferred_gc_2);
+    tcase_add_test(tc_shared, test_concurrent_cache_1);
+    tcase_add_test(tc_shared, test_concurrent_cache_2);
+    suite_add_tcase(s, tc_shared);
+
+    TCase  *tc_publish = tcase_create("publish");
+    tcase_add_test(tc_publish, test_publish_01);
+    suite_add_tcase(s, tc_publish);
+
     return s;
 }
 